@@ -0,0 +1,398 @@
+#pragma once
+
+/* Coroutine lookups(C++20): async_search() returns SearchTask, which is
+ * suspended at prefetch points of in-memory maps and at bucket reads of
+ * disk resident ones, LookupScheduler interleaves many of such tasks on
+ * one thread, so their cache misses and I/O overlap.
+ * Header is empty for older standards.
+ */
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include "diskmap.hpp"
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// number of lookups kept in flight by async_search_batch by default
+int const ASYNC_SEARCH_INFLIGHT = 32;
+
+/* Lookup coroutine: it is started by scheduler(spawn) or by co_await
+ * from other task, which is resumed as soon as lookup finishes
+ */
+template<typename T>
+class SearchTask
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+    /* resume awaiting task only if it is really suspended on this one,
+     * otherwise return to resumer(scheduler or inline start in co_await)
+     */
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend( handle_t h ) noexcept
+        {
+            promise_type &p = h.promise();
+            return p.suspended ? p.continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type
+    {
+        std::optional<T>        value;
+        std::exception_ptr      error;
+        std::coroutine_handle<> continuation;
+        bool                    suspended = false; // awaiting task is suspended
+
+        SearchTask get_return_object() { return SearchTask(handle_t::from_promise(*this)); }
+        // started by scheduler or awaiting task
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // frame is kept until result is taken
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value( T v ) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    /* start task inline, awaiting one is suspended only if task is not finished
+     * by then, so lookups finished without suspension(cache hits, filter rejects)
+     * do not nest stack frames
+     */
+    auto operator co_await() const noexcept
+    {
+        struct Awaiter
+        {
+            handle_t h;
+            bool await_ready() const noexcept { return h.done(); }
+            bool await_suspend( std::coroutine_handle<> cont ) noexcept
+            {
+                h.promise().continuation = cont;
+                h.resume();
+                if( h.done() )
+                    return false;
+                h.promise().suspended = true;
+                return true;
+            }
+            T await_resume() const
+            {
+                if( h.promise().error )
+                    std::rethrow_exception(h.promise().error);
+                return *h.promise().value;
+            }
+        };
+        return Awaiter{ h_ };
+    }
+
+    SearchTask( SearchTask &&other ) noexcept : h_(other.h_) { other.h_ = nullptr; }
+    SearchTask( SearchTask const & ) = delete;
+    SearchTask& operator = ( SearchTask const & ) = delete;
+
+    ~SearchTask()
+    {
+        if( h_ )
+            h_.destroy();
+    }
+
+    bool done() const { return h_.done(); }
+    std::coroutine_handle<> handle() const { return h_; }
+
+    // result of finished task, exception of lookup is rethrown
+    T get() const
+    {
+        if( !h_.done() )
+            throw std::runtime_error("[SearchTask] task is not finished");
+        if( h_.promise().error )
+            std::rethrow_exception(h_.promise().error);
+        return *h_.promise().value;
+    }
+
+private:
+    explicit SearchTask( handle_t h ) : h_(h) {}
+
+    handle_t    h_;
+};
+
+/* Runs suspended lookups round-robin on calling thread. Disk reads are
+ * done by io_threads(if any), task is resumed after read completion,
+ * without them read is done in place.
+ */
+class LookupScheduler
+{
+public:
+    explicit LookupScheduler( size_t io_threads = 0 )
+        : pending_io_(0)
+        , stop_(false)
+    {
+        for( size_t t = 0; t < io_threads; ++t )
+            io_threads_.emplace_back([this]() { io_loop(); });
+    }
+
+    LookupScheduler( LookupScheduler const & ) = delete;
+    LookupScheduler& operator = ( LookupScheduler const & ) = delete;
+
+    ~LookupScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        io_cv_.notify_all();
+        for( auto &t : io_threads_ )
+            t.join();
+    }
+
+    template<typename T>
+    void spawn( SearchTask<T> const &task ) { ready_.push_back(task.handle()); }
+
+    // resume tasks until all of them are finished
+    void run()
+    {
+        for( ;; )
+        {
+            while( !ready_.empty() )
+            {
+                std::coroutine_handle<> h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+            if( 0 == pending_io_ )
+                return;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_cv_.wait(lock, [this]() { return !completed_.empty(); });
+            for( auto h : completed_ )
+                ready_.push_back(h);
+            pending_io_ -= completed_.size();
+            completed_.clear();
+        }
+    }
+
+    // let other tasks run, prefetch issued before it completes meanwhile
+    auto yield()
+    {
+        struct Awaiter
+        {
+            LookupScheduler *sched;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend( std::coroutine_handle<> h ) { sched->ready_.push_back(h); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ this };
+    }
+
+    // read file range, result is true on success
+    auto read( detail::PReadFile const &file, void *p, size_t sz, uint64_t offs )
+    {
+        struct Awaiter
+        {
+            LookupScheduler             *sched;
+            IoRequest                    req;
+            bool await_ready()
+            {
+                if( !sched->io_threads_.empty() )
+                    return false;
+                req.ok = req.file->read(req.p, req.sz, req.offs);
+                return true;
+            }
+            void await_suspend( std::coroutine_handle<> h )
+            {
+                req.h = h;
+                sched->submit(&req);
+            }
+            bool await_resume() const noexcept { return req.ok; }
+        };
+        return Awaiter{ this, IoRequest{ &file, p, sz, offs, false, nullptr } };
+    }
+
+private:
+    struct IoRequest
+    {
+        detail::PReadFile const    *file;
+        void                       *p;
+        size_t                      sz;
+        uint64_t                    offs;
+        bool                        ok;
+        std::coroutine_handle<>     h;
+    };
+
+    void submit( IoRequest *req )
+    {
+        ++pending_io_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            io_queue_.push_back(req);
+        }
+        io_cv_.notify_one();
+    }
+
+    void io_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for( ;; )
+        {
+            io_cv_.wait(lock, [this]() { return stop_ || !io_queue_.empty(); });
+            if( io_queue_.empty() )
+                return;
+            IoRequest *req = io_queue_.front();
+            io_queue_.pop_front();
+
+            lock.unlock();
+            req->ok = req->file->read(req->p, req->sz, req->offs);
+            lock.lock();
+
+            completed_.push_back(req->h);
+            done_cv_.notify_one();
+        }
+    }
+
+    std::deque<std::coroutine_handle<>>     ready_;
+    size_t                                  pending_io_; // owned by run() thread
+    std::mutex                              mutex_;
+    std::condition_variable                 io_cv_;
+    std::condition_variable                 done_cv_;
+    std::deque<IoRequest*>                  io_queue_;
+    std::vector<std::coroutine_handle<>>    completed_;
+    bool                                    stop_;
+    std::vector<std::thread>                io_threads_;
+};
+
+// access to searchers internals for coroutine lookups
+struct SearcherAccess
+{
+    template<typename Key, typename Value>
+    static void prefetch_bucket( HAMapSearcher<Key, Value> const &s, uint8_t const *bucket, uint32_t nkeys )
+    {
+        Key const *bkeys = reinterpret_cast<Key const*>(bucket);
+        if( BUCKET_LAYOUT_SORTED == s.layout_ && SEARCH_MODE_BINARY == s.mode_ )
+            __builtin_prefetch(bkeys + (nkeys >> 1));
+        else
+            __builtin_prefetch(bkeys);
+    }
+
+    template<typename Key, typename Value>
+    static void prefetch_bucket( HACMapSearcher<Key, Value> const &s, uint8_t const *bucket, uint32_t nkeys )
+    {
+        size_t const mid_bit = size_t(nkeys >> 1) * s.key_bits_store_;
+        if( s.bucket_key_bits_ )
+            __builtin_prefetch(bucket);
+        __builtin_prefetch(bucket + (mid_bit >> 3));
+    }
+
+    template<typename Searcher>
+    static detail::BucketIndex const& index( Searcher const &s ) { return s.bi_; }
+
+    template<typename Searcher, typename Key>
+    static auto search_bucket( Searcher const &s, Key k, uint8_t const *bucket, uint32_t nkeys )
+    {
+        return s.search_bucket(k, bucket, nkeys);
+    }
+
+    template<typename S, typename Key, typename Value>
+    static auto get_bucket( DiskSearcher<S, Key, Value> const &s, size_t i ) { return s.get_bucket(i); }
+
+    template<typename S, typename Key, typename Value>
+    static Key get_mask( DiskSearcher<S, Key, Value> const &s ) { return s.mask_; }
+
+    template<typename S, typename Key, typename Value>
+    static S const& get_searcher( DiskSearcher<S, Key, Value> const &s ) { return s.srch_; }
+
+    template<typename S, typename Key, typename Value>
+    static detail::PReadFile const& get_file( DiskSearcher<S, Key, Value> const &s ) { return s.file_; }
+
+    template<typename S, typename Key, typename Value>
+    static detail::BucketCache* get_cache( DiskSearcher<S, Key, Value> const &s ) { return s.cache_.get(); }
+};
+
+/* in-memory lookup: suspends after prefetch of directory entry
+ * and after prefetch of the first probe of bucket search
+ */
+template<typename Key, typename Value, template<typename, typename> class Searcher>
+SearchTask<std::optional<Value>> async_search( Searcher<Key, Value> const &srch, LookupScheduler &sched, Key k )
+{
+    detail::BucketIndex const &bi = SearcherAccess::index(srch);
+    size_t const i = k & bi.get_mask();
+    bi.prefetch(i);
+    bi.prefetch_filter(i, k);
+    co_await sched.yield();
+
+    if( !bi.may_contain(i, k) )
+        co_return std::nullopt;
+    auto const p = bi.get_unpacked(i);
+    SearcherAccess::prefetch_bucket(srch, p.first, p.second);
+    co_await sched.yield();
+
+    co_return detail::to_optional(SearcherAccess::search_bucket(srch, k, p.first, p.second));
+}
+
+// disk resident lookup: suspends until bucket is read, cached bucket is used as is
+template<typename S, typename Key, typename Value>
+SearchTask<std::optional<Value>> async_search( DiskSearcher<S, Key, Value> const &srch, LookupScheduler &sched, Key k )
+{
+    size_t const i = k & SearcherAccess::get_mask(srch);
+    auto const b = SearcherAccess::get_bucket(srch, i);
+    if( 0 == b.nkeys || !SearcherAccess::index(SearcherAccess::get_searcher(srch)).may_contain(i, k) )
+        co_return std::nullopt;
+
+    detail::BucketCache *cache = SearcherAccess::get_cache(srch);
+    detail::BucketCache::buffer_t buf = cache ? cache->get(i) : detail::BucketCache::buffer_t();
+    if( !buf )
+    {
+        auto rd = std::make_shared<detail::BucketCache::bucket_t>((b.size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        if( !co_await sched.read(SearcherAccess::get_file(srch), rd->data(), b.size, b.offset) )
+            throw std::runtime_error("[async_search] bucket read failed");
+        buf = rd;
+        if( cache )
+            cache->put(i, buf);
+    }
+
+    uint8_t const *bucket = reinterpret_cast<uint8_t const*>(buf->data());
+    co_return detail::to_optional(SearcherAccess::search_bucket(SearcherAccess::get_searcher(srch), k, bucket, b.nkeys));
+}
+
+// lookup slot of async_search_batch: takes the next key once its lookup finishes
+template<typename Searcher, typename Key, typename Value>
+SearchTask<size_t> async_search_slot( Searcher const &srch, LookupScheduler &sched, Key const *keys, size_t n,
+                                      std::optional<Value> *out_values, size_t &next )
+{
+    size_t nfound = 0;
+    for( size_t i = next++; i < n; i = next++ )
+    {
+        out_values[i] = co_await async_search(srch, sched, keys[i]);
+        nfound += out_values[i].has_value();
+    }
+    co_return nfound;
+}
+
+/* out_values[i] = search(keys[i]), inflight lookups are interleaved:
+ * a new one is started as soon as any of them finishes
+ * return number of found keys
+ */
+template<typename Searcher, typename Key, typename Value>
+size_t async_search_batch( Searcher const &srch, LookupScheduler &sched, Key const *keys, size_t n,
+                           std::optional<Value> *out_values, size_t inflight = ASYNC_SEARCH_INFLIGHT )
+{
+    size_t next = 0;
+    std::vector<SearchTask<size_t>> slots;
+    size_t const nslots = std::min(n, std::max(size_t(1), inflight));
+    slots.reserve(nslots);
+    for( size_t i = 0; i < nslots; ++i )
+    {
+        slots.push_back(async_search_slot(srch, sched, keys, n, out_values, next));
+        sched.spawn(slots.back());
+    }
+    sched.run();
+
+    size_t nfound = 0;
+    for( auto const &s : slots )
+        nfound += s.get();
+    return nfound;
+}
+
+#endif // __cpp_impl_coroutine
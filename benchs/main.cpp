@@ -102,6 +102,19 @@ size_t get_memory_usage( HACMapSearcher<K, V> const *m )
     return m->get_mem_size();
 }
 
+// adapter to bench batched lookups of the wrapped searcher
+template<typename MapT>
+struct BatchSearch
+{
+    MapT const *m;
+};
+
+template<typename MapT>
+size_t get_memory_usage( BatchSearch<MapT> const *b )
+{
+    return get_memory_usage(b->m);
+}
+
 template<typename K, typename V>
 size_t get_memory_usage( std::vector<std::pair<K, V>> const *m )
 {
@@ -271,7 +284,7 @@ static uint32_t bench_func
     {
         K k = i;
         
-        V const *found = m->search(k);
+        auto found = m->search(k);
         
         if( found )
             cs += *found;
@@ -281,6 +294,39 @@ static uint32_t bench_func
     return cs;
 }
 
+template<typename K, typename V, typename MapT>
+static uint32_t bench_func
+( 
+    size_t from, 
+    size_t to, 
+    std::vector<std::pair<K, V>> const &src, 
+    BatchSearch<MapT> const *b
+)
+{
+    size_t const batch_size = 256;
+    K keys[batch_size];
+    // value pointer or optional value, depending on searcher
+    decltype(b->m->search(K())) found[batch_size];
+    uint32_t cs = 0;
+    
+    for( size_t i = from; i < to; i += batch_size )
+    {
+        size_t const n = std::min(batch_size, to - i);
+        for( size_t j = 0; j < n; ++j )
+            keys[j] = i + j;
+
+        b->m->search_batch(keys, n, found);
+
+        for( size_t j = 0; j < n; ++j )
+        {
+            if( found[j] )
+                cs += *found[j];
+        }
+    }
+    
+    return cs;
+}
+
 template<typename K, typename V, typename MapT>
 static void bench_impl
 (
@@ -349,6 +395,23 @@ static void bench( size_t from, size_t to )
         HAMapSearcher<K, V> srch(map);
         map.clear();
         bench_impl<K, V>(from, to, src, &srch, "eh_umap");
+        BatchSearch<HAMapSearcher<K, V>> batch{&srch};
+        bench_impl<K, V>(from, to, src, &batch, "eh_umap_batch");
+        srch.set_search_mode(SEARCH_MODE_INTERPOLATION);
+        bench_impl<K, V>(from, to, src, &srch, "eh_umap_interp");
+    }
+
+    {
+        HAMapIndexer<K, V> map(src.size());
+        map.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        for( auto const &p : src )
+        {
+            map.add(p);
+        }
+        
+        HAMapSearcher<K, V> srch(map);
+        map.clear();
+        bench_impl<K, V>(from, to, src, &srch, "eh_umap_eytzinger");
     }
     
     /*
@@ -387,6 +450,10 @@ static void bench( size_t from, size_t to )
         HACMapSearcher<K, V> srch(map);
         map.clear();
         bench_impl<K, V>(from, to, src, &srch, "eh_umap_compr");
+        BatchSearch<HACMapSearcher<K, V>> batch{&srch};
+        bench_impl<K, V>(from, to, src, &batch, "eh_umap_compr_batch");
+        srch.set_search_mode(SEARCH_MODE_INTERPOLATION);
+        bench_impl<K, V>(from, to, src, &srch, "eh_umap_compr_interp");
     }
 }
 
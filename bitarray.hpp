@@ -2,6 +2,25 @@
 
 #include <stdint.h>
 #include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* AVX2 bulk decode is compiled with function level target on x86-64 GCC/Clang,
+ * so builds without -mavx2 still use it when the CPU supports it(runtime check).
+ */
+#if defined(__AVX2__)
+#define BITARRAY_AVX2_DECODE 1
+#define BITARRAY_AVX2_TARGET
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BITARRAY_AVX2_DECODE 1
+#define BITARRAY_AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 /* Classic bit-array for packing:
  * = Optimized for 64-bit machines.
@@ -9,6 +28,16 @@
  * = ReadOnly model specific optimization for speed.
  */
 
+// keep only nbits lower bits of value, nbits could be up to 64
+inline uint64_t LowBits( uint64_t value, uint64_t nbits )
+{
+#ifdef __BMI2__
+    return _bzhi_u64(value, nbits);
+#else
+    return nbits < 64 ? value & ((1UL << nbits) - 1) : value;
+#endif
+}
+
 class BitArrayWriter
 {
     static constexpr size_t nBits = sizeof(uint64_t) * 8;
@@ -57,6 +86,7 @@ public:
         {}
 
     void UpdatePtr( uint64_t const *data ) { data_ = data; }
+    uint64_t const *GetData() const { return data_; }
 
     bool GetBit( uint64_t pos ) const;
     uint64_t GetWord( uint64_t pos ) const;
@@ -85,7 +115,7 @@ public:
     BitArrayAdapter( uint64_t const *data, size_t elem_width )
         : BitArrayReader(data)
         , elem_width_(elem_width)
-        , emask_((1UL << elem_width) - 1)
+        , emask_(elem_width < 64 ? (1UL << elem_width) - 1 : ~0UL)
         {}
 
     BitArrayAdapter( uint64_t const *data, size_t elem_width, uint64_t emask )
@@ -102,8 +132,32 @@ public:
     
     uint64_t operator [] ( size_t offs ) const
     {
-        return this->GetBits(offs * elem_width_, emask_);
+        uint64_t const pos = offs * elem_width_;
+        size_t const offset = pos % 64;
+        uint64_t const *word = GetData() + pos / 64;
+        uint64_t out = word[0] >> offset;
+        // read next word only if element really spans it,
+        // otherwise we could read behind end of the mapped data
+        if( offset + elem_width_ > 64 )
+            out |= word[1] << (64 - offset);
+        return out & emask_;
     }
+
+    /* bulk unpack of count elements starting from first into out,
+     * T must be wide enough for elem_width(uint32_t or uint64_t usually).
+     * Never reads words behind the last element of range.
+     */
+    template<typename T>
+    void decode_range( size_t first, size_t count, T *out ) const;
+
+    size_t GetElemWidth() const { return elem_width_; }
+private:
+    template<typename T>
+    void decode_scalar( size_t first, size_t count, T *out ) const;
+#ifdef BITARRAY_AVX2_DECODE
+    template<typename T>
+    BITARRAY_AVX2_TARGET size_t decode_avx2( size_t first, size_t count, T *out ) const;
+#endif
 private:
     size_t const elem_width_;
     uint64_t const emask_;
@@ -129,36 +183,192 @@ inline void BitArrayWriter::SetBit( uint64_t pos, bool value )
         data_[pos / nBits] &= ~(1UL << (pos % nBits));
 }
 
+// value spans at most two words, so write it by two shifts
 inline void BitArrayWriter::AddBits( uint64_t value, uint64_t nbits )
 {
-    uint64_t pos = last_bit_pos_;
+    if( 0 == nbits )
+        return;
+
+    uint64_t const pos = last_bit_pos_;
     last_bit_pos_ += nbits;
     if( GetBitCapacity() < last_bit_pos_ )
         Resize(last_bit_pos_);
-    
-    for( uint64_t i = 0; i < nbits; ++i )
-    {
-        data_[pos / nBits] |= ((value >> i) & 1) << ( pos & 0x3f );
-        ++pos;
-    }
+
+    value = LowBits(value, nbits);
+    uint64_t const offset = pos % nBits;
+    uint64_t *word = &data_[pos / nBits];
+
+    word[0] |= value << offset;
+    if( offset + nbits > nBits )
+        word[1] |= value >> (nBits - offset);
 }
 
+// bulk pack of fixed width values, accumulate whole word before store
 inline void BitArrayWriter::AddBits( uint64_t const *values, size_t sz, uint64_t nbits )
 {
-    uint64_t pos = last_bit_pos_;
+    if( 0 == nbits || 0 == sz )
+        return;
+
+    uint64_t const pos = last_bit_pos_;
     last_bit_pos_ += sz * nbits;
     if( GetBitCapacity() < last_bit_pos_ )
         Resize(last_bit_pos_);
-    
+
+    uint64_t *word = &data_[pos / nBits];
+    uint64_t offset = pos % nBits;
+    uint64_t acc = 0;
+
     for( uint64_t const *end = values + sz; values != end; ++values )
     {
-        uint64_t const value = *values;
-        for( uint64_t i = 0; i < nbits; ++i )
+        uint64_t const value = LowBits(*values, nbits);
+        acc |= value << offset;
+        offset += nbits;
+        if( offset >= nBits )
+        {
+            *word++ |= acc;
+            offset -= nBits;
+            // carry higher part of the value, which did not fit
+            acc = offset ? value >> (nbits - offset) : 0;
+        }
+    }
+
+    if( offset )
+        *word |= acc;
+}
+
+template<typename T>
+inline void BitArrayAdapter::decode_scalar( size_t first, size_t count, T *out ) const
+{
+    for( size_t i = 0; i < count; ++i )
+        out[i] = T((*this)[first + i]);
+}
+
+#ifdef BITARRAY_AVX2_DECODE
+
+inline bool HasAVX2()
+{
+#ifdef __AVX2__
+    return true;
+#else
+    static bool const avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#endif
+}
+
+// gather 8 bytes from byte position of 4 elements, shift by bit offset and mask
+BITARRAY_AVX2_TARGET inline __m256i Gather4Bits( uint8_t const *bytes, __m256i pos, __m256i mask )
+{
+    __m256i const v = _mm256_i64gather_epi64(reinterpret_cast<long long const*>(bytes),
+                                             _mm256_srli_epi64(pos, 3), 1);
+    return _mm256_and_si256(_mm256_srlv_epi64(v, _mm256_and_si256(pos, _mm256_set1_epi64x(7))), mask);
+}
+
+/* AVX2 kernels, return number of decoded elements(rest is done by scalar code):
+ * = byte aligned widths are widened directly by vpmovzx
+ * = widths up to 57 bits gather 8 bytes from byte position of each element,
+ *   then shift by bit offset and mask, so every element needs one load only
+ */
+template<typename T>
+BITARRAY_AVX2_TARGET inline size_t BitArrayAdapter::decode_avx2( size_t first, size_t count, T *out ) const
+{
+    static_assert( sizeof(T) == 4 || sizeof(T) == 8, "AVX2 decode supports only 32/64-bit output" );
+    uint8_t const *bytes = reinterpret_cast<uint8_t const*>(GetData());
+    size_t const w = elem_width_;
+    size_t i = 0;
+
+    // mask with bits above element keeps bits of the next one, which only scalar code does
+    if( w == 0 || (w < 64 && (emask_ >> w) != 0) )
+        return 0;
+
+    if( w == 8 || w == 16 || w == 32 )
+    {
+        __m256i const emask = sizeof(T) == 4 ? _mm256_set1_epi32(int(uint32_t(emask_)))
+                                             : _mm256_set1_epi64x(emask_);
+        uint8_t const *src = bytes + first * (w / 8);
+        size_t const step = sizeof(T) == 4 ? 8 : 4;
+        for( ; i + step <= count; i += step )
         {
-            data_[pos / nBits] |= ((value >> i) & 1) << ( pos & 0x3f );
-            ++pos;
+            uint8_t const *p = src + i * (w / 8);
+            __m256i v;
+            if constexpr( sizeof(T) == 4 )
+            {
+                if( w == 8 )
+                    v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p)));
+                else if( w == 16 )
+                    v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+                else
+                    v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+            }
+            else
+            {
+                if( w == 8 )
+                {
+                    int four;
+                    memcpy(&four, p, sizeof(four));
+                    v = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+                }
+                else if( w == 16 )
+                    v = _mm256_cvtepu16_epi64(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p)));
+                else
+                    v = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(v, emask));
         }
+        return i;
     }
+
+    if( w > 57 )
+        return 0;
+
+    // 8 bytes load of the element must not cross end of the range words
+    size_t const end_bits = (first + count) * w;
+    size_t const limit_bytes = ((end_bits + 63) / 64) * 8;
+    size_t const step = sizeof(T) == 4 ? 8 : 4;
+
+    __m256i const mask = _mm256_set1_epi64x(emask_);
+    __m256i pos = _mm256_add_epi64(_mm256_set1_epi64x(first * w),
+                                   _mm256_setr_epi64x(0, w, 2 * w, 3 * w));
+    __m256i const inc = _mm256_set1_epi64x(4 * w);
+
+    for( ; i + step <= count; i += step )
+    {
+        // check last element of the step
+        if( ((first + i + step - 1) * w) / 8 + 8 > limit_bytes )
+            break;
+
+        __m256i const a = Gather4Bits(bytes, pos, mask);
+        pos = _mm256_add_epi64(pos, inc);
+        if constexpr( sizeof(T) == 8 )
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), a);
+        }
+        else
+        {
+            __m256i const b = Gather4Bits(bytes, pos, mask);
+            pos = _mm256_add_epi64(pos, inc);
+            // take low halves of 64-bit lanes and restore order
+            __m256i const ab = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(a),
+                                                                     _mm256_castsi256_ps(b), 0x88));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                _mm256_permutevar8x32_epi32(ab, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7)));
+        }
+    }
+
+    return i;
+}
+
+#endif
+
+template<typename T>
+inline void BitArrayAdapter::decode_range( size_t first, size_t count, T *out ) const
+{
+    size_t done = 0;
+#ifdef BITARRAY_AVX2_DECODE
+    if constexpr( sizeof(T) == 4 || sizeof(T) == 8 )
+        if( HasAVX2() )
+            done = decode_avx2(first, count, out);
+#endif
+    decode_scalar(first + done, count - done, out + done);
 }
 
 inline bool BitArrayReader::GetBit( uint64_t pos ) const
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+
+namespace detail {
+
+// bytes accounted for cache entry besides bucket data(slot and hash node)
+size_t const BUCKET_CACHE_ENTRY_OVERHEAD = 64;
+int const BUCKET_CACHE_DEFAULT_SHARDS = 16;
+
+/* Bounded cache of buckets read from storage, keyed by bucket index.
+ * Buckets are spread over shards by index, each shard has own lock,
+ * memory budget share and CLOCK eviction: hit sets reference bit, hand
+ * clears set bits and evicts first entry without it. Buffers are shared,
+ * so bucket evicted while other thread searches in it stays alive.
+ */
+class BucketCache
+{
+public:
+    typedef std::vector<uint64_t>           bucket_t;
+    typedef std::shared_ptr<bucket_t const> buffer_t;
+
+    struct Stats
+    {
+        uint64_t    hits;
+        uint64_t    misses;
+        uint64_t    evictions;
+        size_t      entries;
+        size_t      memory;
+    };
+
+    BucketCache( size_t memory_budget, size_t nshards = BUCKET_CACHE_DEFAULT_SHARDS )
+        : shards_(std::max(size_t(1), nshards))
+    {
+        for( auto &s : shards_ )
+            s.budget = memory_budget / shards_.size();
+    }
+
+    // return cached bucket or nullptr, counts hit or miss
+    buffer_t get( size_t bucket )
+    {
+        Shard &s = get_shard(bucket);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto const it = s.index.find(bucket);
+        if( it == s.index.end() )
+        {
+            ++s.stats.misses;
+            return buffer_t();
+        }
+        ++s.stats.hits;
+        Slot &slot = s.slots[it->second];
+        slot.referenced = true;
+        return slot.buf;
+    }
+
+    // insert bucket, evicting others if needed, too large buckets are not cached
+    void put( size_t bucket, buffer_t buf )
+    {
+        Shard &s = get_shard(bucket);
+        size_t const sz = get_entry_size(*buf);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if( sz > s.budget || s.index.count(bucket) )
+            return;
+
+        while( s.stats.memory + sz > s.budget )
+            evict(s);
+
+        uint32_t pos;
+        if( s.free_slots.empty() )
+        {
+            pos = s.slots.size();
+            s.slots.emplace_back();
+        }
+        else
+        {
+            pos = s.free_slots.back();
+            s.free_slots.pop_back();
+        }
+        // new entry is not referenced, so one-time buckets leave first
+        Slot &slot = s.slots[pos];
+        slot.bucket = bucket;
+        slot.buf = std::move(buf);
+        slot.referenced = false;
+        s.index.emplace(bucket, pos);
+        s.stats.memory += sz;
+        ++s.stats.entries;
+    }
+
+    // sum of all shards stats
+    Stats get_stats() const
+    {
+        Stats total = {};
+        for( auto &s : shards_ )
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            total.hits += s.stats.hits;
+            total.misses += s.stats.misses;
+            total.evictions += s.stats.evictions;
+            total.entries += s.stats.entries;
+            total.memory += s.stats.memory;
+        }
+        return total;
+    }
+
+private:
+    struct Slot
+    {
+        size_t      bucket;
+        buffer_t    buf; // empty for free slot
+        bool        referenced;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex                      mutex;
+        std::unordered_map<size_t, uint32_t>    index; // bucket -> slot
+        std::vector<Slot>                       slots;
+        std::vector<uint32_t>                   free_slots;
+        size_t                                  hand = 0;
+        size_t                                  budget = 0;
+        Stats                                   stats = {};
+    };
+
+    static size_t get_entry_size( bucket_t const &b )
+    {
+        return b.size() * sizeof(uint64_t) + BUCKET_CACHE_ENTRY_OVERHEAD;
+    }
+
+    Shard& get_shard( size_t bucket )
+    {
+        return shards_[bucket % shards_.size()];
+    }
+
+    // CLOCK: second chance for referenced entries, shard must not be empty
+    static void evict( Shard &s )
+    {
+        for( ;; s.hand = (s.hand + 1) % s.slots.size() )
+        {
+            Slot &slot = s.slots[s.hand];
+            if( !slot.buf )
+                continue;
+            if( slot.referenced )
+            {
+                slot.referenced = false;
+                continue;
+            }
+
+            s.stats.memory -= get_entry_size(*slot.buf);
+            --s.stats.entries;
+            ++s.stats.evictions;
+            s.index.erase(slot.bucket);
+            slot.buf.reset();
+            s.free_slots.push_back(s.hand);
+            s.hand = (s.hand + 1) % s.slots.size();
+            return;
+        }
+    }
+
+    std::vector<Shard>  shards_;
+};
+
+} // namespace detail
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "memory.hpp"
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+namespace detail {
+
+// hash bits, used by filter probes, start from this one
+uint32_t const FILTER_PROBE_SHIFT = 22;
+// probes take 6 bits each, so at most 7 of them fit the hash
+uint32_t const FILTER_MAX_PROBES = 7;
+
+/* Per-bucket filter of fast negative lookups: register-blocked Bloom
+ * filter, every bucket owns `words` 64-bit words, key sets `probes` bits
+ * in one word of its bucket. So check costs one word read, made before
+ * bucket is touched. Filter is stored after buckets, before the footer.
+ */
+struct BucketFilterParams
+{
+    uint32_t    words;  // per bucket, zero if there is no filter
+    uint32_t    probes;
+
+    // choose parameters for nrecords in nbuckets, bits_per_key is average filter size
+    static BucketFilterParams mk( size_t nrecords, size_t nbuckets, uint32_t bits_per_key )
+    {
+        BucketFilterParams p = { 0, 0 };
+        if( 0 == bits_per_key || 0 == nrecords || 0 == nbuckets )
+            return p;
+
+        uint64_t const bits = uint64_t(nrecords) * bits_per_key;
+        p.words = uint32_t(std::max<uint64_t>(1, (bits + 64 * nbuckets - 1) / (64 * nbuckets)));
+        // word blocks fill unevenly, about bits / 2 probes are the best(not bits * ln2)
+        p.probes = std::min(FILTER_MAX_PROBES, std::max(1u, bits_per_key / 2));
+        return p;
+    }
+
+    explicit operator bool () const { return 0 != words; }
+
+    // bits per key, which mk() was given for nrecords in nbuckets(words could be rounded up)
+    uint32_t get_bits_per_key( size_t nrecords, size_t nbuckets ) const
+    {
+        if( 0 == words || 0 == nrecords )
+            return 0;
+        uint32_t bits = uint32_t(std::min<uint64_t>(64 * FILTER_MAX_PROBES, uint64_t(words) * 64 * nbuckets / nrecords));
+        // probes are bits / 2, so they bound bits unless clamped
+        if( probes < FILTER_MAX_PROBES )
+            bits = std::min(bits, 2 * probes + 1);
+        return std::max(1u, bits);
+    }
+
+    // filter size in bytes for nbuckets
+    size_t get_size( size_t nbuckets ) const { return sizeof(uint64_t) * words * nbuckets; }
+
+    // word of key in its bucket and bits of key in that word
+    static uint64_t hash( uint64_t k )
+    {
+        // keys of one bucket have equal lower bits, so mix all of them(murmur3 finalizer)
+        k ^= k >> 33;
+        k *= 0xFF51AFD7ED558CCDULL;
+        k ^= k >> 33;
+        k *= 0xC4CEB9FE1A85EC53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    size_t get_word( size_t bucket, uint64_t h ) const
+    {
+        uint64_t const w = ((h & ((1ULL << FILTER_PROBE_SHIFT) - 1)) * words) >> FILTER_PROBE_SHIFT;
+        return bucket * words + w;
+    }
+
+    uint64_t get_bits( uint64_t h ) const
+    {
+        uint64_t bits = 0;
+        for( uint32_t i = 0; i < probes; ++i )
+            bits |= 1ULL << ((h >> (FILTER_PROBE_SHIFT + 6 * i)) & 63);
+        return bits;
+    }
+};
+
+/* filter is collected while buckets are flushed, keys of different buckets
+ * could be added concurrently, they touch different words
+ */
+class BucketFilterWriter
+{
+public:
+    BucketFilterWriter( size_t nbuckets, BucketFilterParams const &params )
+        : params_(params)
+        , mask_(nbuckets ? nbuckets - 1 : 0)
+        , words_(params.words * nbuckets, 0)
+    {}
+
+    template<typename Key>
+    void add( Key k )
+    {
+        if( params_ )
+        {
+            uint64_t const h = BucketFilterParams::hash(uint64_t(k));
+            words_[params_.get_word(k & mask_, h)] |= params_.get_bits(h);
+        }
+    }
+
+    void write( utils::OStreamProxy &os ) const
+    {
+        os.write(words_.data(), words_.size() * sizeof(uint64_t));
+    }
+
+private:
+    BucketFilterParams const    params_;
+    size_t const                mask_;
+    std::vector<uint64_t>       words_;
+};
+
+class BucketFilter
+{
+public:
+    BucketFilter()
+        : params_{ 0, 0 }
+        , words_(nullptr)
+    {}
+
+    BucketFilter( uint8_t const *words, BucketFilterParams const &params )
+        : params_(params)
+        , words_(reinterpret_cast<uint64_t const*>(words))
+    {}
+
+    explicit operator bool () const { return nullptr != words_; }
+
+    // false if key is surely not stored in bucket
+    template<typename Key>
+    bool may_contain( size_t bucket, Key k ) const
+    {
+        uint64_t const h = BucketFilterParams::hash(uint64_t(k));
+        uint64_t const bits = params_.get_bits(h);
+        return (words_[params_.get_word(bucket, h)] & bits) == bits;
+    }
+
+    template<typename Key>
+    void prefetch( size_t bucket, Key k ) const
+    {
+        __builtin_prefetch(words_ + params_.get_word(bucket, BucketFilterParams::hash(uint64_t(k))));
+    }
+
+private:
+    BucketFilterParams      params_;
+    uint64_t const         *words_;
+};
+
+} // namespace detail
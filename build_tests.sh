@@ -1,9 +1,14 @@
 #!/bin/bash
 
-mkdir -p build
-rm -rf build/*
-cd build
-cmake ..
-make
+set -e
 
+# build into dir $1 with cmake options $2..., run unit tests
+build() {
+    mkdir -p $1
+    rm -rf $1/*
+    (cd $1 && cmake .. "${@:2}" && make && ctest --output-on-failure)
+}
 
+build build
+# -march=native enables SIMD in-bucket search(AVX2/AVX-512) of the build host
+build build_native -DUSE_NATIVE_ARCH=ON
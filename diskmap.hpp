@@ -0,0 +1,468 @@
+#pragma once
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include "bucketcache.hpp"
+#include <string>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// near buckets of batch are read together if gap between them is not larger
+uint32_t const DISK_READ_GAP = 4096;
+// and whole read is not larger
+uint32_t const DISK_READ_MAX = 1 << 20;
+
+namespace detail {
+
+// read-only file accessed by pread, safe for concurrent reads
+class PReadFile
+{
+public:
+    explicit PReadFile( std::string const &path )
+        : fd_(::open(path.c_str(), O_RDONLY))
+        , size_(0)
+    {
+        if( fd_ < 0 )
+            throw std::runtime_error("[PReadFile] failed to open: " + path);
+
+        struct stat st;
+        if( fstat(fd_, &st) != 0 || st.st_size <= 0 )
+        {
+            ::close(fd_);
+            throw std::runtime_error("[PReadFile] failed to stat or empty file: " + path);
+        }
+        size_ = st.st_size;
+    }
+
+    PReadFile( PReadFile const & ) = delete;
+    PReadFile& operator = ( PReadFile const & ) = delete;
+
+    ~PReadFile()
+    {
+        ::close(fd_);
+    }
+
+    uint64_t size() const { return size_; }
+
+    // return false on error or unexpected end of file
+    bool read( void *p, size_t sz, uint64_t offs ) const
+    {
+        uint8_t *dst = static_cast<uint8_t*>(p);
+        while( sz )
+        {
+            ssize_t const rd = ::pread(fd_, dst, sz, offs);
+            if( rd < 0 && EINTR == errno )
+                continue;
+            if( rd <= 0 )
+                return false;
+            dst += rd;
+            offs += rd;
+            sz -= rd;
+        }
+        return true;
+    }
+
+    void read_or_throw( void *p, size_t sz, uint64_t offs ) const
+    {
+        if( !read(p, sz, offs) )
+            throw std::runtime_error("[PReadFile] read failed");
+    }
+
+private:
+    int         fd_;
+    uint64_t    size_;
+};
+
+/* Persistent threads helping with reads of batches, calling thread
+ * takes part too, so nthreads + 1 reads are in flight at most.
+ * Batches of concurrent callers share the threads.
+ */
+class ReadPool
+{
+public:
+    explicit ReadPool( size_t nthreads )
+        : stop_(false)
+    {
+        for( size_t t = 0; t < nthreads; ++t )
+            threads_.emplace_back([this]() { loop(); });
+    }
+
+    ReadPool( ReadPool const & ) = delete;
+    ReadPool& operator = ( ReadPool const & ) = delete;
+
+    ~ReadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for( auto &t : threads_ )
+            t.join();
+    }
+
+    // read(r) is called for each of nreads, return false if any of them failed
+    template<typename ReadFunc>
+    bool run( size_t nreads, ReadFunc const &read )
+    {
+        // job outlives run() in queue, but read is called only before all reads are done
+        auto job = std::make_shared<Job>(nreads, [&read]( size_t r ) { return read(r); });
+        size_t const nhelpers = std::min(threads_.size(), nreads - std::min(nreads, size_t(1)));
+        if( nhelpers )
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for( size_t t = 0; t < nhelpers; ++t )
+                    jobs_.push_back(job);
+            }
+            cv_.notify_all();
+        }
+        job->work();
+
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->done_cv.wait(lock, [&job]() { return job->ndone == job->nreads; });
+        return job->ok;
+    }
+
+private:
+    struct Job
+    {
+        Job( size_t n, std::function<bool(size_t)> rd )
+            : nreads(n), read(std::move(rd)), next(0), ndone(0), ok(true)
+        {}
+
+        // take reads until all of them are taken
+        void work()
+        {
+            for( size_t r = next++; r < nreads; r = next++ )
+            {
+                if( !read(r) )
+                    ok = false;
+                if( ++ndone == nreads )
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done_cv.notify_all();
+                }
+            }
+        }
+
+        size_t const                    nreads;
+        std::function<bool(size_t)>     read;
+        std::atomic<size_t>             next;
+        std::atomic<size_t>             ndone;
+        std::atomic<bool>               ok;
+        std::mutex                      mutex;
+        std::condition_variable         done_cv;
+    };
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for( ;; )
+        {
+            cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            if( jobs_.empty() )
+                return;
+            std::shared_ptr<Job> job = std::move(jobs_.front());
+            jobs_.pop_front();
+
+            lock.unlock();
+            job->work();
+            lock.lock();
+        }
+    }
+
+    std::mutex                          mutex_;
+    std::condition_variable             cv_;
+    std::deque<std::shared_ptr<Job>>    jobs_;
+    bool                                stop_;
+    std::vector<std::thread>            threads_;
+};
+
+// searchers return value by pointer or by copy
+template<typename Value>
+inline std::optional<Value> to_optional( Value const *v ) { return v ? std::optional<Value>(*v) : std::nullopt; }
+
+template<typename Value>
+inline std::optional<Value> to_optional( std::optional<Value> const &v ) { return v; }
+
+} // namespace detail
+
+/* Disk resident searcher: only directory and footer are loaded into memory,
+ * bucket needed by lookup is read by pread, so lookup costs about one
+ * page_size I/O and map could be much larger than RAM.
+ * Searcher is HAMapSearcher or HACMapSearcher, it decodes directory
+ * and searches inside of read bucket, so all file formats are supported.
+ * All search methods are thread safe.
+ */
+template<typename Searcher, typename Key, typename Value>
+class DiskSearcher
+{
+    struct BucketRange
+    {
+        uint64_t    offset;
+        uint64_t    size;
+        uint32_t    nkeys;
+    };
+
+    typedef detail::BucketCache::bucket_t   bucket_t;
+    typedef detail::BucketCache::buffer_t   buffer_t;
+public:
+    typedef detail::BucketCache::Stats      cache_stats_t;
+
+    explicit DiskSearcher( std::string const &path )
+        : file_(path)
+        , buckets_end_(0)
+        , srch_(load_index(file_, buckets_end_))
+        , mask_(srch_.bi_.get_mask())
+    {}
+
+    // select in-bucket search algorithm
+    void set_search_mode( SearchMode mode ) { srch_.set_search_mode(mode); }
+
+    /* number of threads issuing reads of search_batch, each one keeps
+     * one read in flight, so it is queue depth of the storage.
+     * Calling thread is one of them, others are kept in pool till next call.
+     */
+    void set_io_threads( size_t nthreads )
+    {
+        pool_.reset(nthreads > 1 ? new detail::ReadPool(nthreads - 1) : nullptr);
+    }
+
+    /* keep read buckets in sharded cache of memory_bytes with CLOCK eviction,
+     * so hot buckets are not read again, zero disables cache
+     */
+    void set_cache( size_t memory_bytes, size_t nshards = detail::BUCKET_CACHE_DEFAULT_SHARDS )
+    {
+        cache_.reset(memory_bytes ? new detail::BucketCache(memory_bytes, nshards) : nullptr);
+    }
+
+    // hits, misses and memory of bucket cache, all zero if it is disabled
+    cache_stats_t get_cache_stats() const
+    {
+        return cache_ ? cache_->get_stats() : cache_stats_t();
+    }
+
+    std::optional<Value> search( Key k ) const
+    {
+        size_t const i = k & mask_;
+        BucketRange const b = get_bucket(i);
+        // filter saves the read for most of absent keys
+        if( 0 == b.nkeys || !srch_.bi_.may_contain(i, k) )
+            return std::nullopt;
+
+        buffer_t buf = cache_ ? cache_->get(i) : buffer_t();
+        if( !buf )
+        {
+            auto rd = std::make_shared<bucket_t>(get_words(b.size));
+            file_.read_or_throw(rd->data(), b.size, b.offset);
+            buf = rd;
+            if( cache_ )
+                cache_->put(i, buf);
+        }
+        return detail::to_optional(srch_.search_bucket(k, reinterpret_cast<uint8_t const*>(buf->data()), b.nkeys));
+    }
+
+    /* batched lookup, out_values[i] = search(keys[i])
+     * keys are grouped by buckets, so each bucket is read once and
+     * near buckets are read by one request, requests are issued
+     * by io threads in parallel. Cached buckets are not read.
+     * return number of found keys
+     */
+    size_t search_batch( Key const *keys, size_t n, std::optional<Value> *out_values ) const
+    {
+        struct Read
+        {
+            uint64_t    offset;
+            uint64_t    size;
+            size_t      buf_words; // position in buffer
+        };
+
+        std::vector<uint32_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [keys, this]( uint32_t a, uint32_t b ) {
+            return (keys[a] & mask_) < (keys[b] & mask_);
+        });
+
+        // plan reads, read_of[j] is read containing bucket of key order[j]
+        std::vector<BucketRange> buckets(n);
+        std::vector<buffer_t> cached(cache_ ? n : 0);
+        std::vector<uint32_t> read_of(n);
+        std::vector<Read> reads;
+        size_t nwords = 0;
+        for( size_t j = 0; j < n; ++j )
+        {
+            size_t const i = keys[order[j]] & mask_;
+            bool const same = j && i == (keys[order[j - 1]] & mask_);
+            BucketRange b = get_bucket(i);
+            // key filtered out is handled as one of empty bucket
+            if( !srch_.bi_.may_contain(i, keys[order[j]]) )
+                b.nkeys = 0;
+            buckets[j] = b;
+            if( 0 == b.nkeys )
+                continue;
+            if( cache_ )
+            {
+                cached[j] = same ? cached[j - 1] : cache_->get(i);
+                if( cached[j] )
+                    continue;
+            }
+
+            if( !reads.empty() )
+            {
+                Read &rd = reads.back();
+                uint64_t const end = b.offset + b.size;
+                if( b.offset <= rd.offset + rd.size + DISK_READ_GAP && end - rd.offset <= DISK_READ_MAX )
+                {
+                    nwords -= get_words(rd.size);
+                    rd.size = std::max(rd.size, end - rd.offset);
+                    nwords += get_words(rd.size);
+                    read_of[j] = reads.size() - 1;
+                    continue;
+                }
+            }
+            reads.push_back(Read{ b.offset, b.size, nwords });
+            nwords += get_words(b.size);
+            read_of[j] = reads.size() - 1;
+        }
+
+        std::vector<uint64_t> buf(nwords);
+        run_reads(reads.size(), [&reads, &buf, this]( size_t r ) {
+            return file_.read(buf.data() + reads[r].buf_words, reads[r].size, reads[r].offset);
+        });
+
+        size_t nfound = 0;
+        for( size_t j = 0; j < n; ++j )
+        {
+            std::optional<Value> &out = out_values[order[j]];
+            BucketRange const &b = buckets[j];
+            if( 0 == b.nkeys )
+            {
+                out = std::nullopt;
+                continue;
+            }
+            uint8_t const *bucket;
+            if( cache_ && cached[j] )
+                bucket = reinterpret_cast<uint8_t const*>(cached[j]->data());
+            else
+            {
+                Read const &rd = reads[read_of[j]];
+                bucket = reinterpret_cast<uint8_t const*>(buf.data() + rd.buf_words) + (b.offset - rd.offset);
+                if( cache_ )
+                {
+                    // keep read bucket, next keys of it use the cached copy
+                    auto cb = std::make_shared<bucket_t>(get_words(b.size));
+                    memcpy(cb->data(), bucket, b.size);
+                    cached[j] = cb;
+                    cache_->put(keys[order[j]] & mask_, cached[j]);
+                    for( size_t jj = j + 1; jj < n && (keys[order[jj]] & mask_) == (keys[order[j]] & mask_); ++jj )
+                        cached[jj] = cached[j];
+                }
+            }
+            out = detail::to_optional(srch_.search_bucket(keys[order[j]], bucket, b.nkeys));
+            nfound += out.has_value();
+        }
+        return nfound;
+    }
+
+    // return number of records!
+    size_t size() const
+    {
+        return srch_.size();
+    }
+
+    // memory taken by directory and footer
+    size_t get_mem_size() const
+    {
+        return srch_.get_mem_size();
+    }
+private:
+    /* load directory, filter and footer only as memory image
+     * [directory][filter][footer], so directory offsets stay file offsets
+     */
+    static utils::MemoryReader load_index( detail::PReadFile const &file, uint64_t &buckets_end )
+    {
+        // footer takes at most: extension of any size, its size, key bits and nbuckets bytes
+        size_t const tail_size = std::min<uint64_t>(file.size(), 0xFFFF + sizeof(uint16_t) + 2);
+        utils::MemoryHolder tail = utils::MemoryHolder::mk_aligned(tail_size);
+        file.read_or_throw(tail.get_ptr<uint8_t>(), tail_size, file.size() - tail_size);
+
+        uint32_t key_bits_store;
+        FooterExt ext;
+        size_t footer_size;
+        utils::MemoryReader tail_rdr(std::move(tail));
+        size_t const nbuckets = detail::BucketIndex::read_footer(tail_rdr, key_bits_store, ext, &footer_size);
+        // empty map is footer only
+        size_t const dir_size = 1 == nbuckets ? 0 : detail::BucketIndex::get_directory_size(nbuckets, ext);
+        size_t const filter_size = detail::BucketIndex::get_filter_params(ext).get_size(nbuckets);
+        if( dir_size + filter_size + footer_size > file.size() )
+            throw std::runtime_error("[DiskSearcher] broken map file");
+        buckets_end = file.size() - footer_size - filter_size;
+
+        utils::MemoryHolder index = utils::MemoryHolder::mk_aligned(dir_size + filter_size + footer_size);
+        uint8_t *p = index.get_ptr<uint8_t>();
+        file.read_or_throw(p, dir_size, 0);
+        file.read_or_throw(p + dir_size, filter_size + footer_size, buckets_end);
+        return utils::MemoryReader(std::move(index));
+    }
+
+    static size_t get_words( uint64_t sz ) { return (sz + sizeof(uint64_t) - 1) / sizeof(uint64_t); }
+
+    // file range of bucket i, it ends where next one starts
+    BucketRange get_bucket( size_t i ) const
+    {
+        detail::BucketIndex const &bi = srch_.bi_;
+        BucketEntry const be = bi.get(i);
+        uint64_t const end = i + 1 < bi.get_nbuckets() ? uint64_t(bi.get(i + 1).offset) : buckets_end_;
+        return BucketRange{ be.offset, end - be.offset, uint32_t(be.nkeys) };
+    }
+
+    // read(r) is called for each of nreads, by io threads if set
+    template<typename ReadFunc>
+    void run_reads( size_t nreads, ReadFunc const &read ) const
+    {
+        bool ok = true;
+        if( pool_ )
+            ok = pool_->run(nreads, read);
+        else
+        {
+            for( size_t r = 0; r < nreads; ++r )
+                ok = read(r) && ok;
+        }
+
+        if( !ok )
+            throw std::runtime_error("[DiskSearcher] bucket read failed");
+    }
+
+private:
+    // coroutine lookups, see asyncmap.hpp
+    friend struct SearcherAccess;
+
+
+    detail::PReadFile   file_;
+    uint64_t            buckets_end_;
+    Searcher            srch_;
+    Key           const mask_;
+    std::unique_ptr<detail::ReadPool>    pool_;
+    std::unique_ptr<detail::BucketCache> cache_;
+};
+
+template<typename Key, typename Value>
+using HAMapDiskSearcher = DiskSearcher<HAMapSearcher<Key, Value>, Key, Value>;
+
+template<typename Key, typename Value>
+using HACMapDiskSearcher = DiskSearcher<HACMapSearcher<Key, Value>, Key, Value>;
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "memory.hpp"
+#include "bitarray.hpp"
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+namespace detail {
+
+// position of every EF_SELECT_SAMPLE-th one of upper bits is stored
+uint32_t const EF_SELECT_SAMPLE = 256;
+
+/* Elias-Fano directory of buckets: non-decreasing bucket offsets are split
+ * into low_bits lower bits, stored together with bucket records count
+ * as fixed width [nkeys | low] items, and higher part, stored in unary code:
+ * bit (offset >> low_bits) + i is set for bucket i. Select of i-th one is
+ * answered by sampled positions plus popcount scan over few words.
+ *
+ * Layout(64-bit words): [select samples][upper bits][packed items]
+ */
+struct EliasFanoParams
+{
+    uint32_t    low_bits;
+    uint32_t    nkeys_bits;
+    uint64_t    upper_words;
+
+    // choose parameters for n buckets with maximal offset and records count
+    static EliasFanoParams mk( size_t n, uint64_t max_offset, uint32_t max_nkeys )
+    {
+        EliasFanoParams p;
+        uint64_t const ratio = n ? max_offset / n : 0;
+        p.low_bits = ratio ? 63 - __builtin_clzll(ratio) : 0;
+        // keep items width non-zero
+        p.nkeys_bits = max_nkeys > 1 ? 32 - __builtin_clz(max_nkeys) : 1;
+        uint64_t const upper_bits = n + (max_offset >> p.low_bits) + 1;
+        p.upper_words = (upper_bits + 63) / 64;
+        return p;
+    }
+
+    static size_t get_samples_count( size_t n ) { return (n + EF_SELECT_SAMPLE - 1) / EF_SELECT_SAMPLE; }
+
+    // directory size in bytes for n buckets
+    size_t get_size( size_t n ) const
+    {
+        uint64_t const item_bits = uint64_t(n) * (low_bits + nkeys_bits);
+        return sizeof(uint64_t) * (get_samples_count(n) + upper_words + (item_bits + 63) / 64);
+    }
+};
+
+class EliasFanoWriter
+{
+public:
+    EliasFanoWriter( size_t n, EliasFanoParams const &params )
+        : params_(params)
+        , upper_(params.upper_words, 0)
+        , items_(n * (params.low_bits + params.nkeys_bits))
+        , n_(n)
+        , i_(0)
+    {
+        samples_.reserve(EliasFanoParams::get_samples_count(n));
+    }
+
+    // offsets must be added in non-decreasing order
+    void add( uint64_t offset, uint32_t nkeys )
+    {
+        uint64_t const pos = (offset >> params_.low_bits) + i_;
+        upper_[pos / 64] |= 1ULL << (pos % 64);
+        if( 0 == i_ % EF_SELECT_SAMPLE )
+            samples_.push_back(pos);
+
+        uint64_t const low = LowBits(offset, params_.low_bits);
+        items_.AddBits((uint64_t(nkeys) << params_.low_bits) | low, params_.low_bits + params_.nkeys_bits);
+        ++i_;
+    }
+
+    void write( utils::OStreamProxy &os ) const
+    {
+        os.write(samples_.data(), samples_.size() * sizeof(uint64_t));
+        os.write(upper_.data(), upper_.size() * sizeof(uint64_t));
+        uint64_t const item_bits = uint64_t(n_) * (params_.low_bits + params_.nkeys_bits);
+        os.write(items_.GetData(), (item_bits + 63) / 64 * sizeof(uint64_t));
+    }
+
+private:
+    EliasFanoParams         params_;
+    std::vector<uint64_t>   samples_;
+    std::vector<uint64_t>   upper_;
+    BitArrayWriter          items_;
+    size_t                  n_;
+    size_t                  i_;
+};
+
+class EliasFanoDirectory
+{
+public:
+    EliasFanoDirectory()
+        : samples_(nullptr)
+        , upper_(nullptr)
+        , items_(nullptr)
+        , item_width_(1)
+        , low_bits_(0)
+    {}
+
+    EliasFanoDirectory( uint8_t const *data, size_t n, EliasFanoParams const &params )
+        : samples_(reinterpret_cast<uint64_t const*>(data))
+        , upper_(samples_ + EliasFanoParams::get_samples_count(n))
+        , items_(upper_ + params.upper_words)
+        , item_width_(params.low_bits + params.nkeys_bits)
+        , low_bits_(params.low_bits)
+    {}
+
+    // return [offset, nkeys] of bucket i
+    std::pair<uint64_t, uint32_t> get( size_t i ) const
+    {
+        uint64_t const item = BitArrayAdapter(items_, item_width_)[i];
+        uint64_t const high = select(i) - i;
+        return std::make_pair((high << low_bits_) | LowBits(item, low_bits_), uint32_t(item >> low_bits_));
+    }
+
+    void prefetch( size_t i ) const
+    {
+        __builtin_prefetch(samples_ + i / EF_SELECT_SAMPLE);
+        __builtin_prefetch(items_ + i * item_width_ / 64);
+    }
+
+private:
+    // position of i-th one in upper bits
+    uint64_t select( size_t i ) const
+    {
+        uint64_t const pos = samples_[i / EF_SELECT_SAMPLE];
+        uint32_t rank = i % EF_SELECT_SAMPLE;
+        size_t w = pos / 64;
+        uint64_t word = upper_[w] & (~0ULL << (pos % 64));
+        for( uint32_t cnt = __builtin_popcountll(word); rank >= cnt; cnt = __builtin_popcountll(word) )
+        {
+            rank -= cnt;
+            word = upper_[++w];
+        }
+        return w * 64 + select_in_word(word, rank);
+    }
+
+    static uint32_t select_in_word( uint64_t word, uint32_t rank )
+    {
+#ifdef __BMI2__
+        return __builtin_ctzll(_pdep_u64(1ULL << rank, word));
+#else
+        for( ; rank; --rank )
+            word &= word - 1;
+        return __builtin_ctzll(word);
+#endif
+    }
+
+    uint64_t const     *samples_;
+    uint64_t const     *upper_;
+    uint64_t const     *items_;
+    uint32_t            item_width_;
+    uint32_t            low_bits_;
+};
+
+} // namespace detail
@@ -2,23 +2,41 @@
 
 #include "types.hpp"
 #include "bitarray.hpp"
+#include "spill.hpp"
 #include <type_traits>
 #include <iostream>
 #include <vector>
+#include <optional>
 #include <algorithm>
 
 namespace detail {
 
+// return first position in [l, u) with key not less than k
 template<typename Key>
-inline uint32_t binary_locate_compressed( Key const k, BitArrayAdapter const &keys, uint32_t u )
+inline uint32_t lower_bound_compressed( Key const k, BitArrayAdapter const &keys, uint32_t l, uint32_t u )
 {
-    uint32_t l = 0;
+    while (l < u)
+    {
+        uint32_t i = (l + u) >> 1;
+        if (Key(keys[i]) < k)
+            l = i + 1;
+        else
+            u = i;
+    }
+    return l;
+}
+
+// return position of found key or nkeys if not found
+template<typename Key>
+inline uint32_t binary_locate_compressed( Key const k, BitArrayAdapter const &keys, uint32_t const nkeys )
+{
+    uint32_t l = 0, u = nkeys;
     
     while (l < u)
     {
         uint32_t i = (l + u) >> 1;
 
-        uint32_t kval = keys[i];
+        Key kval = keys[i];
         
         if (kval > k)
             u = i;
@@ -29,7 +47,7 @@ inline uint32_t binary_locate_compressed( Key const k, BitArrayAdapter const &ke
         }
     }
     
-    return u;
+    return nkeys;
 }
 
 } // namespace detail
@@ -39,14 +57,80 @@ class EHCMapIndexer : private detail::KVCheck<Key, Value>
 {
 private:
     typedef std::pair<Key, Value>               kv_pair_t;
-    typedef std::vector< kv_pair_t >            bucket_kv_array_t;
-    typedef std::vector< bucket_kv_array_t >    bucket_array_t;
     typedef std::vector< kv_pair_t >            unsorted_records_list_t;
+    typedef detail::BucketPartition<kv_pair_t>  bucket_partition_t;
+    typedef detail::RecordSpan<kv_pair_t>       bucket_span_t;
+    typedef detail::RunSpiller<Key, Value>      spiller_t;
+    typedef detail::BucketStats<Value>          bucket_stats_t;
+    // values could be packed only if they are integers
+    static constexpr bool kValuesPackable = std::is_integral<Value>::value && sizeof(Value) <= 8;
+
+    struct FlushParams
+    {
+        uint32_t    key_bits_store;
+        uint32_t    key_rshift_by;
+        uint32_t    value_bits;
+        bool        pack_values;
+        bool        multimap;
+        bool        bucket_key_bits;
+        detail::DirectoryPlan dir;
+    };
 public:
-    EHCMapIndexer( size_t reserve = 0 ) : kmask_(0) {
+    EHCMapIndexer( size_t reserve = 0 ) : kmask_(0), pack_values_(kValuesPackable), nthreads_(1), expected_records_(0), dir_format_(DIRECTORY_FORMAT_AUTO), multimap_(false), filter_bits_(0), bucket_key_bits_(true) {
         unsorted_records_.reserve(reserve);
     }
 
+    /* values are stored bit-packed by default(frame of reference:
+     * per bucket base + fixed width deltas), pass false to store them as is
+     */
+    void set_value_packing( bool enable ) { pack_values_ = enable && kValuesPackable; }
+
+    /* directory entries format, tiny one is used by default if limits allow,
+     * Elias-Fano one is the smallest, but a bit slower to decode
+     */
+    void set_directory_format( DirectoryFormat format ) { dir_format_ = format; }
+
+    /* multimap mode: duplicate keys are kept, all values of a key are
+     * stored contiguously and returned by HACMapSearcher::equal_range
+     */
+    void set_multimap( bool enable ) { multimap_ = enable; }
+
+    /* emit per-bucket filter of about bits_per_key(4-10 are reasonable) bits
+     * per record, searchers check it before bucket is touched, so most of
+     * absent keys are rejected by one word read, zero disables filter
+     */
+    void set_filter_bits( uint32_t bits_per_key ) { filter_bits_ = bits_per_key; }
+
+    /* per-bucket key width: bucket keys are stored as offsets from the bucket
+     * minimal key by bits of its own keys range, it is used(by default) only
+     * if map gets smaller than with one global width of all keys
+     */
+    void set_bucket_key_bits( bool enable ) { bucket_key_bits_ = enable; }
+
+    /* number of threads used to sort and encode buckets by compact_and_store,
+     * output does not depend on it
+     */
+    void set_threads( size_t nthreads ) { nthreads_ = std::max(size_t(1), nthreads); }
+
+    /* external memory build: once records take memory_bytes they are sorted
+     * and spilled into temporary file in tmp_dir, compaction merges spilled runs,
+     * output is the same. Runs are partitioned by buckets count estimated from
+     * expected_records(DEFAULT_PAGE_SIZE), if it differs from final one,
+     * runs are re-partitioned once more at compaction.
+     * Budget bounds records storage(reserved at once, records are sorted in
+     * place), merge uses it for read buffers and windows of buckets, bucket
+     * stats and sort buffer of the largest bucket are taken above it.
+     */
+    void set_memory_budget( size_t memory_bytes, std::string const &tmp_dir = "/tmp", size_t expected_records = 0 )
+    {
+        if( spiller_ && !spiller_->empty() )
+            throw std::runtime_error("[EHCMapIndexer] memory budget must be set before spilling");
+        spiller_.reset(new spiller_t(tmp_dir, memory_bytes, kValuesPackable, true));
+        // storage of records is taken once, so vector growth does not exceed budget
+        unsorted_records_.reserve(std::max(unsorted_records_.size(), memory_bytes / sizeof(kv_pair_t)));
+        expected_records_ = expected_records;
+    }
+
     void add( std::pair<Key, Value> const &p )
     {
         add(p.first, p.second);
@@ -56,15 +140,23 @@ public:
     {
         kmask_ |= k;
         unsorted_records_.emplace_back(k, v);
+        // spill before the next record would not fit into reserved storage
+        if( spiller_ && (unsorted_records_.size() + 1) * sizeof(kv_pair_t) > spiller_->get_memory_budget() )
+            spill();
     }
 
-    size_t size() const { return unsorted_records_.size(); }
+    size_t size() const { return unsorted_records_.size() + (spiller_ ? spiller_->size() : 0); }
 
     void clear()
     {
         unsorted_records_.clear();
         unsorted_records_.shrink_to_fit();
         kmask_ = 0;
+        if( spiller_ )
+        {
+            spiller_->reset();
+            unsorted_records_.reserve(spiller_->get_memory_budget() / sizeof(kv_pair_t));
+        }
     }
 
     std::vector<uint8_t> get_compacted( size_t const page_size = DEFAULT_PAGE_SIZE )
@@ -75,71 +167,218 @@ public:
         return buffer;
     }
 
-private:
+    // compact map into cache line aligned memory of exact size, searcher adopts it without copy
+    utils::MemoryHolder get_compacted_memory( size_t const page_size = DEFAULT_PAGE_SIZE )
+    {
+        utils::MemoryHolder mem = utils::MemoryHolder::mk_aligned(get_compacted_size(page_size));
+        utils::OStreamProxy os(mem.get_ptr<void>(), mem.get_mem_size());
+        compact_and_store(os, page_size);
+        return mem;
+    }
+
+    // compact map directly into file, see utils::FileSinkType
+    void store( std::string const &path, size_t const page_size = DEFAULT_PAGE_SIZE, 
+                utils::FileSinkType type = utils::FILE_SINK_MMAP )
+    {
+        utils::OStreamProxy os(path, type);
+        compact_and_store(os, page_size);
+        os.close();
+    }
+
+    /* exact size of compacted map in bytes, sizing pass over records
+     * (or stats of spilled runs) counts records and values range of buckets
+     */
+    size_t get_compacted_size( size_t const page_size = DEFAULT_PAGE_SIZE )
+    {
+        size_t const nbuckets = get_nbuckets(page_size);
+        if( spiller_ && !spiller_->empty() )
+        {
+            prepare_spilled(nbuckets);
+            return get_output_size(spiller_->get_stats());
+        }
+        return get_output_size(get_stats(nbuckets));
+    }
+
     void compact_and_store( utils::OStreamProxy &os, size_t const page_size )
     {
-        // make index from unsorted_records_list_t
-        size_t const nrec = unsorted_records_.size();
-        
-        // always return pow of 2 nbuckets value!
-        size_t const nbuckets = detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * nrec, page_size);
-        size_t const hash_mask = nbuckets - 1;
+        size_t const nbuckets = get_nbuckets(page_size);
+
+        if( spiller_ && !spiller_->empty() )
+        {
+            compact_spilled(os, nbuckets);
+            return;
+        }
+
+        bucket_stats_t const stats = get_stats(nbuckets);
+        FlushParams const fp = get_flush_params(stats);
+        os.prealloc(get_output_size(stats));
         
-        bucket_array_t buckets(nbuckets);
+        bucket_partition_t buckets(unsorted_records_, nbuckets);
+        detail::BucketFilterWriter filter(nbuckets, fp.dir.filter);
         
-        for( auto const & p : unsorted_records_ )
+        detail::write_directory(os, nbuckets, fp.dir, get_bucket_sizes(stats, fp));
+        flush_buckets(os, buckets, fp, false, filter);
+        flush_footer(os, nbuckets, fp, filter);
+    }
+
+private:
+    // always return pow of 2 nbuckets value!
+    size_t get_nbuckets( size_t const page_size ) const
+    {
+        return detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * size(), page_size);
+    }
+
+    bucket_stats_t make_stats( size_t const nbuckets ) const
+    {
+        return bucket_stats_t(nbuckets, pack_values_, true);
+    }
+
+    bucket_stats_t get_stats( size_t const nbuckets ) const
+    {
+        bucket_stats_t stats = make_stats(nbuckets);
+        stats.add(unsorted_records_);
+        return stats;
+    }
+
+    void spill()
+    {
+        size_t nbuckets = spiller_->nbuckets();
+        if( 0 == nbuckets )
         {
-            size_t const bucket_idx = p.first & hash_mask;
-            buckets[bucket_idx].emplace_back(p);
+            size_t const nrec = std::max(expected_records_, unsorted_records_.size());
+            nbuckets = detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * nrec, DEFAULT_PAGE_SIZE);
         }
-        
-        flush_buckets(os, buckets);
+        spiller_->spill(unsorted_records_, nbuckets);
+    }
+
+    // spill the rest of records, runs must be partitioned by final buckets count
+    void prepare_spilled( size_t const nbuckets )
+    {
+        spiller_->spill(unsorted_records_, spiller_->nbuckets());
+        // records storage is not needed anymore, merge takes the budget
+        unsorted_records_.shrink_to_fit();
+        if( spiller_->nbuckets() != nbuckets )
+            spiller_->repartition(nbuckets);
+    }
+
+    // merge spilled runs by windows of buckets, records of them are sorted already
+    void compact_spilled( utils::OStreamProxy &os, size_t const nbuckets )
+    {
+        prepare_spilled(nbuckets);
+        compact_sorted(os, spiller_->get_stats(), [this]( auto &&on_window ) {
+            spiller_->merge(on_window);
+        });
+    }
+
+    /* write buckets, which are sorted already and described by stats,
+     * merge(on_window) passes consecutive windows of buckets
+     * to on_window(partition, first_bucket)
+     */
+    template<typename MergeFunc>
+    void compact_sorted( utils::OStreamProxy &os, bucket_stats_t const &stats, MergeFunc &&merge )
+    {
+        size_t const nbuckets = stats.nbuckets();
+        FlushParams const fp = get_flush_params(stats);
+        os.prealloc(get_output_size(stats));
+        detail::BucketFilterWriter filter(nbuckets, fp.dir.filter);
+
+        detail::write_directory(os, nbuckets, fp.dir, get_bucket_sizes(stats, fp));
+        merge([this, &os, &fp, &filter]( bucket_partition_t &buckets, size_t ) {
+            flush_buckets(os, buckets, fp, true, filter);
+        });
+        flush_footer(os, nbuckets, fp, filter);
+    }
+
+    size_t get_output_size( bucket_stats_t const &stats ) const
+    {
+        FlushParams const fp = get_flush_params(stats);
+        return detail::get_buckets_area_size(stats.nbuckets(), fp.dir, get_bucket_sizes(stats, fp))
+             + detail::get_footer_size(fp.key_bits_store, get_footer_ext(fp));
+    }
+
+    static uint64_t get_bucket_size( uint32_t nrec, uint32_t key_bits, FlushParams const &fp )
+    {
+        if( 0 == nrec )
+            return 0;
+
+        uint64_t sz = detail::BucketIndex::get_kcompressed_size(nrec, key_bits);
+        if( fp.bucket_key_bits )
+            sz += sizeof(uint64_t);
+        if( fp.pack_values )
+            sz += sizeof(uint64_t) + detail::BucketIndex::get_kcompressed_size(nrec, fp.value_bits);
+        else
+            sz += nrec * sizeof(Value);
+        return sz;
+    }
+
+    // minimal value of the bucket is a base for packed deltas
+    static uint64_t get_values_base( bucket_span_t const &b )
+    {
+        Value vmin = b.front().second;
+        for( auto const &p : b )
+            vmin = std::min(vmin, p.second);
+        return uint64_t(vmin);
+    }
+
+    static void flush_packed_values( utils::OStreamProxy &os, bucket_span_t const &b, FlushParams const &fp )
+    {
+        // frame of reference: base, then deltas of value_bits width
+        uint64_t const base = get_values_base(b);
+        os << base;
+
+        std::vector<uint64_t> deltas(b.size());
+        for( size_t i = 0; i < b.size(); ++i )
+            deltas[i] = uint64_t(b[i].second) - base;
+
+        BitArrayWriter vwr(b.size() * fp.value_bits);
+        vwr.AddBits(deltas.data(), deltas.size(), fp.value_bits);
+
+        os.write(vwr.GetData(), detail::BucketIndex::get_kcompressed_size(b.size(), fp.value_bits));
     }
 
     static void flush_bucket
     ( 
         utils::OStreamProxy     &os, 
-        bucket_kv_array_t       &b, 
-        uint32_t          const key_bits_store,
-        uint32_t          const key_rshift_by
+        bucket_span_t     const &b, 
+        FlushParams       const &fp
     )
     {
         if( !b.empty() )
         {
-            // each bucket must sorted by key before get flushed
-            std::sort(b.begin(), b.end());
-            
             // store keys and values separatly
             // compress keys by storing only higher key part
 
-            BitArrayWriter bwr(b.size() * key_bits_store);
+            // bucket is sorted, so its first key is the base of offsets
+            uint64_t const kbase = fp.bucket_key_bits ? uint64_t(b.front().first >> fp.key_rshift_by) : 0;
+            uint32_t const key_bits = get_key_bits(b, fp);
+            if( fp.bucket_key_bits )
+                os << uint64_t((kbase << BUCKET_KEY_BITS_WIDTH) | key_bits);
 
-            for( auto const &p : b )
-            {
-                bwr.AddBits(p.first >> key_rshift_by, key_bits_store);
-                //std::cout << p.first << ':' << (p.first >> key_rshift_by) << ", ";
-            }
+            std::vector<uint64_t> kreduced(b.size());
+            for( size_t i = 0; i < b.size(); ++i )
+                kreduced[i] = uint64_t(b[i].first >> fp.key_rshift_by) - kbase;
+
+            BitArrayWriter bwr(b.size() * key_bits);
+            bwr.AddBits(kreduced.data(), kreduced.size(), key_bits);
             
-            os.write(bwr.GetData(), bwr.GetCapacity());
+            os.write(bwr.GetData(), detail::BucketIndex::get_kcompressed_size(b.size(), key_bits));
 
-            BitArrayAdapter barr(bwr.GetData(), key_bits_store, (1UL << key_bits_store) - 1);
-            /*
-            std::cout << "DUMP BUCKET KEYS: ";
-            for( int i = 0; i < 20; ++i )
+            if constexpr( kValuesPackable )
             {
-                std::cout << barr[i] << ", ";
+                if( fp.pack_values )
+                {
+                    flush_packed_values(os, b, fp);
+                    return;
+                }
             }
 
-            std::cout << std::endl;*/
-
-            // store values uncompressed for now
             os.write_range(b.begin(), b.end(), []( kv_pair_t const &p ) { return p.second; });
         }
     }
     
-    void flush_buckets( utils::OStreamProxy &os, bucket_array_t &buckets )
+    FlushParams get_flush_params( bucket_stats_t const &stats ) const
     {
-        size_t const nbuckets = buckets.size();
+        size_t const nbuckets = stats.nbuckets();
         uint8_t nshift = utils::maxbits(nbuckets) - 1;
         uint32_t const key_bits_store0 = sizeof(Key) * 8 - nshift;
         uint32_t const key_rshift_by = sizeof(Key) * 8 - key_bits_store0;
@@ -148,45 +387,111 @@ private:
             utils::maxbits(kmask_ >> key_rshift_by)
             ;
 
-        BucketEntry be;
-        uint64_t offs = sizeof(BucketEntry) * buckets.size();
-        // write buckets index
-        uint32_t bid = 0;
-        for( auto const &b : buckets )
+        FlushParams fp = { key_bits_store, key_rshift_by, 0, pack_values_, multimap_, false, { DIRECTORY_FORMAT_WIDE, {}, {} } };
+        if constexpr( kValuesPackable )
         {
-            uint32_t nrec = b.size();
-            be.nkeys = nrec;
-            be.offset = offs;
-            os << be;
-            //std::cout << "BI: id=" << bid << " offs=" << offs << " nrec=" << nrec << std::endl;
-            ++bid;
-            if( nrec )
-                offs += nrec * sizeof(Value)
-                + detail::BucketIndex::get_kcompressed_size(nrec, key_bits_store);
+            // width is common for all buckets
+            if( fp.pack_values )
+                fp.value_bits = stats.get_value_bits();
+        }
+        // bucket header keeps the base within 58 bits
+        if( bucket_key_bits_ && key_bits_store <= BUCKET_KEY_BASE_MAX_BITS )
+            fp.bucket_key_bits = get_keys_size(stats, fp, true) < get_keys_size(stats, fp, false);
+        fp.dir = detail::plan_directory(dir_format_, nbuckets, get_bucket_sizes(stats, fp));
+        fp.dir.filter = detail::BucketFilterParams::mk(stats.size(), nbuckets, filter_bits_);
+        return fp;
+    }
+
+    // bits of keys of bucket i
+    static uint32_t get_key_bits( bucket_stats_t const &stats, size_t i, FlushParams const &fp )
+    {
+        return fp.bucket_key_bits ? stats.get_key_bits(i, fp.key_rshift_by) : fp.key_bits_store;
+    }
 
+    // bits of keys of sorted bucket
+    static uint32_t get_key_bits( bucket_span_t const &b, FlushParams const &fp )
+    {
+        if( !fp.bucket_key_bits || b.empty() )
+            return fp.key_bits_store;
+        return utils::maxbits(uint64_t(b.back().first >> fp.key_rshift_by) - uint64_t(b.front().first >> fp.key_rshift_by));
+    }
+
+    // bytes of all keys with per-bucket or global width
+    static uint64_t get_keys_size( bucket_stats_t const &stats, FlushParams fp, bool bucket_key_bits )
+    {
+        fp.bucket_key_bits = bucket_key_bits;
+        uint64_t sz = 0;
+        for( size_t i = 0; i < stats.nbuckets(); ++i )
+        {
+            uint32_t const nrec = stats.bucket_size(i);
+            if( nrec )
+                sz += get_bucket_size(nrec, get_key_bits(stats, i, fp), fp);
         }
+        return sz;
+    }
 
-        // write each bucket
-        for( auto &b : buckets )
-            flush_bucket(os, b, key_bits_store, key_rshift_by);
+    // (records count, bytes) of bucket i
+    static auto get_bucket_sizes( bucket_stats_t const &stats, FlushParams const &fp )
+    {
+        return [&stats, &fp]( size_t i ) {
+            uint32_t const nrec = stats.bucket_size(i);
+            return std::make_pair(nrec, get_bucket_size(nrec, get_key_bits(stats, i, fp), fp));
+        };
+    }
+    
+    void flush_buckets( utils::OStreamProxy &os, bucket_partition_t &buckets, FlushParams const &fp, bool sorted,
+                        detail::BucketFilterWriter &filter ) const
+    {
+        // write each bucket, it must sorted by key before get flushed
+        detail::flush_parallel(os, buckets.nbuckets(), nthreads_, 
+            [&buckets, &fp, sorted, &filter]( size_t i, utils::OStreamProxy &bos ) {
+                auto const b = buckets.bucket(i);
+                if( !sorted )
+                    detail::sort_bucket(b.data(), b.size(), fp.key_rshift_by);
+                for( auto const &p : b )
+                    filter.add(p.first);
+                flush_bucket(bos, b, fp);
+                detail::write_bucket_padding(bos, fp.dir, get_bucket_size(b.size(), get_key_bits(b, fp), fp));
+            });
+    }
 
-        /*
-        std::cout << "FOOTER WRITE: key_bits_store=" << key_bits_store
-                  << " nshift=" << int(nshift)
-                  << " key_rshift_by=" << key_rshift_by
-                  << " nbuckets=" << nbuckets
-                  << std::endl;*/
+    static FooterExt get_footer_ext( FlushParams const &fp )
+    {
+        FooterExt ext = {};
+        if( fp.pack_values )
+        {
+            ext.flags |= FOOTER_FLAG_PACKED_VALUES;
+            ext.value_bits = fp.value_bits;
+        }
+        if( fp.multimap )
+            ext.flags |= FOOTER_FLAG_MULTIMAP;
+        if( fp.bucket_key_bits )
+            ext.flags |= FOOTER_FLAG_BUCKET_KEY_BITS;
+        fp.dir.fill_ext(ext);
+        return ext;
+    }
 
+    static void flush_footer( utils::OStreamProxy &os, size_t const nbuckets, FlushParams const &fp,
+                              detail::BucketFilterWriter const &filter )
+    {
+        filter.write(os);
         // use footer, to keep alignment fine.
-        // write footer;
-        os << uint8_t(key_bits_store);
-        // store only N from buckets = 2 ** (N - 1)
-        nshift |= 0x80; // also set higher bit to signal footer reader get second byte too
-        os << nshift; 
+        detail::write_footer(os, nbuckets, fp.key_bits_store, get_footer_ext(fp));
     }
 private:
+    // merge of map files writes buckets by compact_sorted, see mergemap.hpp
+    template<typename, typename, typename, typename> friend class MapMerger;
+
     unsorted_records_list_t     unsorted_records_;
     Key                         kmask_;
+    bool                        pack_values_;
+    size_t                      nthreads_;
+    std::unique_ptr<spiller_t>  spiller_;
+    size_t                      expected_records_;
+    DirectoryFormat             dir_format_;
+    bool                        multimap_;
+    uint32_t                    filter_bits_;
+    bool                        bucket_key_bits_;
 };
     
 
@@ -194,69 +499,139 @@ template<typename Key, typename Value>
 class HACMapSearcher : private detail::KVCheck<Key, Value>
 {
 public:
+    /* values of one key, returned by equal_range(),
+     * values could be bit-packed, so they are returned by copy
+     */
+    class ValueRange
+    {
+    public:
+        size_t size() const { return count_; }
+        bool empty() const { return 0 == count_; }
+        Value operator [] ( size_t i ) const { return srch_->get_value(values_start_, first_ + uint32_t(i)); }
+    private:
+        friend class HACMapSearcher;
+
+        ValueRange( HACMapSearcher const *srch, uint8_t const *values_start, uint32_t first, uint32_t count )
+            : srch_(srch), values_start_(values_start), first_(first), count_(count)
+        {}
+
+        HACMapSearcher const   *srch_;
+        uint8_t const          *values_start_;
+        uint32_t                first_;
+        uint32_t                count_;
+    };
+
     /* construct searcher from readable std::istream interface
      */
     HACMapSearcher( std::istream &is )
         : bi_(is)
         , mask_(bi_.get_mask())
-        , bit_array_(nullptr, bi_.get_key_bits_store())
+        , key_bits_store_(bi_.get_key_bits_store())
+        , packed_values_((bi_.get_flags() & FOOTER_FLAG_PACKED_VALUES) != 0)
+        , value_bits_(bi_.get_ext().value_bits)
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , bucket_key_bits_((bi_.get_flags() & FOOTER_FLAG_BUCKET_KEY_BITS) != 0)
+        , mode_(SEARCH_MODE_BINARY)
+    {
+        init();
+    }
+
+    /* construct searcher from file path, file is mapped into memory(zero-copy)
+     */
+    HACMapSearcher( std::string const &path )
+        : bi_(utils::MemoryReader(path))
+        , mask_(bi_.get_mask())
+        , key_bits_store_(bi_.get_key_bits_store())
+        , packed_values_((bi_.get_flags() & FOOTER_FLAG_PACKED_VALUES) != 0)
+        , value_bits_(bi_.get_ext().value_bits)
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , bucket_key_bits_((bi_.get_flags() & FOOTER_FLAG_BUCKET_KEY_BITS) != 0)
+        , mode_(SEARCH_MODE_BINARY)
+    {
+        init();
+    }
+    
+    /* construct searcher from memory image of the map
+     */
+    explicit HACMapSearcher( utils::MemoryReader rdr )
+        : bi_(std::move(rdr))
+        , mask_(bi_.get_mask())
+        , key_bits_store_(bi_.get_key_bits_store())
+        , packed_values_((bi_.get_flags() & FOOTER_FLAG_PACKED_VALUES) != 0)
+        , value_bits_(bi_.get_ext().value_bits)
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , bucket_key_bits_((bi_.get_flags() & FOOTER_FLAG_BUCKET_KEY_BITS) != 0)
+        , mode_(SEARCH_MODE_BINARY)
     {
         init();
     }
     
     /* usefull for tests and other */
     HACMapSearcher( EHCMapIndexer<Key, Value> &idx )
-        : bi_(idx.get_compacted())
+        : bi_(utils::MemoryReader(idx.get_compacted_memory()))
         , mask_(bi_.get_mask())
-        , bit_array_(nullptr, bi_.get_key_bits_store())
+        , key_bits_store_(bi_.get_key_bits_store())
+        , packed_values_((bi_.get_flags() & FOOTER_FLAG_PACKED_VALUES) != 0)
+        , value_bits_(bi_.get_ext().value_bits)
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , bucket_key_bits_((bi_.get_flags() & FOOTER_FLAG_BUCKET_KEY_BITS) != 0)
+        , mode_(SEARCH_MODE_BINARY)
     {
         init();
     }
     
-    // unique key mode(get first equal key)
-    // return pointer to found value or nullptr if not found!
-    Value const* search( Key k ) const
+    // select in-bucket search algorithm
+    void set_search_mode( SearchMode mode ) { mode_ = mode; }
+
+    // unique key mode(any equal key), in multimap mode the first value of key
+    // values could be bit-packed, so found value is returned by copy
+    std::optional<Value> search( Key k ) const
     {
+        size_t const i = k & mask_;
+        if( !bi_.may_contain(i, k) )
+            return std::nullopt;
+        auto const p = bi_.get_unpacked( i );
+        return search_bucket(k, p.first, p.second);
+    }
+
+    /* return all values of key k, range is empty if not found,
+     * duplicate keys are stored by multimap mode
+     */
+    ValueRange equal_range( Key k ) const
+    {
+        if( !bi_.may_contain(k & mask_, k) )
+            return ValueRange(this, nullptr, 0, 0);
         auto const p = bi_.get_unpacked( k & mask_ );
         if( 0 == p.second )
-            return nullptr;
-        // get reduced key value to compare with prepared array
-        Key kred = k >> key_rshift_by_;
-        // update pointer to the selected bucket
-        bit_array_.UpdatePtr(reinterpret_cast<uint64_t const*>(p.first));
-        
-        uint32_t offs = detail::binary_locate_compressed(kred, bit_array_, p.second);
-        /*
-        std::cout << "ATTEMP locate: k=" << k
-                    << " bid=" << (k & mask_)
-                    << " boffs=" << uint64_t(bi_.get(k & mask_).offset)
-                    << " key_bits_store=" << key_bits_store
-                    << " nshift=" << int(nshift)
-                    << " kred=" << kred
-                    << " kmask=0x" << std::hex << kmask_ << std::dec
-                    << " nkeys=" << p.second
-                    << " found offs=" << offs
-                    << std::endl;
-
-        std::cout << "DUMP BUCKET KEYS: ";
-        for( int i = 0; i < 20; ++i )
-        {
-            std::cout << barr[i] << ", ";
-        }
+            return ValueRange(this, nullptr, 0, 0);
+        auto const r = bucket_equal_range(k >> key_rshift_by_, p.first, p.second);
+        return ValueRange(this, get_bucket_keys(p.first, p.second).values, r.first, r.second - r.first);
+    }
 
-        std::cout << std::endl;*/
-        
-        if( offs < p.second )
-        {
-            // retrieve value by offset
-            // we need to get start of the values
-            // so calculate compressed keys size
-            size_t keys_size = bi_.get_compressed_keys_size(p.second);
-            uint8_t const *values_start = p.first + keys_size;
-            return reinterpret_cast<Value const*>(values_start) + offs;
-        }
-        
-        return nullptr;
+    bool is_multimap() const { return multimap_; }
+
+    /* batched lookup, out_values[i] = search(keys[i])
+     * keys are processed by groups in stages, so cache misses
+     * on directory and buckets of different keys are overlapped.
+     * return number of found keys
+     */
+    size_t search_batch( Key const *keys, size_t n, std::optional<Value> *out_values ) const
+    {
+        size_t nfound = 0;
+        visit_batch(keys, n, [this, keys, out_values, &nfound]( size_t j, uint8_t const *bucket, uint32_t nkeys ) {
+            out_values[j] = search_bucket(keys[j], bucket, nkeys);
+            nfound += out_values[j].has_value();
+        });
+        return nfound;
+    }
+
+    // batched locate(), out_positions[i] = locate(keys[i])
+    void locate_batch( Key const *keys, size_t n, std::optional<uint32_t> *out_positions ) const
+    {
+        visit_batch(keys, n, [this, keys, out_positions]( size_t j, uint8_t const *bucket, uint32_t nkeys ) {
+            uint32_t const pos = nkeys ? locate_bucket(keys[j], get_bucket_keys(bucket, nkeys), nkeys) : nkeys;
+            out_positions[j] = pos < nkeys ? std::optional<uint32_t>(pos) : std::nullopt;
+        });
     }
     
     // return number of records!
@@ -269,16 +644,262 @@ public:
     {
         return bi_.get_mem_size();
     }
+
+    size_t get_nbuckets() const { return bi_.get_nbuckets(); }
+    uint32_t get_bucket_size( size_t i ) const { return bi_.get(i).nkeys; }
+    // build settings of the map(flags, directory and filter params)
+    FooterExt const& get_footer_ext() const { return bi_.get_ext(); }
+
+    // position of record found by search(k) in its bucket(k & mask)
+    std::optional<uint32_t> locate( Key k ) const
+    {
+        size_t const i = k & mask_;
+        if( !bi_.may_contain(i, k) )
+            return std::nullopt;
+        auto const p = bi_.get_unpacked( i );
+        if( 0 == p.second )
+            return std::nullopt;
+        uint32_t const pos = locate_bucket(k, get_bucket_keys(p.first, p.second), p.second);
+        return pos < p.second ? std::optional<uint32_t>(pos) : std::nullopt;
+    }
+
+    // value of record pos of bucket i
+    Value get_value_at( size_t i, uint32_t pos ) const
+    {
+        auto const p = bi_.get_unpacked( i );
+        return get_value(get_bucket_keys(p.first, p.second).values, pos);
+    }
+
+    // [first, last) positions of records of key k in its bucket(k & mask)
+    std::pair<uint32_t, uint32_t> locate_range( Key k ) const
+    {
+        auto const p = bi_.get_unpacked( k & mask_ );
+        return bucket_equal_range(k >> key_rshift_by_, p.first, p.second);
+    }
+
+    // append records of bucket i to out, in stored order
+    void decode_bucket( size_t i, std::vector<std::pair<Key, Value>> &out ) const
+    {
+        auto const p = bi_.get_unpacked(i);
+        uint32_t const nkeys = p.second;
+        if( 0 == nkeys )
+            return;
+
+        // full key is reduced key and bucket index
+        BucketKeys const bk = get_bucket_keys(p.first, nkeys);
+        std::vector<Key> keys(nkeys, 0);
+        if( bk.bits )
+        {
+            BitArrayAdapter const kadapter(bk.keys, bk.bits);
+            kadapter.decode_range(0, nkeys, keys.data());
+        }
+
+        uint8_t const *values_start = bk.values;
+        std::vector<Value> values(nkeys);
+        if constexpr( std::is_integral<Value>::value )
+        {
+            if( packed_values_ )
+                decode_packed_values(values_start, nkeys, values.data());
+            else
+                memcpy(values.data(), values_start, nkeys * sizeof(Value));
+        }
+        else
+            memcpy(values.data(), values_start, nkeys * sizeof(Value));
+
+        for( uint32_t j = 0; j < nkeys; ++j )
+            out.emplace_back(Key(((keys[j] + bk.base) << key_rshift_by_) | i), values[j]);
+    }
 private:
+    // keys of nonempty bucket are stored as (reduced key - base) by bits, values follow them
+    struct BucketKeys
+    {
+        uint64_t const *keys;
+        uint8_t const  *values;
+        uint64_t        base;
+        uint32_t        bits;
+    };
+
+    BucketKeys get_bucket_keys( uint8_t const *bucket, uint32_t nkeys ) const
+    {
+        BucketKeys bk = { reinterpret_cast<uint64_t const*>(bucket), nullptr, 0, key_bits_store_ };
+        if( bucket_key_bits_ )
+        {
+            // header word: (base << BUCKET_KEY_BITS_WIDTH) | bits
+            uint64_t const header = *bk.keys++;
+            bk.base = header >> BUCKET_KEY_BITS_WIDTH;
+            bk.bits = uint32_t(header & ((1u << BUCKET_KEY_BITS_WIDTH) - 1));
+        }
+        bk.values = reinterpret_cast<uint8_t const*>(bk.keys) + detail::BucketIndex::get_kcompressed_size(nkeys, bk.bits);
+        return bk;
+    }
+
     void init()
     {
         uint8_t nshift = utils::maxbits(bi_.get_nbuckets()) - 1;
         uint32_t const key_bits_store0 = sizeof(Key) * 8 - nshift;
         key_rshift_by_ = sizeof(Key) * 8 - key_bits_store0;
     }
+
+    // stages of batched lookups, func(j, bucket, nkeys) searches keys[j] in its prefetched bucket
+    template<typename Func>
+    void visit_batch( Key const *keys, size_t n, Func &&func ) const
+    {
+        std::pair<uint8_t const*, uint32_t> buckets[SEARCH_BATCH_GROUP];
+
+        for( size_t g = 0; g < n; g += SEARCH_BATCH_GROUP )
+        {
+            size_t const gsz = std::min(n - g, size_t(SEARCH_BATCH_GROUP));
+            Key const *gkeys = keys + g;
+
+            // stage 1: prefetch directory entries and filter words
+            for( size_t i = 0; i < gsz; ++i )
+            {
+                bi_.prefetch(gkeys[i] & mask_);
+                bi_.prefetch_filter(gkeys[i] & mask_, gkeys[i]);
+            }
+
+            // stage 2: resolve buckets and prefetch first probe of the search
+            for( size_t i = 0; i < gsz; ++i )
+            {
+                // key filtered out is searched in empty bucket
+                if( !bi_.may_contain(gkeys[i] & mask_, gkeys[i]) )
+                {
+                    buckets[i] = std::make_pair(nullptr, 0u);
+                    continue;
+                }
+                buckets[i] = bi_.get_unpacked(gkeys[i] & mask_);
+                // per-bucket width is not known yet, so probes are estimated by global one
+                if( bucket_key_bits_ )
+                    __builtin_prefetch(buckets[i].first);
+                if( SEARCH_MODE_BINARY == mode_ )
+                {
+                    size_t const mid_bit = size_t(buckets[i].second >> 1) * key_bits_store_;
+                    __builtin_prefetch(buckets[i].first + (mid_bit >> 3));
+                }
+                else if( buckets[i].second )
+                {
+                    // interpolation reads first and last keys
+                    size_t const last_bit = size_t(buckets[i].second - 1) * key_bits_store_;
+                    __builtin_prefetch(buckets[i].first);
+                    __builtin_prefetch(buckets[i].first + (last_bit >> 3));
+                }
+            }
+
+            // stage 3: search, data is expected to be in cache already
+            for( size_t i = 0; i < gsz; ++i )
+                func(g + i, buckets[i].first, buckets[i].second);
+        }
+    }
+
+    std::optional<Value> search_bucket( Key k, uint8_t const *bucket, uint32_t nkeys ) const
+    {
+        if( 0 == nkeys )
+            return std::nullopt;
+        BucketKeys const bk = get_bucket_keys(bucket, nkeys);
+        uint32_t const offs = locate_bucket(k, bk, nkeys);
+        if( offs < nkeys )
+        {
+            // retrieve value by offset, values follow compressed keys
+            return get_value(bk.values, offs);
+        }
+        
+        return std::nullopt;
+    }
+
+    // return position of found key in nonempty bucket or nkeys if not found
+    uint32_t locate_bucket( Key k, BucketKeys const &bk, uint32_t nkeys ) const
+    {
+        // get reduced key value to compare with prepared array
+        Key kred = k >> key_rshift_by_;
+        // keys are offsets from the bucket minimal one
+        if( uint64_t(kred) < bk.base )
+            return nkeys;
+        kred = Key(kred - bk.base);
+        // adapter is local, so concurrent searches are safe
+        BitArrayAdapter const keys(bk.keys, bk.bits);
+        
+        // all reduced keys are zero if nothing is stored for them
+        uint32_t offs;
+        if( 0 == bk.bits )
+            offs = 0 == kred ? 0 : nkeys;
+        else if( multimap_ )
+        {
+            // first of equal keys
+            offs = detail::lower_bound_compressed(kred, keys, 0, nkeys);
+            if( offs < nkeys && Key(keys[offs]) != kred )
+                offs = nkeys;
+        }
+        else
+            offs = SEARCH_MODE_INTERPOLATION == mode_
+                 ? detail::interpolation_locate(kred, keys, nkeys)
+                 : detail::binary_locate_compressed(kred, keys, nkeys);
+        return offs;
+    }
+
+    // [first, last) positions of reduced key kred in bucket
+    std::pair<uint32_t, uint32_t> bucket_equal_range( Key kred, uint8_t const *bucket, uint32_t nkeys ) const
+    {
+        if( 0 == nkeys )
+            return std::make_pair(0u, 0u);
+        BucketKeys const bk = get_bucket_keys(bucket, nkeys);
+        if( uint64_t(kred) < bk.base )
+            return std::make_pair(0u, 0u);
+        kred = Key(kred - bk.base);
+        if( 0 == bk.bits )
+            return std::make_pair(0u, 0 == kred ? nkeys : 0u);
+
+        // reduced keys are shorter than Key, so kred + 1 does not overflow
+        BitArrayAdapter const keys(bk.keys, bk.bits);
+        uint32_t const first = detail::lower_bound_compressed(kred, keys, 0, nkeys);
+        uint32_t const last = detail::lower_bound_compressed(Key(kred + 1), keys, first, nkeys);
+        return std::make_pair(first, last);
+    }
+
+    Value get_value( uint8_t const *values_start, uint32_t offs ) const
+    {
+        if constexpr( std::is_integral<Value>::value )
+        {
+            if( packed_values_ )
+                return get_packed_value(values_start, offs);
+        }
+        return reinterpret_cast<Value const*>(values_start)[offs];
+    }
+
+    void decode_packed_values( uint8_t const *values_start, uint32_t nkeys, Value *out ) const
+    {
+        uint64_t const base = *reinterpret_cast<uint64_t const*>(values_start);
+        std::vector<uint64_t> deltas(nkeys, 0);
+        if( value_bits_ )
+        {
+            BitArrayAdapter const values(reinterpret_cast<uint64_t const*>(values_start + sizeof(uint64_t)), value_bits_);
+            values.decode_range(0, nkeys, deltas.data());
+        }
+        for( uint32_t j = 0; j < nkeys; ++j )
+            out[j] = Value(base + deltas[j]);
+    }
+
+    // values are stored as [uint64 base][value_bits deltas]
+    Value get_packed_value( uint8_t const *values_start, uint32_t offs ) const
+    {
+        uint64_t const base = *reinterpret_cast<uint64_t const*>(values_start);
+        if( 0 == value_bits_ )
+            return Value(base);
+        BitArrayAdapter const values(reinterpret_cast<uint64_t const*>(values_start + sizeof(uint64_t)), value_bits_);
+        return Value(base + values[offs]);
+    }
 private:
+    // disk resident searcher reuses directory and in-bucket search
+    template<typename, typename, typename> friend class DiskSearcher;
+    // coroutine lookups, see asyncmap.hpp
+    friend struct SearcherAccess;
+
     detail::BucketIndex const bi_;
     Key                 const mask_;
-    mutable BitArrayAdapter   bit_array_;
+    uint32_t            const key_bits_store_;
+    bool                const packed_values_;
+    uint32_t            const value_bits_;
+    bool                const multimap_;
+    bool                const bucket_key_bits_;
     uint32_t                  key_rshift_by_;
+    SearchMode                mode_;
 };
\ No newline at end of file
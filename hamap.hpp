@@ -1,8 +1,13 @@
 #pragma once
 
 #include "types.hpp"
+#include "spill.hpp"
 #include <iostream>
+#include <optional>
 #include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 
 namespace detail {
@@ -28,6 +33,230 @@ inline Key const* binary_locate( Key const k, Key const * __restrict__ keys, uin
     return nullptr;
 }
 
+#if defined(__AVX512F__) || defined(__AVX2__)
+
+/* SIMD in-bucket search:
+ * large ranges are narrowed by k-ary steps, each step gathers
+ * SIMD width pivots and compares them with key at once,
+ * then small range is scanned linearly by whole vectors.
+ */
+template<typename Key>
+struct SimdLocate;
+
+#if defined(__AVX512F__)
+
+template<>
+struct SimdLocate<uint32_t>
+{
+    static constexpr uint32_t nLanes = 16;
+    static constexpr uint32_t nLinearLimit = 64;
+
+    static uint32_t count_less( uint32_t k, uint32_t const *keys, uint32_t step )
+    {
+        __m512i const idx = _mm512_mullo_epi32(_mm512_set1_epi32(step),
+            _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16));
+        // masked form with zero source, plain gather leaves source undefined
+        __m512i const pivots = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), __mmask16(0xFFFF), idx, keys - 1, 4);
+        return __builtin_popcount(_mm512_cmplt_epu32_mask(pivots, _mm512_set1_epi32(k)));
+    }
+
+    static uint32_t const *scan( uint32_t k, uint32_t const *keys, uint32_t n )
+    {
+        __m512i const vk = _mm512_set1_epi32(k);
+        for( uint32_t i = 0; i < n; i += nLanes )
+        {
+            __mmask16 const lmask = n - i >= nLanes ? __mmask16(0xFFFF) : __mmask16((1U << (n - i)) - 1);
+            __m512i const v = _mm512_maskz_loadu_epi32(lmask, keys + i);
+            __mmask16 const eq = _mm512_mask_cmpeq_epi32_mask(lmask, v, vk);
+            if( eq )
+                return keys + i + __builtin_ctz(eq);
+        }
+        return nullptr;
+    }
+};
+
+template<>
+struct SimdLocate<uint64_t>
+{
+    static constexpr uint32_t nLanes = 8;
+    static constexpr uint32_t nLinearLimit = 32;
+
+    static uint32_t count_less( uint64_t k, uint64_t const *keys, uint32_t step )
+    {
+        __m256i const idx = _mm256_mullo_epi32(_mm256_set1_epi32(step),
+            _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8));
+        __m512i const pivots = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), __mmask8(0xFF), idx, keys - 1, 8);
+        return __builtin_popcount(_mm512_cmplt_epu64_mask(pivots, _mm512_set1_epi64(k)));
+    }
+
+    static uint64_t const *scan( uint64_t k, uint64_t const *keys, uint32_t n )
+    {
+        __m512i const vk = _mm512_set1_epi64(k);
+        for( uint32_t i = 0; i < n; i += nLanes )
+        {
+            __mmask8 const lmask = n - i >= nLanes ? __mmask8(0xFF) : __mmask8((1U << (n - i)) - 1);
+            __m512i const v = _mm512_maskz_loadu_epi64(lmask, keys + i);
+            __mmask8 const eq = _mm512_mask_cmpeq_epi64_mask(lmask, v, vk);
+            if( eq )
+                return keys + i + __builtin_ctz(eq);
+        }
+        return nullptr;
+    }
+};
+
+#else // AVX2
+
+template<>
+struct SimdLocate<uint32_t>
+{
+    static constexpr uint32_t nLanes = 8;
+    static constexpr uint32_t nLinearLimit = 64;
+
+    static uint32_t count_less( uint32_t k, uint32_t const *keys, uint32_t step )
+    {
+        __m256i const idx = _mm256_mullo_epi32(_mm256_set1_epi32(step),
+            _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8));
+        __m256i const pivots = _mm256_i32gather_epi32(reinterpret_cast<int const*>(keys - 1), idx, 4);
+        // AVX2 has only signed compare, so flip sign bits
+        __m256i const sign = _mm256_set1_epi32(int(0x80000000));
+        __m256i const gt = _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_set1_epi32(k), sign),
+                                              _mm256_xor_si256(pivots, sign));
+        return __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+    }
+
+    static uint32_t const *scan( uint32_t k, uint32_t const *keys, uint32_t n )
+    {
+        __m256i const vk = _mm256_set1_epi32(k);
+        uint32_t i = 0;
+        for( ; i + nLanes <= n; i += nLanes )
+        {
+            __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i));
+            uint32_t const eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vk)));
+            if( eq )
+                return keys + i + __builtin_ctz(eq);
+        }
+        // scalar tail, avoid reading out of the keys range
+        for( ; i < n; ++i )
+        {
+            if( keys[i] == k )
+                return keys + i;
+        }
+        return nullptr;
+    }
+};
+
+template<>
+struct SimdLocate<uint64_t>
+{
+    static constexpr uint32_t nLanes = 4;
+    static constexpr uint32_t nLinearLimit = 32;
+
+    static uint32_t count_less( uint64_t k, uint64_t const *keys, uint32_t step )
+    {
+        __m256i const idx = _mm256_mul_epu32(_mm256_set1_epi64x(step), _mm256_setr_epi64x(1, 2, 3, 4));
+        __m256i const pivots = _mm256_i64gather_epi64(reinterpret_cast<long long const*>(keys - 1), idx, 8);
+        __m256i const sign = _mm256_set1_epi64x(int64_t(0x8000000000000000ULL));
+        __m256i const gt = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_set1_epi64x(k), sign),
+                                              _mm256_xor_si256(pivots, sign));
+        return __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+    }
+
+    static uint64_t const *scan( uint64_t k, uint64_t const *keys, uint32_t n )
+    {
+        __m256i const vk = _mm256_set1_epi64x(k);
+        uint32_t i = 0;
+        for( ; i + nLanes <= n; i += nLanes )
+        {
+            __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i));
+            uint32_t const eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, vk)));
+            if( eq )
+                return keys + i + __builtin_ctz(eq);
+        }
+        for( ; i < n; ++i )
+        {
+            if( keys[i] == k )
+                return keys + i;
+        }
+        return nullptr;
+    }
+};
+
+#endif
+
+template<typename Key>
+inline Key const* simd_locate( Key const k, Key const * __restrict__ keys, uint32_t u )
+{
+    typedef typename std::conditional<sizeof(Key) == 4, uint32_t, uint64_t>::type ukey_t;
+    typedef SimdLocate<ukey_t> simd_t;
+
+    ukey_t const *base = reinterpret_cast<ukey_t const*>(keys);
+    // k-ary narrowing: split range into nLanes + 1 segments,
+    // last key of each first nLanes segments is a pivot
+    while( u > simd_t::nLinearLimit )
+    {
+        uint32_t const step = u / (simd_t::nLanes + 1);
+        uint32_t const nless = simd_t::count_less(ukey_t(k), base, step);
+        base += nless * step;
+        u = nless == simd_t::nLanes ? u - simd_t::nLanes * step : step;
+    }
+
+    return reinterpret_cast<Key const*>(simd_t::scan(ukey_t(k), base, u));
+}
+
+#endif
+
+// in-bucket key search, use SIMD version if it was enabled at compile time
+// (SIMD compares are unsigned, so signed keys always use binary search)
+template<typename Key>
+inline Key const* locate( Key const k, Key const * __restrict__ keys, uint32_t u )
+{
+#if defined(__AVX512F__) || defined(__AVX2__)
+    if constexpr( std::is_unsigned<Key>::value )
+        return simd_locate(k, keys, u);
+#endif
+    return binary_locate(k, keys, u);
+}
+
+/* Eytzinger layout: keys[0] is a root, children of (1-based) node i
+ * are 2i and 2i+1. Descent is branchless and next levels are prefetched,
+ * 64 bytes line holds 4(8-byte keys) or 5(4-byte keys) levels of subtree.
+ */
+
+// reorder sorted src into Eytzinger order, return next src index
+template<typename T>
+inline size_t eytzinger_fill( T const *src, T *dst, size_t i, size_t node, size_t n )
+{
+    if( node <= n )
+    {
+        i = eytzinger_fill(src, dst, i, 2 * node, n);
+        dst[node - 1] = src[i++];
+        i = eytzinger_fill(src, dst, i, 2 * node + 1, n);
+    }
+    return i;
+}
+
+template<typename Key>
+inline Key const* eytzinger_locate( Key const k, Key const * __restrict__ keys, uint32_t n )
+{
+    // empty bucket could have null keys
+    if( 0 == n )
+        return nullptr;
+    // keys per cache line, prefetch node i * nLine is the first
+    // descendant of i located log2(nLine) levels below
+    size_t const nLine = 64 / sizeof(Key);
+    uint8_t const *bytes = reinterpret_cast<uint8_t const*>(keys - 1);
+    size_t i = 1;
+    while( i <= n )
+    {
+        __builtin_prefetch(bytes + i * nLine * sizeof(Key));
+        i = 2 * i + (keys[i - 1] < k);
+    }
+    // drop right turns made after last left turn, result is lower bound
+    i >>= __builtin_ffsl(~i);
+
+    return (i != 0 && keys[i - 1] == k) ? keys + i - 1 : nullptr;
+}
+
 } // namespace detail
 
 /****************************************/
@@ -43,9 +272,11 @@ class HAMapIndexer : private detail::KVCheck<Key, Value>
 {
 private:
     typedef std::pair<Key, Value>               kv_pair_t;
-    typedef std::vector< kv_pair_t >            bucket_kv_array_t;
-    typedef std::vector< bucket_kv_array_t >    bucket_array_t;
     typedef std::vector< kv_pair_t >            unsorted_records_list_t;
+    typedef detail::BucketPartition<kv_pair_t>  bucket_partition_t;
+    typedef detail::RecordSpan<kv_pair_t>       bucket_span_t;
+    typedef detail::RunSpiller<Key, Value>      spiller_t;
+    typedef detail::BucketStats<Value>          bucket_stats_t;
 public:
     /* pass here total number of records will be indexed or zero if you don't know */
     HAMapIndexer
@@ -53,11 +284,17 @@ public:
         size_t total_records_known_at_creation = 0UL, 
         size_t const page_size = DEFAULT_PAGE_SIZE
     )
-        : buckets_( detail::calc_buckets_count(sizeof(kv_pair_t) * total_records_known_at_creation
+        : nbuckets_( detail::calc_buckets_count(sizeof(kv_pair_t) * total_records_known_at_creation
                     , page_size) )
-        , hash_mask_( !buckets_.empty() ? buckets_.size() - 1 : 0 )
+        , hash_mask_( nbuckets_ ? nbuckets_ - 1 : 0 )
+        , layout_(BUCKET_LAYOUT_SORTED)
+        , dir_format_(DIRECTORY_FORMAT_AUTO)
+        , nthreads_(1)
+        , multimap_(false)
+        , filter_bits_(0)
         {
-            DBG( std::cerr << "HAMapIndexer nbuckets=" << buckets_.size() << std::endl );
+            DBG( std::cerr << "HAMapIndexer nbuckets=" << nbuckets_ << std::endl );
+            unsorted_records_.reserve(total_records_known_at_creation);
         }
     
     void add( std::pair<Key, Value> const &p )
@@ -67,40 +304,71 @@ public:
 
     size_t get_hash_mask() const { return hash_mask_; }
 
-    bucket_kv_array_t const& get_bucket_arr( size_t i ) const { return buckets_[i]; }
+    /* select order of keys inside of buckets, stored in footer */
+    void set_layout( BucketLayout layout ) { layout_ = layout; }
+
+    /* multimap mode: duplicate keys are kept, all values of a key are
+     * stored contiguously and returned by HAMapSearcher::equal_range,
+     * sorted layout is forced
+     */
+    void set_multimap( bool enable ) { multimap_ = enable; }
+
+    /* emit per-bucket filter of about bits_per_key(4-10 are reasonable) bits
+     * per record, searchers check it before bucket is touched, so most of
+     * absent keys are rejected by one word read, zero disables filter
+     */
+    void set_filter_bits( uint32_t bits_per_key ) { filter_bits_ = bits_per_key; }
+
+    /* directory entries format, tiny one is used by default if limits allow,
+     * Elias-Fano one is the smallest, but a bit slower to decode
+     */
+    void set_directory_format( DirectoryFormat format ) { dir_format_ = format; }
+
+    /* number of threads used to sort and encode buckets by compact_and_store,
+     * output does not depend on it
+     */
+    void set_threads( size_t nthreads ) { nthreads_ = std::max(size_t(1), nthreads); }
+
+    /* external memory build: once records take memory_bytes they are sorted
+     * and spilled into temporary file in tmp_dir, compact_and_store merges
+     * spilled runs, output is the same. Spilled runs are partitioned by buckets,
+     * so pass total records count to constructor, otherwise runs are
+     * re-partitioned once more at compaction.
+     * Budget bounds records storage(reserved at once, records are sorted in
+     * place), merge uses it for read buffers and windows of buckets, bucket
+     * stats and sort buffer of the largest bucket are taken above it.
+     */
+    void set_memory_budget( size_t memory_bytes, std::string const &tmp_dir = "/tmp" )
+    {
+        if( spiller_ && !spiller_->empty() )
+            throw std::runtime_error("[HAMapIndexer] memory budget must be set before spilling");
+        spiller_.reset(new spiller_t(tmp_dir, memory_bytes, false, false));
+        // storage of records is taken once, so vector growth does not exceed budget
+        unsorted_records_.reserve(std::max(unsorted_records_.size(), memory_bytes / sizeof(kv_pair_t)));
+    }
     
     void add( Key k, Value v )
     {
-        if( !buckets_.empty() )
-        {
-            size_t const bucket_idx = k & hash_mask_;
-            buckets_[bucket_idx].emplace_back(k, v);
-        }
-        else
-        {
-            unsorted_records_.emplace_back(k, v);
-        }
+        unsorted_records_.emplace_back(k, v);
+        // spill before the next record would not fit into reserved storage
+        if( spiller_ && (unsorted_records_.size() + 1) * sizeof(kv_pair_t) > spiller_->get_memory_budget() )
+            spill();
     }
 
     void clear()
     {
         unsorted_records_.clear();
         unsorted_records_.shrink_to_fit();
+        if( spiller_ )
+        {
+            spiller_->reset();
+            unsorted_records_.reserve(spiller_->get_memory_budget() / sizeof(kv_pair_t));
+        }
     }
     
-    /* WARN: size calculated on the fly! */
     size_t size() const
     {
-        size_t sz = 0;
-        if( !buckets_.empty() )
-        {
-            for( auto const &b : buckets_ )
-                sz += b.size();
-        }
-        else
-            sz = unsorted_records_.size();
-        
-        return sz;
+        return unsorted_records_.size() + (spiller_ ? spiller_->size() : 0);
     }
     
     std::vector<uint8_t> get_compacted( size_t const page_size = DEFAULT_PAGE_SIZE )
@@ -111,47 +379,160 @@ public:
         return buffer;
     }
 
-    void compact_and_store( utils::OStreamProxy &os, size_t const page_size )
+    // compact map into cache line aligned memory of exact size, searcher adopts it without copy
+    utils::MemoryHolder get_compacted_memory( size_t const page_size = DEFAULT_PAGE_SIZE )
+    {
+        utils::MemoryHolder mem = utils::MemoryHolder::mk_aligned(get_compacted_size(page_size));
+        utils::OStreamProxy os(mem.get_ptr<void>(), mem.get_mem_size());
+        compact_and_store(os, page_size);
+        return mem;
+    }
+
+    // compact map directly into file, see utils::FileSinkType
+    void store( std::string const &path, size_t const page_size = DEFAULT_PAGE_SIZE, 
+                utils::FileSinkType type = utils::FILE_SINK_MMAP )
+    {
+        utils::OStreamProxy os(path, type);
+        compact_and_store(os, page_size);
+        os.close();
+    }
+
+    // exact size of compacted map in bytes
+    size_t get_compacted_size( size_t const page_size = DEFAULT_PAGE_SIZE )
     {
-        if( !buckets_.empty() )
+        size_t const nbuckets = get_nbuckets(page_size);
+        if( spiller_ && !spiller_->empty() )
         {
-            // use predefined set size
-            flush_buckets(os, buckets_);
+            prepare_spilled(nbuckets);
+            return get_output_size(spiller_->get_stats());
         }
-        else
-        {
-            // make index from unsorted_records_list_t
-            size_t const nrec = unsorted_records_.size();
-            
-            // always return pow of 2 nbuckets value!
-            size_t const nbuckets = detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * nrec, page_size);
-            size_t const hash_mask = nbuckets - 1;
-            
-            bucket_array_t buckets(nbuckets);
-            
-            for( auto const & p : unsorted_records_ )
-            {
-                size_t const bucket_idx = p.first & hash_mask;
-                buckets[bucket_idx].emplace_back(p);
-            }
+        return get_output_size(get_stats(nbuckets));
+    }
 
-            os.prealloc
-            (
-                sizeof(BucketEntry) * buckets.size() 
-                + nrec * (sizeof(Key) + sizeof(Value))
-                + 1 /* footer */
-            );
-            
-            flush_buckets(os, buckets);
+    void compact_and_store( utils::OStreamProxy &os, size_t const page_size )
+    {
+        size_t const nbuckets = get_nbuckets(page_size);
+
+        if( spiller_ && !spiller_->empty() )
+        {
+            compact_spilled(os, nbuckets);
+            return;
         }
+
+        bucket_stats_t const stats = get_stats(nbuckets);
+        detail::DirectoryPlan const dir = get_directory_plan(stats);
+        os.prealloc(get_output_size(stats));
+        
+        bucket_partition_t buckets(unsorted_records_, nbuckets);
+        detail::BucketFilterWriter filter(nbuckets, dir.filter);
+        
+        detail::write_directory(os, nbuckets, dir, get_bucket_sizes(stats));
+        flush_buckets(os, buckets, dir, false, filter);
+        flush_footer(os, nbuckets, dir, filter);
     }
     
 private:
+
+    // use predefined set size or make it from records count,
+    // always return pow of 2 nbuckets value!
+    size_t get_nbuckets( size_t const page_size ) const
+    {
+        return nbuckets_ ? nbuckets_ 
+             : detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * size(), page_size);
+    }
+
+    bucket_stats_t make_stats( size_t const nbuckets ) const
+    {
+        return bucket_stats_t(nbuckets);
+    }
+
+    bucket_stats_t get_stats( size_t const nbuckets ) const
+    {
+        bucket_stats_t stats = make_stats(nbuckets);
+        stats.add(unsorted_records_);
+        return stats;
+    }
+
+    // (records count, bytes) of bucket i
+    static auto get_bucket_sizes( bucket_stats_t const &stats )
+    {
+        return [&stats]( size_t i ) {
+            uint32_t const nkeys = stats.bucket_size(i);
+            return std::make_pair(nkeys, uint64_t(nkeys) * (sizeof(Key) + sizeof(Value)));
+        };
+    }
+
+    detail::DirectoryPlan get_directory_plan( bucket_stats_t const &stats ) const
+    {
+        detail::DirectoryPlan plan = detail::plan_directory(dir_format_, stats.nbuckets(), get_bucket_sizes(stats));
+        plan.filter = detail::BucketFilterParams::mk(stats.size(), stats.nbuckets(), filter_bits_);
+        return plan;
+    }
+
+    size_t get_output_size( bucket_stats_t const &stats ) const
+    {
+        detail::DirectoryPlan const dir = get_directory_plan(stats);
+        return detail::get_buckets_area_size(stats.nbuckets(), dir, get_bucket_sizes(stats))
+             + detail::get_footer_size(0, get_footer_ext(stats.nbuckets(), dir));
+    }
+
+    void spill()
+    {
+        size_t nbuckets = spiller_->nbuckets();
+        if( 0 == nbuckets )
+        {
+            nbuckets = nbuckets_ ? nbuckets_ 
+                     : detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * unsorted_records_.size(), DEFAULT_PAGE_SIZE);
+        }
+        spiller_->spill(unsorted_records_, nbuckets);
+    }
+
+    // spill the rest of records, runs must be partitioned by final buckets count
+    void prepare_spilled( size_t const nbuckets )
+    {
+        spiller_->spill(unsorted_records_, spiller_->nbuckets());
+        // records storage is not needed anymore, merge takes the budget
+        unsorted_records_.shrink_to_fit();
+        if( spiller_->nbuckets() != nbuckets )
+            spiller_->repartition(nbuckets);
+    }
+
+    // merge spilled runs by windows of buckets, records of them are sorted already
+    void compact_spilled( utils::OStreamProxy &os, size_t const nbuckets )
+    {
+        prepare_spilled(nbuckets);
+        compact_sorted(os, spiller_->get_stats(), [this]( auto &&on_window ) {
+            spiller_->merge(on_window);
+        });
+    }
+
+    /* write buckets, which are sorted already and described by stats,
+     * merge(on_window) passes consecutive windows of buckets
+     * to on_window(partition, first_bucket)
+     */
+    template<typename MergeFunc>
+    void compact_sorted( utils::OStreamProxy &os, bucket_stats_t const &stats, MergeFunc &&merge )
+    {
+        size_t const nbuckets = stats.nbuckets();
+        detail::DirectoryPlan const dir = get_directory_plan(stats);
+        os.prealloc(get_output_size(stats));
+        detail::BucketFilterWriter filter(nbuckets, dir.filter);
+
+        detail::write_directory(os, nbuckets, dir, get_bucket_sizes(stats));
+        merge([this, &os, &dir, &filter]( bucket_partition_t &buckets, size_t ) {
+            flush_buckets(os, buckets, dir, true, filter);
+        });
+        flush_footer(os, nbuckets, dir, filter);
+    }
     
-    static void flush_bucket( utils::OStreamProxy &os, bucket_kv_array_t &b )
+    static void flush_bucket( utils::OStreamProxy &os, bucket_span_t const &b, BucketLayout layout )
     {
-        // each bucket must sorted by key before get flushed
-        std::sort(b.begin(), b.end());
+        if( BUCKET_LAYOUT_EYTZINGER == layout )
+        {
+            unsorted_records_list_t eb(b.size());
+            detail::eytzinger_fill(b.data(), eb.data(), 0, 1, b.size());
+            std::copy(eb.begin(), eb.end(), b.begin());
+        }
         
         // store keys and values separatly
         
@@ -162,41 +543,64 @@ private:
         // and apply bit packing for each range
         
     }
-    
-    static void flush_buckets( utils::OStreamProxy &os, bucket_array_t &buckets )
+
+    BucketLayout get_layout() const { return multimap_ ? BUCKET_LAYOUT_SORTED : layout_; }
+
+    void flush_buckets( utils::OStreamProxy &os, bucket_partition_t &buckets, detail::DirectoryPlan const &dir, bool sorted,
+                        detail::BucketFilterWriter &filter ) const
     {
-        size_t const nbuckets = buckets.size();
-        uint8_t n = 0;
-        if( nbuckets )
-        {
-            // write buckets index
-            BucketEntry be;
-            uint64_t offs = sizeof(BucketEntry) * buckets.size();
-            for( auto const &b : buckets )
-            {
-                uint32_t nkeys = b.size();
-                be.offset = offs;
-                be.nkeys = nkeys;
-                os << be;
-                offs += nkeys * (sizeof(Key) + sizeof(Value));
-            }
+        size_t const nbuckets = buckets.nbuckets();
+        if( 0 == nbuckets )
+            return;
 
-            // write each bucket
-            for( auto &b : buckets )
-                flush_bucket(os, b);
+        // each bucket must sorted by key before get flushed,
+        // lower key bits are equal inside of bucket
+        uint32_t const key_shift = utils::maxbits(nbuckets) - 1;
+        BucketLayout const layout = get_layout();
+        detail::flush_parallel(os, nbuckets, nthreads_, 
+            [&buckets, key_shift, layout, &dir, sorted, &filter]( size_t i, utils::OStreamProxy &bos ) {
+                auto const b = buckets.bucket(i);
+                if( !sorted )
+                    detail::sort_bucket(b.data(), b.size(), key_shift);
+                for( auto const &p : b )
+                    filter.add(p.first);
+                flush_bucket(bos, b, layout);
+                detail::write_bucket_padding(bos, dir, b.size() * (sizeof(Key) + sizeof(Value)));
+            });
+    }
 
-            // use footer, to keep alignment fine.
-            // write footer
-            // store only N from: buckets = 2 ** (N - 1)
-            n = utils::maxbits(nbuckets) - 1;
-        }
-        os << n;
+    FooterExt get_footer_ext( size_t const nbuckets, detail::DirectoryPlan const &dir ) const
+    {
+        FooterExt ext = {};
+        if( nbuckets && BUCKET_LAYOUT_EYTZINGER == get_layout() )
+            ext.flags |= FOOTER_FLAG_EYTZINGER;
+        if( multimap_ )
+            ext.flags |= FOOTER_FLAG_MULTIMAP;
+        dir.fill_ext(ext);
+        return ext;
+    }
+
+    void flush_footer( utils::OStreamProxy &os, size_t const nbuckets, detail::DirectoryPlan const &dir,
+                       detail::BucketFilterWriter const &filter ) const
+    {
+        filter.write(os);
+        // use footer, to keep alignment fine.
+        detail::write_footer(os, nbuckets, 0, get_footer_ext(nbuckets, dir));
     }
     
 private:
+    // merge of map files writes buckets by compact_sorted, see mergemap.hpp
+    template<typename, typename, typename, typename> friend class MapMerger;
+
     unsorted_records_list_t             unsorted_records_;
-    bucket_array_t                      buckets_;
+    size_t const                        nbuckets_;
     size_t const                        hash_mask_;
+    BucketLayout                        layout_;
+    DirectoryFormat                     dir_format_;
+    size_t                              nthreads_;
+    bool                                multimap_;
+    uint32_t                            filter_bits_;
+    std::unique_ptr<spiller_t>          spiller_;
 };
 
 template<typename Key, typename Value>
@@ -208,35 +612,98 @@ public:
     HAMapSearcher( std::istream &is )
         : bi_(is)
         , mask_(bi_.get_mask())
+        , layout_(get_layout(bi_))
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , mode_(SEARCH_MODE_BINARY)
+        {}
+
+    /* construct searcher from file path, file is mapped into memory(zero-copy)
+     */
+    HAMapSearcher( std::string const &path )
+        : bi_(utils::MemoryReader(path))
+        , mask_(bi_.get_mask())
+        , layout_(get_layout(bi_))
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , mode_(SEARCH_MODE_BINARY)
+        {}
+    
+    /* construct searcher from memory image of the map
+     */
+    explicit HAMapSearcher( utils::MemoryReader rdr )
+        : bi_(std::move(rdr))
+        , mask_(bi_.get_mask())
+        , layout_(get_layout(bi_))
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , mode_(SEARCH_MODE_BINARY)
         {}
     
     /* usefull for tests and other */
     HAMapSearcher( HAMapIndexer<Key, Value> &idx )
-        : bi_(idx.get_compacted())
+        : bi_(utils::MemoryReader(idx.get_compacted_memory()))
         , mask_(bi_.get_mask())
+        , layout_(get_layout(bi_))
+        , multimap_((bi_.get_flags() & FOOTER_FLAG_MULTIMAP) != 0)
+        , mode_(SEARCH_MODE_BINARY)
         {}
     
-    // unique key mode(get first equal key)
+    /* select in-bucket search algorithm, 
+     * used only for sorted layout, Eytzinger has own search
+     */
+    void set_search_mode( SearchMode mode ) { mode_ = mode; }
+
+    // unique key mode(any equal key), in multimap mode the first value of key
     // return pointer to found value or nullptr if not found!
     Value const* search( Key k ) const
     {
+        size_t const i = k & mask_;
+        if( !bi_.may_contain(i, k) )
+            return nullptr;
+        auto const o = bi_.get( i );
+        return search_bucket(k, bi_.get_data_start() + o.offset, o.nkeys);
+    }
+
+    /* return [first, last) span of all values of key k, it is empty if not found,
+     * works for any sorted layout map, duplicate keys are stored by multimap mode
+     */
+    std::pair<Value const*, Value const*> equal_range( Key k ) const
+    {
+        if( BUCKET_LAYOUT_SORTED != layout_ )
+            throw std::runtime_error("[HAMapSearcher] equal_range requires sorted layout");
+        if( !bi_.may_contain(k & mask_, k) )
+            return std::make_pair(nullptr, nullptr);
+
         auto const o = bi_.get( k & mask_ );
-        // convert it into key offsets
         Key const *start = reinterpret_cast<Key const*>(bi_.get_data_start() + o.offset);
-        
-        auto it = detail::binary_locate(k, start, o.nkeys);
+        auto const r = std::equal_range(start, start + o.nkeys, k);
+        Value const *value_ptr = reinterpret_cast<Value const*>(start + o.nkeys);
+        return std::make_pair(value_ptr + (r.first - start), value_ptr + (r.second - start));
+    }
 
-        if( nullptr != it )
-        {
-            // retrieve value by offset
-            // detect offset value by iter
-            size_t const offs = std::distance(start, it);
-            // this is uncompressed version so just increment keys pointer
-            Value const *value_ptr = reinterpret_cast<Value const*>(start + o.nkeys);
-            return value_ptr + offs;
-        }
-        
-        return nullptr;
+    bool is_multimap() const { return multimap_; }
+
+    /* batched lookup, out_values[i] = search(keys[i])
+     * keys are processed by groups in stages, so cache misses
+     * on directory and buckets of different keys are overlapped.
+     * return number of found keys
+     */
+    size_t search_batch( Key const *keys, size_t n, Value const **out_values ) const
+    {
+        size_t nfound = 0;
+        visit_batch(keys, n, [this, keys, out_values, &nfound]( size_t j, uint8_t const *bucket, uint32_t nkeys ) {
+            Value const *v = search_bucket(keys[j], bucket, nkeys);
+            out_values[j] = v;
+            nfound += (nullptr != v);
+        });
+        return nfound;
+    }
+
+    // batched locate(), out_positions[i] = locate(keys[i])
+    void locate_batch( Key const *keys, size_t n, std::optional<uint32_t> *out_positions ) const
+    {
+        visit_batch(keys, n, [this, keys, out_positions]( size_t j, uint8_t const *bucket, uint32_t nkeys ) {
+            uint32_t const pos = locate_bucket(keys[j], bucket, nkeys);
+            out_positions[j] = pos < nkeys ? std::optional<uint32_t>(pos) : std::nullopt;
+        });
     }
     
     // return number of records!
@@ -249,9 +716,160 @@ public:
     {
         return bi_.get_mem_size();
     }
+
+    size_t get_nbuckets() const { return bi_.get_nbuckets(); }
+    uint32_t get_bucket_size( size_t i ) const { return bi_.get(i).nkeys; }
+    // build settings of the map(flags, directory and filter params)
+    FooterExt const& get_footer_ext() const { return bi_.get_ext(); }
+
+    // position of record found by search(k) in its bucket(k & mask)
+    std::optional<uint32_t> locate( Key k ) const
+    {
+        size_t const i = k & mask_;
+        if( !bi_.may_contain(i, k) )
+            return std::nullopt;
+        auto const o = bi_.get( i );
+        uint32_t const pos = locate_bucket(k, bi_.get_data_start() + o.offset, o.nkeys);
+        return pos < o.nkeys ? std::optional<uint32_t>(pos) : std::nullopt;
+    }
+
+    // value of record pos of bucket i
+    Value const* get_value_at( size_t i, uint32_t pos ) const
+    {
+        auto const o = bi_.get( i );
+        Key const *start = reinterpret_cast<Key const*>(bi_.get_data_start() + o.offset);
+        return reinterpret_cast<Value const*>(start + o.nkeys) + pos;
+    }
+
+    // [first, last) positions of records of key k in its bucket(k & mask)
+    std::pair<uint32_t, uint32_t> locate_range( Key k ) const
+    {
+        auto const o = bi_.get( k & mask_ );
+        Key const *start = reinterpret_cast<Key const*>(bi_.get_data_start() + o.offset);
+        if( BUCKET_LAYOUT_EYTZINGER == layout_ )
+        {
+            Key const *it = detail::eytzinger_locate(k, start, o.nkeys);
+            uint32_t const pos = it ? uint32_t(it - start) : 0;
+            return std::make_pair(pos, it ? pos + 1 : pos);
+        }
+        auto const r = std::equal_range(start, start + o.nkeys, k);
+        return std::make_pair(uint32_t(r.first - start), uint32_t(r.second - start));
+    }
+
+    // append records of bucket i to out, in stored order
+    void decode_bucket( size_t i, std::vector<std::pair<Key, Value>> &out ) const
+    {
+        auto const o = bi_.get(i);
+        Key const *keys = reinterpret_cast<Key const*>(bi_.get_data_start() + o.offset);
+        Value const *values = reinterpret_cast<Value const*>(keys + o.nkeys);
+        for( uint32_t j = 0; j < o.nkeys; ++j )
+            out.emplace_back(keys[j], values[j]);
+    }
+private:
+    static BucketLayout get_layout( detail::BucketIndex const &bi )
+    {
+        return (bi.get_flags() & FOOTER_FLAG_EYTZINGER) ? BUCKET_LAYOUT_EYTZINGER : BUCKET_LAYOUT_SORTED;
+    }
+
+    // stages of batched lookups, func(j, bucket, nkeys) searches keys[j] in its prefetched bucket
+    template<typename Func>
+    void visit_batch( Key const *keys, size_t n, Func &&func ) const
+    {
+        uint8_t const *buckets[SEARCH_BATCH_GROUP];
+        uint32_t nkeys[SEARCH_BATCH_GROUP];
+
+        for( size_t g = 0; g < n; g += SEARCH_BATCH_GROUP )
+        {
+            size_t const gsz = std::min(n - g, size_t(SEARCH_BATCH_GROUP));
+            Key const *gkeys = keys + g;
+            
+            // stage 1: prefetch directory entries and filter words
+            for( size_t i = 0; i < gsz; ++i )
+            {
+                bi_.prefetch(gkeys[i] & mask_);
+                bi_.prefetch_filter(gkeys[i] & mask_, gkeys[i]);
+            }
+            
+            // stage 2: resolve buckets and prefetch first probe of the search
+            for( size_t i = 0; i < gsz; ++i )
+            {
+                // key filtered out is searched in empty bucket
+                if( !bi_.may_contain(gkeys[i] & mask_, gkeys[i]) )
+                {
+                    buckets[i] = bi_.get_data_start();
+                    nkeys[i] = 0;
+                    continue;
+                }
+                auto const o = bi_.get(gkeys[i] & mask_);
+                buckets[i] = bi_.get_data_start() + o.offset;
+                nkeys[i] = o.nkeys;
+                // binary search starts from middle key, Eytzinger and interpolation ones
+                // from the first key(interpolation reads the last key too)
+                Key const *bkeys = reinterpret_cast<Key const*>(buckets[i]);
+                if( BUCKET_LAYOUT_SORTED == layout_ && SEARCH_MODE_BINARY == mode_ )
+                    __builtin_prefetch(bkeys + (nkeys[i] >> 1));
+                else
+                    __builtin_prefetch(bkeys);
+                if( SEARCH_MODE_INTERPOLATION == mode_ && nkeys[i] )
+                    __builtin_prefetch(bkeys + nkeys[i] - 1);
+            }
+
+            // stage 3: search, data is expected to be in cache already
+            for( size_t i = 0; i < gsz; ++i )
+                func(g + i, buckets[i], nkeys[i]);
+        }
+    }
+
+    Value const* search_bucket( Key k, uint8_t const *bucket, uint32_t nkeys ) const
+    {
+        uint32_t const offs = locate_bucket(k, bucket, nkeys);
+        if( offs < nkeys )
+        {
+            // this is uncompressed version so values just follow keys
+            Value const *value_ptr = reinterpret_cast<Value const*>(reinterpret_cast<Key const*>(bucket) + nkeys);
+            return value_ptr + offs;
+        }
+        return nullptr;
+    }
+
+    // return position of found key or nkeys if not found
+    uint32_t locate_bucket( Key k, uint8_t const *bucket, uint32_t nkeys ) const
+    {
+        // convert it into key offsets
+        Key const *start = reinterpret_cast<Key const*>(bucket);
+        
+        Key const *it;
+        if( BUCKET_LAYOUT_EYTZINGER == layout_ )
+            it = detail::eytzinger_locate(k, start, nkeys);
+        else if( multimap_ )
+        {
+            // first of equal keys
+            it = std::lower_bound(start, start + nkeys, k);
+            if( it == start + nkeys || *it != k )
+                it = nullptr;
+        }
+        else if( SEARCH_MODE_INTERPOLATION == mode_ )
+        {
+            uint32_t const pos = detail::interpolation_locate(k, start, nkeys);
+            it = pos < nkeys ? start + pos : nullptr;
+        }
+        else
+            it = detail::locate(k, start, nkeys);
+
+        // detect offset value by iter
+        return nullptr != it ? uint32_t(std::distance(start, it)) : nkeys;
+    }
 private:
+    // disk resident searcher reuses directory and in-bucket search
+    template<typename, typename, typename> friend class DiskSearcher;
+    // coroutine lookups, see asyncmap.hpp
+    friend struct SearcherAccess;
+
     detail::BucketIndex const bi_;
     Key                 const mask_;
+    BucketLayout        const layout_;
+    bool                const multimap_;
+    SearchMode                mode_;
 };
 
 
@@ -4,15 +4,28 @@
 #include <stdint.h>
 #include <memory>
 #include <fstream>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <new>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace utils {
 
+// start of memory allocated by MemoryHolder::mk_aligned()
+size_t const CACHE_LINE_SIZE = 64;
+
 enum DeleterType
 {
     DELETER_TYPE_NONE           = 0,
     DELETER_TYPE_FREE           = 1, // using free()
     DELETER_TYPE_DELETEARRAY    = 2, // using delete[]
-    DELETER_TYPE_UNMAP          = 3,
+    DELETER_TYPE_UNMAP          = 3, // using munmap(), mem_size is required
     DELETER_TYPE_PTR_MASK       = 0x3 
 };
 
@@ -57,6 +70,9 @@ public:
                 case DELETER_TYPE_DELETEARRAY:
                     delete[] get_ptr<uint8_t>();
                     break;
+                case DELETER_TYPE_UNMAP:
+                    munmap(get_ptr<void>(), mem_size_);
+                    break;
                 case DELETER_TYPE_NONE:
                 default:
                     break;
@@ -69,13 +85,16 @@ public:
         return MemoryHolder(size_t(p.release()), DELETER_TYPE_DELETEARRAY);
     }
 
-    // sadly, but we need to make copy here
+    // sadly, but we need to make copy here(vector can't release its buffer),
+    // write into mk_aligned() memory directly to avoid it
     static MemoryHolder mk( std::vector<uint8_t> && buffer )
     {
         size_t const mem_sz = buffer.size();
-        uint8_t *p = new uint8_t[mem_sz];
-        memcpy(p, buffer.data(), mem_sz);
-        return MemoryHolder(size_t(p), DELETER_TYPE_DELETEARRAY, mem_sz);
+        MemoryHolder h = mk_aligned(mem_sz);
+        memcpy(h.get_ptr<uint8_t>(), buffer.data(), mem_sz);
+        buffer.clear();
+        buffer.shrink_to_fit();
+        return h;
     }
 
     static MemoryHolder mk( size_t mem_size_in_bytes )
@@ -83,6 +102,15 @@ public:
         return MemoryHolder(size_t(new uint8_t[mem_size_in_bytes]), DELETER_TYPE_DELETEARRAY, mem_size_in_bytes);
     }
 
+    // memory starting at cache line boundary, released by free()
+    static MemoryHolder mk_aligned( size_t mem_size_in_bytes )
+    {
+        void *p = nullptr;
+        if( posix_memalign(&p, CACHE_LINE_SIZE, std::max(mem_size_in_bytes, size_t(1))) != 0 )
+            throw std::bad_alloc();
+        return MemoryHolder(size_t(p), DELETER_TYPE_FREE, mem_size_in_bytes);
+    }
+
     template<typename T>
     static MemoryHolder mk( T const *ptr, size_t mem_sz = 0 )
     {
@@ -95,6 +123,31 @@ public:
         return MemoryHolder(size_t(ptr), DELETER_TYPE_FREE, mem_sz);
     }
 
+    // map whole file into memory(read only, shared between processes)
+    static MemoryHolder mk_mapped( std::string const &path )
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if( fd < 0 )
+            throw std::runtime_error("[MemoryHolder] failed to open: " + path);
+
+        struct stat st;
+        if( fstat(fd, &st) != 0 || st.st_size <= 0 )
+        {
+            ::close(fd);
+            throw std::runtime_error("[MemoryHolder] failed to stat or empty file: " + path);
+        }
+
+        size_t const mem_sz = st.st_size;
+        void *p = mmap(nullptr, mem_sz, PROT_READ, MAP_SHARED, fd, 0);
+        // mapping keeps file referenced, so descriptor is not needed anymore
+        ::close(fd);
+
+        if( MAP_FAILED == p )
+            throw std::runtime_error("[MemoryHolder] failed to mmap: " + path);
+
+        return MemoryHolder(size_t(p), DELETER_TYPE_UNMAP, mem_sz);
+    }
+
     template<typename T>
     T * get_ptr() const
     {
@@ -119,7 +172,7 @@ public:
         init from std::istream(reads whole file into memory)
         */
     MemoryReader( std::istream &is )
-        : mholder_(MemoryHolder::mk(file_size_from_current_to_end(is)))
+        : mholder_(MemoryHolder::mk_aligned(file_size_from_current_to_end(is)))
         , mem_(mholder_.get_ptr<uint8_t>())
     {
         if( !is.read( mholder_.get_ptr<char>(), mholder_.get_mem_size() ).good() )
@@ -138,6 +191,14 @@ public:
         mem_ += by;
     }
     
+    /*
+        init from file path(mmap whole file, zero-copy)
+        */
+    explicit MemoryReader( std::string const &path )
+        : mholder_(MemoryHolder::mk_mapped(path))
+        , mem_(mholder_.get_ptr<uint8_t>())
+    {}
+
     /*
         init from memory reference
         */
@@ -147,7 +208,15 @@ public:
         {}
     
     /*
-        int from memory buffer
+        take ownership of memory holder(no copy), mem_size is required
+        */
+    explicit MemoryReader( MemoryHolder && holder )
+        : mholder_(std::move(holder))
+        , mem_(mholder_.get_ptr<uint8_t>())
+    {}
+
+    /*
+        int from memory buffer(copied into cache line aligned memory)
         */
     MemoryReader( std::vector<uint8_t> && buffer )
         : mholder_(MemoryHolder::mk(std::move(buffer)))
@@ -167,6 +236,12 @@ public:
         return *this;
     }
 
+    void read( void *out, size_t sz )
+    {
+        memcpy(out, mem_, sz);
+        mem_ += sz;
+    }
+
     size_t get_offset() const
     {
         return mem_ - mholder_.get_ptr<uint8_t>();
@@ -194,11 +269,54 @@ private:
 };
 
 
+// file output of OStreamProxy
+enum FileSinkType
+{
+    FILE_SINK_MMAP      = 0, // file is resized by prealloc() and mapped, writes are memcpy
+    FILE_SINK_PWRITE    = 1, // writes are collected into large batches for pwrite()
+};
+
+/* Output of the compacted map: std::ostream, growing std::vector,
+ * preallocated memory buffer or file. Indexers call prealloc() with
+ * exact output size before writing anything.
+ */
 class OStreamProxy
 {
+    // elements of write_range are staged by this chunk
+    static size_t const STAGE_SIZE = 4096;
 public:
-    OStreamProxy( std::ostream &os ) : os_(&os), buffer_(nullptr) {}
-    OStreamProxy( std::vector<uint8_t> &buffer ) : os_(nullptr), buffer_(&buffer) {}
+    OStreamProxy( std::ostream &os ) : OStreamProxy() { os_ = &os; }
+    OStreamProxy( std::vector<uint8_t> &buffer ) : OStreamProxy() { buffer_ = &buffer; }
+
+    // write into preallocated memory, throws if capacity is exceeded
+    OStreamProxy( void *mem, size_t capacity ) : OStreamProxy()
+    {
+        mem_ = reinterpret_cast<uint8_t*>(mem);
+        mem_cap_ = capacity;
+    }
+
+    // create(truncate) file and write into it, call close() to check for errors
+    OStreamProxy( std::string const &path, FileSinkType type, size_t batch_size = 4 << 20 ) : OStreamProxy()
+    {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if( fd_ < 0 )
+            throw std::runtime_error("[OStreamProxy] failed to open: " + path);
+
+        mapped_ = FILE_SINK_MMAP == type;
+        if( !mapped_ )
+            batch_.reserve(batch_size);
+    }
+
+    OStreamProxy( OStreamProxy const & ) = delete;
+    OStreamProxy& operator = ( OStreamProxy const & ) = delete;
+
+    ~OStreamProxy()
+    {
+        try {
+            close();
+        } catch( ... ) {
+        }
+    }
     
     template<typename T>
     OStreamProxy & operator << ( T const &v )
@@ -210,23 +328,45 @@ public:
     void prealloc( size_t sz ) 
     {
         if( buffer_ )
-            buffer_->reserve(sz);
+            buffer_->reserve(buffer_->size() + sz);
+        else if( mem_ && !mapped_ && mem_pos_ + sz > mem_cap_ )
+            throw std::runtime_error("[OStreamProxy] output buffer is too small");
+        else if( fd_ >= 0 && mapped_ && !mem_ )
+            map_file(sz);
     }
     
     template<typename Iter, typename Func>
     void write_range( Iter beg, Iter end, Func f )
     {
+        typedef typename std::decay<decltype(f(*beg))>::type value_t;
+        static_assert( std::is_trivial<value_t>::value, "support only POD types!" );
+
+        // one sink call per chunk instead of per element
+        value_t stage[STAGE_SIZE / sizeof(value_t)];
+        size_t n = 0;
         for( ; beg != end; ++ beg )
         {
-            *this << f(*beg);
+            stage[n++] = f(*beg);
+            if( n == STAGE_SIZE / sizeof(value_t) )
+            {
+                write(stage, sizeof(stage));
+                n = 0;
+            }
         }
+        if( n )
+            write(stage, n * sizeof(value_t));
     }
 
     size_t tellp() const
     {
         if(buffer_)
             return buffer_->size();
-        
+
+        if( mem_ )
+            return mem_pos_;
+
+        if( fd_ >= 0 )
+            return file_offs_ + batch_.size();
 
         return os_->tellp();
     }
@@ -234,11 +374,32 @@ public:
     template<typename T>
     OStreamProxy& write( T const *data, size_t sz )
     {
+        // empty write could come with null data
+        if( 0 == sz )
+            return *this;
+        uint8_t const *beg = reinterpret_cast<uint8_t const*>(data);
         if (buffer_)
         {
-            uint8_t const *beg = reinterpret_cast<uint8_t const*>(data);
             buffer_->insert(buffer_->end(), beg, beg + sz);
         }
+        else if( mem_ )
+        {
+            if( mem_pos_ + sz > mem_cap_ )
+                throw std::runtime_error("[OStreamProxy] output buffer is too small");
+            memcpy(mem_ + mem_pos_, beg, sz);
+            mem_pos_ += sz;
+        }
+        else if( fd_ >= 0 )
+        {
+            if( mapped_ )
+                throw std::runtime_error("[OStreamProxy] prealloc() is required for mapped file");
+            if( batch_.size() + sz > batch_.capacity() )
+                flush();
+            if( sz >= batch_.capacity() )
+                pwrite_all(beg, sz);
+            else
+                batch_.insert(batch_.end(), beg, beg + sz);
+        }
         else
         {
             os_->write(reinterpret_cast<const char *>(data), sz);
@@ -247,9 +408,89 @@ public:
         return *this;
     }
 
+    // write collected batch into file
+    void flush()
+    {
+        if( fd_ >= 0 && !batch_.empty() )
+        {
+            pwrite_all(batch_.data(), batch_.size());
+            batch_.clear();
+        }
+    }
+
+    // finish file output: flush, unmap and truncate file to written size
+    void close()
+    {
+        if( fd_ < 0 )
+            return;
+
+        flush();
+        size_t const written = tellp();
+        bool ok = true;
+        if( mapped_ && mem_ )
+        {
+            ok = 0 == munmap(mem_, mem_cap_);
+            mem_ = nullptr;
+        }
+        ok = 0 == ftruncate(fd_, written) && ok;
+        ok = 0 == ::close(fd_) && ok;
+        fd_ = -1;
+        if( !ok )
+            throw std::runtime_error("[OStreamProxy] failed to finish file output");
+    }
+
 private:
+    OStreamProxy()
+        : os_(nullptr)
+        , buffer_(nullptr)
+        , mem_(nullptr)
+        , mem_pos_(0)
+        , mem_cap_(0)
+        , fd_(-1)
+        , mapped_(false)
+        , file_offs_(0)
+    {}
+
+    void map_file( size_t sz )
+    {
+        if( 0 == sz )
+            return;
+
+        if( ftruncate(fd_, sz) != 0 )
+            throw std::runtime_error("[OStreamProxy] failed to resize output file");
+
+        void *p = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if( MAP_FAILED == p )
+            throw std::runtime_error("[OStreamProxy] failed to mmap output file");
+
+        mem_ = reinterpret_cast<uint8_t*>(p);
+        mem_cap_ = sz;
+    }
+
+    void pwrite_all( uint8_t const *p, size_t sz )
+    {
+        while( sz )
+        {
+            ssize_t const wr = pwrite(fd_, p, sz, file_offs_);
+            if( wr <= 0 )
+                throw std::runtime_error("[OStreamProxy] failed to write output file");
+            p += wr;
+            sz -= wr;
+            file_offs_ += wr;
+        }
+    }
+
     std::ostream            *os_;
     std::vector<uint8_t>    *buffer_;
+    // preallocated or mapped memory
+    uint8_t                 *mem_;
+    size_t                   mem_pos_;
+    size_t                   mem_cap_;
+    // output file
+    int                      fd_;
+    bool                     mapped_;
+    size_t                   file_offs_;
+    std::vector<uint8_t>     batch_;
 };
  
 } // namespace utils
\ No newline at end of file
@@ -0,0 +1,264 @@
+#pragma once
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include "tombstone.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// merged buckets are passed to indexer by windows of about this records count
+size_t const MERGE_WINDOW_RECORDS = 1 << 16;
+
+/* Merge of N map files of one kind into new one. Inputs are mapped and
+ * read bucket by bucket, output buckets count, bucket sizes and key width
+ * are derived for merged records, newer inputs(later in the list) win on
+ * equal keys: all values of a key are taken from the newest input having it.
+ * Records deleted by deletion bitmap of input(see tombstone.hpp) are dropped,
+ * key deleted in newer input is dropped from older ones too, so merge of
+ * a single input is its compaction.
+ * First pass collects stats of output buckets, second one writes them,
+ * both go by windows of output buckets, every input bucket feeding a window
+ * is decoded once. Memory is about a window and one bucket of every input,
+ * indexer is never filled by records.
+ * Output buckets count is derived from sum of inputs sizes.
+ * Indexer(HAMapIndexer or EHCMapIndexer) could be configured by indexer().
+ */
+template<typename Indexer, typename Searcher, typename Key, typename Value>
+class MapMerger
+{
+    typedef std::pair<Key, Value>                   kv_pair_t;
+    typedef typename Indexer::bucket_partition_t    bucket_partition_t;
+    typedef typename Indexer::bucket_stats_t        bucket_stats_t;
+    typedef std::unique_ptr<detail::DeletionBitmap> bitmap_ptr_t;
+
+    struct Tagged
+    {
+        Key         k;
+        uint32_t    input;
+        bool        deleted;
+        Value       v;
+
+        // by key, newest input first, then by value
+        bool operator < ( Tagged const &o ) const
+        {
+            if( k != o.k )
+                return k < o.k;
+            if( input != o.input )
+                return input > o.input;
+            return v < o.v;
+        }
+    };
+
+    struct Decoded
+    {
+        size_t              bucket;     // input bucket of tagged records
+        std::vector<Tagged> tagged;
+    };
+public:
+    // inputs are ordered from the oldest to the newest one
+    explicit MapMerger( std::vector<std::string> const &inputs )
+    {
+        for( auto const &path : inputs )
+        {
+            inputs_.emplace_back(new Searcher(path));
+            starts_.push_back(detail::get_bucket_starts(*inputs_.back()));
+            deleted_.emplace_back(new detail::DeletionBitmap(inputs_.back()->size()));
+            if( !deleted_.back()->load(path + DELETION_BITMAP_SUFFIX) )
+                deleted_.back().reset();
+            decoded_.push_back(Decoded{ SIZE_MAX, {} });
+            // duplicate keys are kept if any input has them
+            if( inputs_.back()->is_multimap() )
+                idx_.set_multimap(true);
+        }
+    }
+
+    Indexer& indexer() { return idx_; }
+
+    // exact size of merged map in bytes(makes counting pass)
+    size_t get_compacted_size( size_t const page_size = DEFAULT_PAGE_SIZE )
+    {
+        return idx_.get_output_size(count(get_nbuckets(page_size)));
+    }
+
+    void compact_and_store( utils::OStreamProxy &os, size_t const page_size )
+    {
+        size_t const nbuckets = get_nbuckets(page_size);
+        bucket_stats_t const stats = count(nbuckets);
+        idx_.compact_sorted(os, stats, [this, nbuckets]( auto &&on_window ) {
+            merge(nbuckets, on_window);
+        });
+    }
+
+    // merge directly into file, see utils::FileSinkType
+    void store( std::string const &path, size_t const page_size = DEFAULT_PAGE_SIZE,
+                utils::FileSinkType type = utils::FILE_SINK_MMAP )
+    {
+        utils::OStreamProxy os(path, type);
+        compact_and_store(os, page_size);
+        os.close();
+    }
+
+private:
+    size_t get_nbuckets( size_t const page_size ) const
+    {
+        size_t nrec = 0;
+        for( size_t i = 0; i < inputs_.size(); ++i )
+            nrec += inputs_[i]->size() - (deleted_[i] ? deleted_[i]->count() : 0);
+        return detail::calc_buckets_count((sizeof(Key) + sizeof(Value)) * nrec, page_size);
+    }
+
+    // output buckets merged at once, they take about MERGE_WINDOW_RECORDS records
+    size_t get_window_buckets( size_t const nbuckets ) const
+    {
+        size_t nrec = 0;
+        for( auto const &in : inputs_ )
+            nrec += in->size();
+        return std::max(size_t(1), std::min(nbuckets, MERGE_WINDOW_RECORDS * nbuckets / std::max(size_t(1), nrec)));
+    }
+
+    // first pass: records count and values range of output buckets
+    bucket_stats_t count( size_t const nbuckets )
+    {
+        bucket_stats_t stats = idx_.make_stats(nbuckets);
+        Key kmask = 0;
+        size_t const window = get_window_buckets(nbuckets);
+        std::vector<kv_pair_t> records;
+        std::vector<size_t> starts;
+        for( size_t first = 0; first < nbuckets; first += window )
+        {
+            size_t const last = std::min(nbuckets, first + window);
+            gather(first, last, nbuckets, records, starts);
+            for( size_t j = first; j < last; ++j )
+            {
+                for( size_t r = starts[j - first]; r < starts[j - first + 1]; ++r )
+                {
+                    stats.add(j, records[r].first, records[r].second);
+                    kmask |= records[r].first;
+                }
+            }
+        }
+        set_kmask(idx_, kmask);
+        return stats;
+    }
+
+    // second pass: pass merged buckets by windows
+    template<typename OnWindow>
+    void merge( size_t const nbuckets, OnWindow &&on_window )
+    {
+        size_t const window = get_window_buckets(nbuckets);
+        for( size_t first = 0; first < nbuckets; first += window )
+        {
+            std::vector<kv_pair_t> records;
+            std::vector<size_t> starts;
+            gather(first, std::min(nbuckets, first + window), nbuckets, records, starts);
+
+            bucket_partition_t part(std::move(records), std::move(starts));
+            on_window(part, first);
+        }
+    }
+
+    /* merged and sorted records of output buckets [first, last) into out,
+     * starts are their positions(last - first + 1 items), every input bucket
+     * feeding the window is decoded once and scattered to output buckets
+     */
+    void gather( size_t const first, size_t const last, size_t const nbuckets,
+                 std::vector<kv_pair_t> &out, std::vector<size_t> &starts )
+    {
+        size_t const mask = nbuckets - 1;
+        window_.resize(last - first);
+        for( auto &w : window_ )
+            w.clear();
+
+        auto scatter = [this, first, last, mask]( std::vector<Tagged> const &tagged ) {
+            for( auto const &t : tagged )
+            {
+                size_t const j = t.k & mask;
+                if( j >= first && j < last )
+                    window_[j - first].push_back(t);
+            }
+        };
+
+        for( uint32_t i = 0; i < inputs_.size(); ++i )
+        {
+            size_t const in_nbuckets = inputs_[i]->get_nbuckets();
+            if( in_nbuckets <= nbuckets )
+            {
+                // input bucket holds several output ones, distinct ones of window
+                size_t const n = std::min(in_nbuckets, last - first);
+                for( size_t j = first; j < first + n; ++j )
+                    scatter(get_decoded(i, j & (in_nbuckets - 1)));
+            }
+            else
+            {
+                // input bucket is a part of output one
+                for( size_t j = first; j < last; ++j )
+                {
+                    for( size_t b = j; b < in_nbuckets; b += nbuckets )
+                        scatter(get_decoded(i, b));
+                }
+            }
+        }
+
+        out.clear();
+        starts.assign(1, 0);
+        for( auto &w : window_ )
+        {
+            std::sort(w.begin(), w.end());
+            for( size_t t = 0; t < w.size(); )
+            {
+                // not deleted values of the newest input only
+                size_t e = t;
+                for( ; e < w.size() && w[e].k == w[t].k; ++e )
+                {
+                    if( w[e].input == w[t].input && !w[e].deleted )
+                        out.emplace_back(w[e].k, w[e].v);
+                }
+                t = e;
+            }
+            starts.push_back(out.size());
+        }
+    }
+
+    /* records of input bucket b tagged by input and deletion, the last decoded
+     * bucket of every input is kept, so bucket of small input feeding many
+     * output ones(e.g. delta file of overlay) is not decoded again
+     */
+    std::vector<Tagged> const& get_decoded( uint32_t const i, size_t const b )
+    {
+        Decoded &c = decoded_[i];
+        if( c.bucket != b )
+        {
+            detail::DeletionBitmap const *deleted = deleted_[i].get();
+            records_.clear();
+            inputs_[i]->decode_bucket(b, records_);
+            c.bucket = b;
+            c.tagged.clear();
+            for( size_t d = 0; d < records_.size(); ++d )
+            {
+                bool const del = deleted && deleted->test(starts_[i][b] + d);
+                c.tagged.push_back(Tagged{ records_[d].first, i, del, records_[d].second });
+            }
+        }
+        return c.tagged;
+    }
+
+    static void set_kmask( HAMapIndexer<Key, Value> &, Key ) {}
+    static void set_kmask( EHCMapIndexer<Key, Value> &idx, Key kmask ) { idx.kmask_ = kmask; }
+
+private:
+    std::vector<std::unique_ptr<Searcher>>  inputs_;
+    std::vector<std::vector<uint64_t>>      starts_;
+    std::vector<bitmap_ptr_t>               deleted_; // null if input has no deletions
+    Indexer                                 idx_;
+    std::vector<Decoded>                    decoded_; // last decoded bucket of every input
+    std::vector<std::vector<Tagged>>        window_;  // records of output buckets of window
+    std::vector<kv_pair_t>                  records_;
+};
+
+template<typename Key, typename Value>
+using HAMapMerger = MapMerger<HAMapIndexer<Key, Value>, HAMapSearcher<Key, Value>, Key, Value>;
+
+template<typename Key, typename Value>
+using HACMapMerger = MapMerger<EHCMapIndexer<Key, Value>, HACMapSearcher<Key, Value>, Key, Value>;
@@ -0,0 +1,352 @@
+#pragma once
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include "mergemap.hpp"
+#include "diskmap.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <exception>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+
+// delta table load factor limit, puts fail above it
+uint32_t const DELTA_MAX_LOAD_PERCENT = 75;
+
+namespace detail {
+
+/* Fixed capacity open addressing table(linear probing) for single writer
+ * and any number of lock-free readers: slot key is written before slot is
+ * published by release store of its state, key of published slot is never
+ * changed, value is updated atomically. Records are never removed.
+ */
+template<typename Key, typename Value>
+class DeltaTable
+{
+    struct Slot
+    {
+        Key                     k;
+        std::atomic<Value>      v;
+        std::atomic<uint8_t>    used;
+    };
+public:
+    // capacity is power of 2 holding max_size records within load limit
+    explicit DeltaTable( size_t max_size )
+        : shift_(64 - utils::maxbits(uint64_t(std::max(size_t(1), max_size * 100 / DELTA_MAX_LOAD_PERCENT))))
+        , mask_((size_t(1) << (64 - shift_)) - 1)
+        , max_size_((mask_ + 1) * DELTA_MAX_LOAD_PERCENT / 100)
+        , slots_(new Slot[mask_ + 1])
+        , size_(0)
+    {
+        for( size_t i = 0; i <= mask_; ++i )
+            slots_[i].used.store(0, std::memory_order_relaxed);
+    }
+
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+    size_t capacity() const { return mask_ + 1; }
+
+    // insert or update, return false if table is full(writer only)
+    bool put( Key k, Value v )
+    {
+        for( size_t i = home(k);; i = (i + 1) & mask_ )
+        {
+            Slot &s = slots_[i];
+            if( !s.used.load(std::memory_order_relaxed) )
+            {
+                if( size() >= max_size_ )
+                    return false;
+                s.k = k;
+                s.v.store(v, std::memory_order_relaxed);
+                s.used.store(1, std::memory_order_release);
+                size_.store(size() + 1, std::memory_order_relaxed);
+                return true;
+            }
+            if( s.k == k )
+            {
+                s.v.store(v, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    std::optional<Value> get( Key k ) const
+    {
+        for( size_t i = home(k);; i = (i + 1) & mask_ )
+        {
+            Slot const &s = slots_[i];
+            if( !s.used.load(std::memory_order_acquire) )
+                return std::nullopt;
+            if( s.k == k )
+                return s.v.load(std::memory_order_relaxed);
+        }
+    }
+
+    // call func(k, v) for every record
+    template<typename Func>
+    void for_each( Func &&func ) const
+    {
+        for( size_t i = 0; i <= mask_; ++i )
+        {
+            Slot const &s = slots_[i];
+            if( s.used.load(std::memory_order_acquire) )
+                func(s.k, s.v.load(std::memory_order_relaxed));
+        }
+    }
+private:
+    // keys could be sequential IDs, so they are mixed by multiplicative hash
+    size_t home( Key k ) const
+    {
+        return size_t((uint64_t(k) * 0x9E3779B97F4A7C15ULL) >> shift_);
+    }
+private:
+    uint32_t const              shift_;
+    size_t const                mask_;
+    size_t const                max_size_;
+    std::unique_ptr<Slot[]>     slots_;
+    std::atomic<size_t>         size_;
+};
+
+// settings of both indexers taken from footer of existing map
+template<typename Indexer, typename Searcher>
+inline void set_common_params( Indexer &idx, Searcher const &srch )
+{
+    FooterExt const &ext = srch.get_footer_ext();
+    // tiny directory is used by auto format while limits allow
+    idx.set_directory_format((ext.flags & FOOTER_FLAG_EF_DIRECTORY) ? DIRECTORY_FORMAT_ELIAS_FANO
+                           : (ext.flags & FOOTER_FLAG_TINY_DIRECTORY) ? DIRECTORY_FORMAT_AUTO
+                           : DIRECTORY_FORMAT_WIDE);
+    idx.set_multimap((ext.flags & FOOTER_FLAG_MULTIMAP) != 0);
+    idx.set_filter_bits(BucketIndex::get_filter_params(ext).get_bits_per_key(srch.size(), srch.get_nbuckets()));
+}
+
+// configure indexer to build map like the one of srch
+template<typename Key, typename Value, typename Searcher>
+inline void set_params_of( HAMapIndexer<Key, Value> &idx, Searcher const &srch )
+{
+    set_common_params(idx, srch);
+    idx.set_layout((srch.get_footer_ext().flags & FOOTER_FLAG_EYTZINGER) ? BUCKET_LAYOUT_EYTZINGER : BUCKET_LAYOUT_SORTED);
+}
+
+template<typename Key, typename Value, typename Searcher>
+inline void set_params_of( EHCMapIndexer<Key, Value> &idx, Searcher const &srch )
+{
+    set_common_params(idx, srch);
+    idx.set_value_packing((srch.get_footer_ext().flags & FOOTER_FLAG_PACKED_VALUES) != 0);
+}
+
+} // namespace detail
+
+/* Mutable view of immutable map file: puts go to small delta table checked
+ * before the map. When delta reaches rebuild threshold it is frozen, new
+ * delta is started and background thread merges the map file with frozen
+ * records(by MapMerger, delta wins), replaces the file and swaps searcher.
+ * Lookups are lock-free in delta tables, map state is taken by
+ * std::atomic_load as in ShardedSearcher. Puts are serialized, a put into
+ * full delta waits for running rebuild. Map is unique key one, rebuilds
+ * keep its build settings(layout, directory, filter, value packing).
+ * Indexer/Searcher are HAMapIndexer/HAMapSearcher or EHCMapIndexer/HACMapSearcher.
+ */
+template<typename Indexer, typename Searcher, typename Key, typename Value>
+class DeltaOverlay
+{
+    typedef detail::DeltaTable<Key, Value>  delta_t;
+
+    struct State
+    {
+        std::shared_ptr<Searcher const>     base;
+        std::shared_ptr<delta_t>            delta;
+        std::shared_ptr<delta_t const>      frozen; // being merged into base
+    };
+    typedef std::shared_ptr<State const>    state_ptr_t;
+public:
+    // path is existing map file, it is rewritten by rebuilds
+    explicit DeltaOverlay( std::string const &path, size_t rebuild_threshold = 1 << 16,
+                           size_t const page_size = DEFAULT_PAGE_SIZE )
+        : path_(path)
+        , threshold_(std::max(size_t(1), rebuild_threshold))
+        , page_size_(page_size)
+        , rebuilding_(false)
+    {
+        std::shared_ptr<State> s = std::make_shared<State>();
+        s->base = std::make_shared<Searcher const>(path_);
+        s->delta = make_delta();
+        state_ = s;
+    }
+
+    ~DeltaOverlay()
+    {
+        if( rebuild_thread_.joinable() )
+            rebuild_thread_.join();
+    }
+
+    DeltaOverlay( DeltaOverlay const & ) = delete;
+    DeltaOverlay& operator = ( DeltaOverlay const & ) = delete;
+
+    std::optional<Value> search( Key k ) const
+    {
+        state_ptr_t const s = std::atomic_load(&state_);
+        if( auto const v = s->delta->get(k) )
+            return v;
+        if( s->frozen )
+        {
+            if( auto const v = s->frozen->get(k) )
+                return v;
+        }
+        return detail::to_optional(s->base->search(k));
+    }
+
+    /* insert or update key, newest put wins,
+     * error of previous background rebuild is rethrown here
+     */
+    void put( Key k, Value v )
+    {
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        rethrow_error();
+        if( !state_->delta->put(k, v) )
+        {
+            // previous delta is still merged, wait for it and rotate full one
+            rebuild_cv_.wait(lock, [this]() { return !rebuilding_; });
+            rethrow_error();
+            start_rebuild();
+            state_->delta->put(k, v);
+        }
+        if( state_->delta->size() >= threshold_ && !rebuilding_ )
+            start_rebuild();
+    }
+
+    // merge all records put so far into map file and wait for it
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        rebuild_cv_.wait(lock, [this]() { return !rebuilding_; });
+        if( state_->delta->size() || state_->frozen )
+        {
+            start_rebuild();
+            rebuild_cv_.wait(lock, [this]() { return !rebuilding_; });
+        }
+        rethrow_error();
+    }
+
+    // records in delta tables, not merged into map file yet
+    size_t get_delta_size() const
+    {
+        state_ptr_t const s = std::atomic_load(&state_);
+        return s->delta->size() + (s->frozen ? s->frozen->size() : 0);
+    }
+
+    std::shared_ptr<Searcher const> get_base() const
+    {
+        return std::atomic_load(&state_)->base;
+    }
+
+private:
+    std::shared_ptr<delta_t> make_delta() const
+    {
+        // delta keeps taking puts while previous one is merged
+        return std::make_shared<delta_t>(threshold_ * 2);
+    }
+
+    // freeze current delta and merge it in background(write_mutex_ is held)
+    void start_rebuild()
+    {
+        if( rebuild_thread_.joinable() )
+            rebuild_thread_.join();
+
+        std::shared_ptr<State> s = std::make_shared<State>(*state_);
+        std::shared_ptr<delta_t> frozen = s->delta;
+        if( s->frozen )
+        {
+            // left by failed rebuild, newer records of delta win
+            frozen = std::make_shared<delta_t>(s->frozen->size() + s->delta->size());
+            for( delta_t const *d : { s->frozen.get(), static_cast<delta_t const*>(s->delta.get()) } )
+                d->for_each([&frozen]( Key k, Value v ) { frozen->put(k, v); });
+        }
+        s->frozen = frozen;
+        s->delta = make_delta();
+        std::atomic_store(&state_, state_ptr_t(s));
+
+        rebuilding_ = true;
+        rebuild_thread_ = std::thread([this, frozen, base = s->base]() {
+            std::shared_ptr<Searcher const> new_base;
+            std::exception_ptr error;
+            try {
+                new_base = rebuild(*frozen, *base);
+            } catch( ... ) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            if( new_base )
+            {
+                std::shared_ptr<State> s = std::make_shared<State>(*state_);
+                s->base = new_base;
+                s->frozen.reset();
+                std::atomic_store(&state_, state_ptr_t(s));
+            }
+            else
+            {
+                // frozen delta stays visible and is merged by next rebuild
+                error_ = error;
+            }
+            rebuilding_ = false;
+            rebuild_cv_.notify_all();
+        });
+    }
+
+    // map file with delta records merged into it, built like base
+    std::shared_ptr<Searcher const> rebuild( delta_t const &delta, Searcher const &base ) const
+    {
+        std::string const delta_path = path_ + ".delta";
+        std::string const next_path = path_ + ".next";
+        {
+            Indexer idx;
+            delta.for_each([&idx]( Key k, Value v ) { idx.add(k, v); });
+            idx.store(delta_path, page_size_);
+        }
+
+        // delta file is temporary, only merged map takes settings of base
+        MapMerger<Indexer, Searcher, Key, Value> merger({ path_, delta_path });
+        detail::set_params_of(merger.indexer(), base);
+        merger.store(next_path, page_size_);
+        std::remove(delta_path.c_str());
+        // mapped old file stays valid for searches still using it
+        if( 0 != std::rename(next_path.c_str(), path_.c_str()) )
+            throw std::runtime_error("[DeltaOverlay] unable to replace file " + path_);
+        // deleted records are dropped by merge, so bitmap does not match new file
+        std::remove((path_ + DELETION_BITMAP_SUFFIX).c_str());
+        return std::make_shared<Searcher const>(path_);
+    }
+
+    void rethrow_error()
+    {
+        if( error_ )
+        {
+            std::exception_ptr e = error_;
+            error_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    std::string const           path_;
+    size_t const                threshold_;
+    size_t const                page_size_;
+    mutable state_ptr_t         state_;
+    std::mutex                  write_mutex_;
+    std::condition_variable     rebuild_cv_;
+    bool                        rebuilding_;
+    std::thread                 rebuild_thread_;
+    std::exception_ptr          error_;
+};
+
+template<typename Key, typename Value>
+using HAMapOverlay = DeltaOverlay<HAMapIndexer<Key, Value>, HAMapSearcher<Key, Value>, Key, Value>;
+
+template<typename Key, typename Value>
+using HACMapOverlay = DeltaOverlay<EHCMapIndexer<Key, Value>, HACMapSearcher<Key, Value>, Key, Value>;
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <type_traits>
+
+namespace detail {
+
+// shard of key is taken from its higher bits, buckets use lower ones
+// (shift is logical, so negative keys are routed to upper shards)
+template<typename Key>
+inline size_t get_shard_index( Key k, uint32_t shard_bits )
+{
+    return shard_bits ? size_t(std::make_unsigned_t<Key>(k) >> (sizeof(Key) * 8 - shard_bits)) : 0;
+}
+
+inline uint32_t get_shard_bits( size_t nshards )
+{
+    if( 0 == nshards || (nshards & (nshards - 1)) )
+        throw std::runtime_error("[Sharded] shards count must be power of 2");
+    return utils::maxbits(nshards) - 1;
+}
+
+// file of shard i is <prefix>.<i>
+inline std::string get_shard_path( std::string const &prefix, size_t i )
+{
+    return prefix + "." + std::to_string(i);
+}
+
+// run func(i) for i in [0, n) by nthreads, first exception is rethrown
+template<typename Func>
+inline void run_parallel( size_t n, size_t nthreads, Func const &func )
+{
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        for( size_t i = next++; i < n; i = next++ )
+        {
+            try {
+                func(i);
+            } catch( ... ) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if( !error )
+                    error = std::current_exception();
+            }
+        }
+    };
+
+    nthreads = std::min(std::max(size_t(1), nthreads), n);
+    if( nthreads <= 1 )
+        worker();
+    else
+    {
+        std::vector<std::thread> threads;
+        for( size_t t = 0; t < nthreads; ++t )
+            threads.emplace_back(worker);
+        for( auto &t : threads )
+            t.join();
+    }
+
+    if( error )
+        std::rethrow_exception(error);
+}
+
+} // namespace detail
+
+/* Key space is split by higher key bits into N independent maps(shards),
+ * each one is compacted into own file <prefix>.<i>, so shards are built in
+ * parallel, every shard has own size limits and could be rebuilt alone.
+ * Indexer is HAMapIndexer or EHCMapIndexer, shards could be configured
+ * by shard(i).
+ */
+template<typename Indexer, typename Key, typename Value>
+class ShardedIndexer
+{
+public:
+    explicit ShardedIndexer( size_t nshards )
+        : shard_bits_(detail::get_shard_bits(nshards))
+        , shards_(nshards)
+    {}
+
+    size_t get_nshards() const { return shards_.size(); }
+    Indexer& shard( size_t i ) { return shards_[i]; }
+
+    void add( Key k, Value v )
+    {
+        shards_[detail::get_shard_index(k, shard_bits_)].add(k, v);
+    }
+
+    size_t size() const
+    {
+        size_t sz = 0;
+        for( auto const &s : shards_ )
+            sz += s.size();
+        return sz;
+    }
+
+    // compact shards into files by nthreads in parallel
+    void store( std::string const &prefix, size_t const page_size = DEFAULT_PAGE_SIZE, size_t nthreads = 1 )
+    {
+        detail::run_parallel(shards_.size(), nthreads, [this, &prefix, page_size]( size_t i ) {
+            shards_[i].store(detail::get_shard_path(prefix, i), page_size);
+        });
+    }
+
+private:
+    uint32_t const          shard_bits_;
+    std::vector<Indexer>    shards_;
+};
+
+/* Routes each key to searcher of its shard. Shards are loaded lazily on
+ * first access or all at once by load(), any shard could be replaced by
+ * rebuilt file while searches are running: searcher is swapped atomically
+ * and old one is released after last search in it finishes.
+ * Searcher is any searcher constructed from file path(HAMapSearcher,
+ * HACMapSearcher, DiskSearcher). Pointers returned by HAMapSearcher are
+ * valid until their shard is replaced.
+ */
+template<typename Searcher, typename Key>
+class ShardedSearcher
+{
+    typedef std::shared_ptr<Searcher const> searcher_ptr_t;
+public:
+    ShardedSearcher( std::string const &prefix, size_t nshards )
+        : prefix_(prefix)
+        , shard_bits_(detail::get_shard_bits(nshards))
+        , shards_(nshards)
+        , load_mutexes_(nshards)
+    {}
+
+    size_t get_nshards() const { return shards_.size(); }
+
+    // load all not loaded shards by nthreads in parallel
+    void load( size_t nthreads = 1 )
+    {
+        detail::run_parallel(shards_.size(), nthreads, [this]( size_t i ) { get_shard(i); });
+    }
+
+    // swap searcher of shard i to new file
+    void replace_shard( size_t i, std::string const &path )
+    {
+        searcher_ptr_t s = std::make_shared<Searcher const>(path);
+        std::atomic_store(&shards_[i], s);
+    }
+
+    // searcher of shard i, loaded if needed
+    searcher_ptr_t get_shard( size_t i ) const
+    {
+        searcher_ptr_t s = std::atomic_load(&shards_[i]);
+        if( !s )
+        {
+            std::lock_guard<std::mutex> lock(load_mutexes_[i]);
+            s = std::atomic_load(&shards_[i]);
+            if( !s )
+            {
+                s = std::make_shared<Searcher const>(detail::get_shard_path(prefix_, i));
+                std::atomic_store(&shards_[i], s);
+            }
+        }
+        return s;
+    }
+
+    // result of shard searcher
+    auto search( Key k ) const
+    {
+        return get_shard(detail::get_shard_index(k, shard_bits_))->search(k);
+    }
+
+    /* batched lookup, out_values[i] = search(keys[i]), keys are grouped by
+     * shards and passed to search_batch of each shard
+     * return number of found keys
+     */
+    template<typename Out>
+    size_t search_batch( Key const *keys, size_t n, Out *out_values ) const
+    {
+        std::vector<std::vector<uint32_t>> positions(shards_.size());
+        for( size_t i = 0; i < n; ++i )
+            positions[detail::get_shard_index(keys[i], shard_bits_)].push_back(i);
+
+        size_t nfound = 0;
+        std::vector<Key> skeys;
+        std::vector<Out> sout;
+        for( size_t s = 0; s < shards_.size(); ++s )
+        {
+            std::vector<uint32_t> const &pos = positions[s];
+            if( pos.empty() )
+                continue;
+
+            skeys.resize(pos.size());
+            sout.resize(pos.size());
+            for( size_t j = 0; j < pos.size(); ++j )
+                skeys[j] = keys[pos[j]];
+            nfound += get_shard(s)->search_batch(skeys.data(), skeys.size(), sout.data());
+            for( size_t j = 0; j < pos.size(); ++j )
+                out_values[pos[j]] = sout[j];
+        }
+        return nfound;
+    }
+
+    // return number of records of all shards(loads them)
+    size_t size() const
+    {
+        size_t sz = 0;
+        for( size_t i = 0; i < shards_.size(); ++i )
+            sz += get_shard(i)->size();
+        return sz;
+    }
+
+private:
+    std::string                         prefix_;
+    uint32_t const                      shard_bits_;
+    mutable std::vector<searcher_ptr_t> shards_;
+    mutable std::vector<std::mutex>     load_mutexes_;
+};
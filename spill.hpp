@@ -0,0 +1,278 @@
+#pragma once
+
+#include "types.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+
+namespace detail {
+
+// anonymous temporary file, removed from directory right after creation
+class TempFile
+{
+public:
+    explicit TempFile( std::string const &dir )
+        : f_(nullptr)
+    {
+        std::string tpl = dir + "/hacmap-run-XXXXXX";
+        int const fd = mkstemp(&tpl[0]);
+        if( fd < 0 )
+            throw std::runtime_error("[TempFile] unable to create temporary file in " + dir);
+        unlink(tpl.c_str());
+
+        f_ = fdopen(fd, "w+b");
+        if( !f_ )
+        {
+            close(fd);
+            throw std::runtime_error("[TempFile] fdopen failed");
+        }
+    }
+
+    TempFile( TempFile const & ) = delete;
+    TempFile& operator = ( TempFile const & ) = delete;
+
+    ~TempFile()
+    {
+        fclose(f_);
+    }
+
+    void write( void const *p, size_t sz )
+    {
+        if( sz && fwrite(p, 1, sz, f_) != sz )
+            throw std::runtime_error("[TempFile] write failed");
+    }
+
+    size_t read( void *p, size_t sz )
+    {
+        size_t const rd = fread(p, 1, sz, f_);
+        if( rd != sz && ferror(f_) )
+            throw std::runtime_error("[TempFile] read failed");
+        return rd;
+    }
+
+    void rewind()
+    {
+        if( fflush(f_) || fseek(f_, 0, SEEK_SET) )
+            throw std::runtime_error("[TempFile] seek failed");
+    }
+
+private:
+    FILE    *f_;
+};
+
+/* Spilled runs of records for external memory build.
+ * Every run is sorted by (bucket index, key, value) for the same number
+ * of buckets, so k-way merge of runs gives buckets in file order with
+ * records already sorted inside of bucket. Bucket stats
+ * (records count, values and keys ranges, if asked) are collected while spilling, so
+ * directory could be written before merge.
+ */
+template<typename Key, typename Value>
+class RunSpiller
+{
+    typedef std::pair<Key, Value>       record_t;
+    typedef BucketPartition<record_t>   partition_t;
+
+    struct Run
+    {
+        std::unique_ptr<TempFile>   file;
+        size_t                      size;
+    };
+public:
+    RunSpiller( std::string const &tmp_dir, size_t memory_budget, bool track_values, bool track_keys )
+        : tmp_dir_(tmp_dir)
+        , memory_budget_(memory_budget)
+        , track_values_(track_values)
+        , track_keys_(track_keys)
+        , nrecords_(0)
+    {}
+
+    bool empty() const { return runs_.empty(); }
+    size_t size() const { return nrecords_; }
+    size_t nbuckets() const { return stats_.nbuckets(); }
+    size_t get_memory_budget() const { return memory_budget_; }
+
+    // drop all spilled runs
+    void reset()
+    {
+        nrecords_ = 0;
+        runs_.clear();
+        stats_ = BucketStats<Value>();
+    }
+
+    BucketStats<Value> const& get_stats() const { return stats_; }
+
+    /* sort records into new run and clear them, nbuckets must be same for all runs,
+     * records are sorted in place and their capacity is kept for next ones,
+     * so memory is not taken above records storage
+     */
+    void spill( std::vector<record_t> &records, size_t nbuckets )
+    {
+        if( 0 == stats_.nbuckets() )
+            stats_ = BucketStats<Value>(nbuckets, track_values_, track_keys_);
+        else if( stats_.nbuckets() != nbuckets )
+            throw std::runtime_error("[RunSpiller] buckets count mismatch");
+
+        if( !records.empty() )
+        {
+            uint32_t const key_shift = utils::maxbits(nbuckets) - 1;
+            std::vector<size_t> const starts = partition_in_place(records, nbuckets);
+
+            Run run = { std::unique_ptr<TempFile>(new TempFile(tmp_dir_)), records.size() };
+            for( size_t i = 0; i < nbuckets; ++i )
+            {
+                RecordSpan<record_t> const b = { records.data() + starts[i], starts[i + 1] - starts[i] };
+                if( b.empty() )
+                    continue;
+
+                sort_bucket(b.data(), b.size(), key_shift);
+                run.file->write(b.data(), b.size() * sizeof(record_t));
+                for( auto const &r : b )
+                    stats_.add(i, r.first, r.second);
+            }
+            records.clear();
+            nrecords_ += run.size;
+            runs_.push_back(std::move(run));
+        }
+    }
+
+    // re-spill all runs for other buckets count(one more pass over data)
+    void repartition( size_t nbuckets )
+    {
+        RunSpiller tmp(tmp_dir_, memory_budget_, track_values_, track_keys_);
+        size_t const chunk = get_chunk_records(1);
+        std::vector<record_t> records;
+        for( auto &run : runs_ )
+        {
+            run.file->rewind();
+            for( size_t left = run.size; left; )
+            {
+                size_t const n = std::min(left, chunk);
+                records.resize(n);
+                if( run.file->read(records.data(), n * sizeof(record_t)) != n * sizeof(record_t) )
+                    throw std::runtime_error("[RunSpiller] unexpected end of run");
+                tmp.spill(records, nbuckets);
+                left -= n;
+            }
+            run.file.reset();
+        }
+        if( tmp.empty() )
+            tmp.spill(records, nbuckets);
+        *this = std::move(tmp);
+    }
+
+    /* merge all runs, on_window(partition, first_bucket) is called for
+     * consecutive ranges of whole buckets, which fit into half of memory budget,
+     * other half is used for read buffers of runs
+     */
+    template<typename OnWindow>
+    void merge( OnWindow &&on_window )
+    {
+        std::vector<Reader> readers(runs_.size());
+        size_t const rd_chunk = get_chunk_records(2 * runs_.size());
+        for( size_t r = 0; r < runs_.size(); ++r )
+        {
+            runs_[r].file->rewind();
+            readers[r].run = &runs_[r];
+            readers[r].left = runs_[r].size;
+            readers[r].chunk = rd_chunk;
+            readers[r].fill();
+        }
+
+        size_t const hash_mask = stats_.nbuckets() - 1;
+        auto greater = [&readers, hash_mask]( size_t a, size_t b ) {
+            record_t const &ra = readers[a].top();
+            record_t const &rb = readers[b].top();
+            size_t const ba = ra.first & hash_mask, bb = rb.first & hash_mask;
+            return ba != bb ? ba > bb : rb < ra;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+        for( size_t r = 0; r < readers.size(); ++r )
+        {
+            if( !readers[r].done() )
+                heap.push(r);
+        }
+
+        size_t const window_cap = get_chunk_records(2);
+        size_t const nbuckets = stats_.nbuckets();
+        for( size_t first = 0; first < nbuckets; )
+        {
+            // take whole buckets, at least one
+            size_t last = first, nrec = 0;
+            do {
+                nrec += stats_.bucket_size(last++);
+            } while( last < nbuckets && nrec + stats_.bucket_size(last) <= window_cap );
+
+            std::vector<record_t> records;
+            records.reserve(nrec);
+            std::vector<size_t> starts(1, 0);
+            starts.reserve(last - first + 1);
+            for( size_t i = first; i < last; ++i )
+            {
+                for( uint32_t j = 0; j < stats_.bucket_size(i); ++j )
+                {
+                    size_t const r = heap.top();
+                    heap.pop();
+                    records.push_back(readers[r].top());
+                    if( readers[r].next() )
+                        heap.push(r);
+                }
+                starts.push_back(records.size());
+            }
+
+            partition_t part(std::move(records), std::move(starts));
+            on_window(part, first);
+            first = last;
+        }
+    }
+
+private:
+    struct Reader
+    {
+        Run                     *run;
+        size_t                   left;
+        size_t                   chunk;
+        size_t                   pos;
+        std::vector<record_t>    buf;
+
+        bool done() const { return pos == buf.size(); }
+        record_t const& top() const { return buf[pos]; }
+
+        void fill()
+        {
+            size_t const n = std::min(left, chunk);
+            buf.resize(n);
+            pos = 0;
+            if( run->file->read(buf.data(), n * sizeof(record_t)) != n * sizeof(record_t) )
+                throw std::runtime_error("[RunSpiller] unexpected end of run");
+            left -= n;
+        }
+
+        // move to next record, return false at the end of run
+        bool next()
+        {
+            if( ++pos == buf.size() && left )
+                fill();
+            return !done();
+        }
+    };
+
+    size_t get_chunk_records( size_t parts ) const
+    {
+        return std::max(size_t(1024), memory_budget_ / parts / sizeof(record_t));
+    }
+
+    std::string             tmp_dir_;
+    size_t                  memory_budget_;
+    bool                    track_values_;
+    bool                    track_keys_;
+    size_t                  nrecords_;
+    std::vector<Run>        runs_;
+    BucketStats<Value>      stats_;
+};
+
+} // namespace detail
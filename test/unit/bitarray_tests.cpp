@@ -74,4 +74,103 @@ TEST(CapacityGranularity, TestIsTrue)
         EXPECT_EQ(wcap * 64U, wr.GetPos());
         EXPECT_EQ(wcap * 8U, wr.GetCapacity());
     }
-}
\ No newline at end of file
+}
+// reference bit by bit writer
+static void add_bits_ref( std::vector<uint64_t> &data, uint64_t &pos, uint64_t value, uint64_t nbits )
+{
+    for( uint64_t i = 0; i < nbits; ++i, ++pos )
+    {
+        if( data.size() <= pos / 64 )
+            data.resize(pos / 64 + 1);
+        data[pos / 64] |= ((value >> i) & 1) << (pos % 64);
+    }
+}
+
+TEST(WordWriterEquivalence, TestIsTrue)
+{
+    uint64_t seed = 0x12345678;
+    auto rnd = [&seed]() { seed = seed * 6364136223846793005ULL + 1442695040888963407ULL; return seed; };
+
+    for( uint64_t nbits = 0; nbits <= 64; ++nbits )
+    {
+        BitArrayWriter single(0), bulk(0);
+        std::vector<uint64_t> ref;
+        uint64_t ref_pos = 0;
+
+        std::vector<uint64_t> values;
+        for( int i = 0; i < 333; ++i )
+            values.push_back(rnd()); // higher bits must be ignored
+
+        // unaligned start for the bulk writer
+        single.AddBits(5, 3);
+        bulk.AddBits(5, 3);
+        add_bits_ref(ref, ref_pos, 5, 3);
+
+        for( auto v : values )
+        {
+            single.AddBits(v, nbits);
+            add_bits_ref(ref, ref_pos, v, nbits);
+        }
+        bulk.AddBits(values.data(), values.size(), nbits);
+
+        ASSERT_EQ(ref_pos, single.GetPos());
+        ASSERT_EQ(ref_pos, bulk.GetPos());
+
+        BitArrayReader srdr(single), brdr(bulk);
+        for( uint64_t pos = 0; pos < ref_pos; ++pos )
+        {
+            bool const bit = ((ref[pos / 64] >> (pos % 64)) & 1) != 0;
+            ASSERT_EQ(bit, srdr.GetBit(pos));
+            ASSERT_EQ(bit, brdr.GetBit(pos));
+        }
+
+        for( size_t i = 0; i < values.size() && nbits; ++i )
+        {
+            uint64_t const mask = nbits < 64 ? (1UL << nbits) - 1 : ~0UL;
+            ASSERT_EQ(values[i] & mask, BitArrayReader(bulk).GetBits(3 + i * nbits, mask));
+        }
+    }
+}
+
+template<typename T>
+static void check_decode_range( uint64_t nbits )
+{
+    uint64_t seed = 0xABCDEF + nbits;
+    auto rnd = [&seed]() { seed = seed * 6364136223846793005ULL + 1442695040888963407ULL; return seed; };
+
+    size_t const count = 517;
+    std::vector<uint64_t> values(count);
+    for( auto &v : values )
+        v = rnd();
+
+    // exact capacity, so reading behind the range is caught by sanitizers
+    BitArrayWriter wr(count * nbits);
+    wr.AddBits(values.data(), values.size(), nbits);
+
+    std::vector<T> out(count);
+    uint64_t const emask = nbits < 64 ? (1ULL << nbits) - 1 : ~0ULL;
+
+    // default mask and custom ones of explicit mask constructor
+    for( uint64_t mask : { emask, emask & uint64_t(0x5555555555555555ULL), emask >> 1, (emask << 1) | 1 } )
+    {
+        BitArrayAdapter adapter(wr.GetData(), nbits, mask);
+        for( size_t first : { 0, 1, 3, 8, 13, 64, 100 } )
+        {
+            for( size_t n : { size_t(0), size_t(1), size_t(7), size_t(33), count - first } )
+            {
+                std::fill(out.begin(), out.end(), T(0));
+                adapter.decode_range(first, n, out.data());
+                for( size_t i = 0; i < n; ++i )
+                    ASSERT_EQ(T(adapter[first + i]), out[i]);
+            }
+        }
+    }
+}
+
+TEST(DecodeRange, TestIsTrue)
+{
+    for( uint64_t nbits = 1; nbits <= 32; ++nbits )
+        check_decode_range<uint32_t>(nbits);
+    for( uint64_t nbits = 1; nbits <= 64; ++nbits )
+        check_decode_range<uint64_t>(nbits);
+}
@@ -1,7 +1,14 @@
 #include "../../hamap.hpp"
 #include "../../hacmap.hpp"
+#include "../../diskmap.hpp"
+#include "../../asyncmap.hpp"
+#include "../../shardedmap.hpp"
+#include "../../mergemap.hpp"
+#include "../../overlaymap.hpp"
+#include "../../tombstone.hpp"
 #include "gtest/gtest.h"
 #include <fstream>
+#include <sstream>
 
 
 TEST(UtilsTest, TestIsTrue)
@@ -181,20 +188,20 @@ TEST(EHCMapCreationWithBucketsAndNOIO, TestIsTrue)
     
     for( uint32_t i = from; i < to; ++i )
     {
-        auto const *v = searcher.search(i);
+        auto v = searcher.search(i);
         if( 0 == (i & 1) )
         {
-            ASSERT_NE(nullptr, v);
+            ASSERT_TRUE(v);
             EXPECT_EQ(i + 37, *v);
         }
         else
         {
-            ASSERT_EQ(nullptr, v);
+            ASSERT_FALSE(v);
         }
         
         // and not found scan!
         v = searcher.search(i + to);
-        ASSERT_EQ(nullptr, v);
+        ASSERT_FALSE(v);
     }
 }
 
@@ -221,10 +228,10 @@ static void check_range( size_t from, size_t to )
 
         V const *found0 = chk_srch.search(k);
 
-        V const *found1 = srch.search(k);
+        auto found1 = srch.search(k);
 
         ASSERT_NE(nullptr, found0);
-        ASSERT_NE(nullptr, found1);
+        ASSERT_TRUE(found1);
 
         ASSERT_EQ(*found0, *found1);
     }
@@ -238,3 +245,1727 @@ TEST(ComprVsOrdinal, TestIsTrue)
     check_range<uint64_t, uint32_t>(111, 88774);
 }
 
+
+TEST(MappedFileSearch, TestIsTrue)
+{
+    uint32_t const from = 100, to = 70000;
+    {
+        HAMapIndexer<uint32_t, uint32_t> indexer;
+        for( uint32_t i = from; i < to; ++i )
+            indexer.add(i, i + 11);
+
+        std::ofstream ofs("test_mapped.trie", std::ios::trunc | std::ios::binary);
+        utils::OStreamProxy prx(ofs);
+        indexer.compact_and_store(prx, DEFAULT_PAGE_SIZE);
+    }
+    {
+        EHCMapIndexer<uint32_t, uint32_t> indexer;
+        for( uint32_t i = from; i < to; ++i )
+            indexer.add(i, i + 13);
+
+        auto const buffer = indexer.get_compacted();
+        std::ofstream ofs("test_mapped_compr.trie", std::ios::trunc | std::ios::binary);
+        ofs.write(reinterpret_cast<char const*>(buffer.data()), buffer.size());
+    }
+
+    HAMapSearcher<uint32_t, uint32_t> searcher("test_mapped.trie");
+    HACMapSearcher<uint32_t, uint32_t> csearcher("test_mapped_compr.trie");
+
+    EXPECT_EQ(to - from, searcher.size());
+    EXPECT_EQ(to - from, csearcher.size());
+
+    for( uint32_t i = from; i < to; ++i )
+    {
+        auto const *v = searcher.search(i);
+        ASSERT_NE(nullptr, v);
+        EXPECT_EQ(i + 11, *v);
+
+        auto cv = csearcher.search(i);
+        ASSERT_TRUE(cv);
+        EXPECT_EQ(i + 13, *cv);
+
+        ASSERT_EQ(nullptr, searcher.search(i + to));
+    }
+
+    typedef HAMapSearcher<uint32_t, uint32_t> searcher_t;
+    EXPECT_THROW(searcher_t("no_such_file.trie"), std::runtime_error);
+}
+
+template<typename Searcher, typename K>
+static void check_batch( Searcher const &srch, std::vector<K> const &keys )
+{
+    // value pointer or optional value, depending on searcher
+    typedef decltype(srch.search(K())) result_t;
+    std::vector<result_t> out(keys.size());
+    size_t const nfound = srch.search_batch(keys.data(), keys.size(), out.data());
+
+    size_t nexpected = 0;
+    for( size_t i = 0; i < keys.size(); ++i )
+    {
+        result_t v = srch.search(keys[i]);
+        ASSERT_EQ(v, out[i]);
+        nexpected += bool(v);
+    }
+
+    EXPECT_EQ(nexpected, nfound);
+}
+
+TEST(SearchBatch, TestIsTrue)
+{
+    HAMapIndexer<uint64_t, uint32_t> indexer;
+    EHCMapIndexer<uint64_t, uint32_t> cindexer;
+    for( uint32_t i = 0; i < 50000; ++i )
+    {
+        indexer.add(i * 3, i);
+        cindexer.add(i * 3, i);
+    }
+
+    HAMapSearcher<uint64_t, uint32_t> srch(indexer);
+    HACMapSearcher<uint64_t, uint32_t> csrch(cindexer);
+
+    // mix of found and not found keys, odd size to cover partial group
+    std::vector<uint64_t> keys;
+    for( uint64_t i = 0; i < 150001; i += 2 )
+        keys.push_back(i);
+
+    check_batch(srch, keys);
+    check_batch(csrch, keys);
+}
+
+TEST(ComprNotFoundInFilledBucket, TestIsTrue)
+{
+    EHCMapIndexer<uint32_t, uint32_t> indexer;
+    for( uint32_t i = 0; i < 100000; ++i )
+        indexer.add(i * 3, i);
+
+    HACMapSearcher<uint32_t, uint32_t> srch(indexer);
+
+    for( uint32_t i = 0; i < 100000; ++i )
+    {
+        auto v = srch.search(i * 3);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(i, *v);
+        // neighbours share buckets with existing keys, but must not be found
+        ASSERT_FALSE(srch.search(i * 3 + 1));
+        ASSERT_FALSE(srch.search(i * 3 + 2));
+    }
+}
+
+template<typename K>
+static void check_locate()
+{
+    std::vector<K> keys;
+    for( uint32_t n : { 0, 1, 3, 7, 8, 9, 31, 32, 33, 64, 65, 100, 511, 512, 1000, 4097 } )
+    {
+        keys.clear();
+        // sparse sorted keys, including values with higher bit set
+        for( uint32_t i = 0; i < n; ++i )
+            keys.push_back(K(i * 7 + 3) | (i >= n / 2 ? (K(1) << (sizeof(K) * 8 - 1)) : 0));
+
+        for( uint32_t i = 0; i < n; ++i )
+        {
+            ASSERT_EQ(keys.data() + i, detail::locate(keys[i], keys.data(), n));
+            ASSERT_EQ(nullptr, detail::locate(K(keys[i] + 1), keys.data(), n));
+        }
+        ASSERT_EQ(nullptr, detail::locate(K(0), keys.data(), n));
+        ASSERT_EQ(nullptr, detail::locate(K(~K(0)), keys.data(), n));
+    }
+}
+
+TEST(InBucketLocate, TestIsTrue)
+{
+    check_locate<uint32_t>();
+    check_locate<uint64_t>();
+}
+
+template<typename K, typename V>
+static void check_layouts( uint32_t count, size_t page_size )
+{
+    HAMapIndexer<K, V> sorted_idx, eytz_idx;
+    eytz_idx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+    sorted_idx.set_directory_format(DIRECTORY_FORMAT_WIDE);
+    eytz_idx.set_directory_format(DIRECTORY_FORMAT_WIDE);
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        sorted_idx.add(K(i) * 5, V(i));
+        eytz_idx.add(K(i) * 5, V(i));
+    }
+
+    auto const sorted_buf = sorted_idx.get_compacted(page_size);
+    auto const eytz_buf = eytz_idx.get_compacted(page_size);
+    // extension must be written only for non default layout
+    EXPECT_EQ(sorted_buf.size() + sizeof(FooterExt) + sizeof(uint16_t) + 1, eytz_buf.size());
+
+    HAMapSearcher<K, V> srch(eytz_idx);
+    for( uint32_t i = 0; i < count * 5 + 10; ++i )
+    {
+        V const *v = srch.search(i);
+        if( i % 5 == 0 && i < count * 5 )
+        {
+            ASSERT_NE(nullptr, v);
+            EXPECT_EQ(V(i / 5), *v);
+        }
+        else
+        {
+            ASSERT_EQ(nullptr, v);
+        }
+    }
+}
+
+TEST(EytzingerLayout, TestIsTrue)
+{
+    check_layouts<uint32_t, uint32_t>(100000, DEFAULT_PAGE_SIZE);
+    check_layouts<uint64_t, uint32_t>(100000, DEFAULT_PAGE_SIZE);
+    check_layouts<uint64_t, uint64_t>(7777, 512);
+    check_layouts<uint32_t, uint64_t>(3, DEFAULT_PAGE_SIZE);
+
+    for( uint32_t n = 0; n < 300; ++n )
+    {
+        std::vector<uint32_t> keys, ekeys(n);
+        for( uint32_t i = 0; i < n; ++i )
+            keys.push_back(i * 2 + 1);
+        detail::eytzinger_fill(keys.data(), ekeys.data(), 0, 1, n);
+        for( uint32_t i = 0; i < n * 2 + 2; ++i )
+        {
+            uint32_t const *it = detail::eytzinger_locate(i, ekeys.data(), n);
+            if( (i & 1) && i < n * 2 )
+            {
+                ASSERT_NE(nullptr, it);
+                EXPECT_EQ(i, *it);
+            }
+            else
+                ASSERT_EQ(nullptr, it);
+        }
+    }
+}
+
+TEST(InterpolationSearch, TestIsTrue)
+{
+    // skewed keys: dense head and sparse tail
+    std::vector<uint64_t> keys;
+    for( uint64_t i = 0; i < 1000; ++i )
+        keys.push_back(i < 900 ? i * 2 : (i << 40));
+    uint32_t const n = keys.size();
+    for( uint32_t i = 0; i < n; ++i )
+    {
+        ASSERT_EQ(i, detail::interpolation_locate(keys[i], keys.data(), n));
+        ASSERT_EQ(n, detail::interpolation_locate(keys[i] + 1, keys.data(), n));
+    }
+
+    uint32_t const count = 200000;
+    HAMapIndexer<uint64_t, uint32_t> indexer;
+    EHCMapIndexer<uint64_t, uint32_t> cindexer;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        uint64_t const k = uint64_t(i) * 0x9E3779B97F4A7C15ULL;
+        indexer.add(k, i);
+        cindexer.add(k, i);
+    }
+
+    HAMapSearcher<uint64_t, uint32_t> srch(indexer);
+    HACMapSearcher<uint64_t, uint32_t> csrch(cindexer);
+    srch.set_search_mode(SEARCH_MODE_INTERPOLATION);
+    csrch.set_search_mode(SEARCH_MODE_INTERPOLATION);
+
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        uint64_t const k = uint64_t(i) * 0x9E3779B97F4A7C15ULL;
+        auto const *v = srch.search(k);
+        ASSERT_NE(nullptr, v);
+        EXPECT_EQ(i, *v);
+        auto cv = csrch.search(k);
+        ASSERT_TRUE(cv);
+        EXPECT_EQ(i, *cv);
+
+        ASSERT_EQ(nullptr, srch.search(k + 1));
+        ASSERT_FALSE(csrch.search(k + 1));
+    }
+}
+
+template<typename K, typename V>
+static void check_packed_values( V vfrom, V vstep, uint32_t count, bool expect_smaller = true )
+{
+    EHCMapIndexer<K, V> packed, plain;
+    plain.set_value_packing(false);
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        packed.add(K(i) * 7, V(vfrom + V(i % 1000) * vstep));
+        plain.add(K(i) * 7, V(vfrom + V(i % 1000) * vstep));
+    }
+
+    HACMapSearcher<K, V> psrch(packed), srch(plain);
+    if( expect_smaller )
+    {
+        EXPECT_LT(psrch.get_mem_size(), srch.get_mem_size());
+    }
+
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        auto pv = psrch.search(K(i) * 7);
+        auto v = srch.search(K(i) * 7);
+        ASSERT_TRUE(pv);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(V(vfrom + V(i % 1000) * vstep), *pv);
+        EXPECT_EQ(*v, *pv);
+        ASSERT_FALSE(psrch.search(K(i) * 7 + 1));
+    }
+}
+
+TEST(PackedValues, TestIsTrue)
+{
+    check_packed_values<uint32_t, uint64_t>(1ULL << 40, 4096, 100000);
+    check_packed_values<uint64_t, uint32_t>(7, 1, 50000);
+    // all values equal, zero width deltas
+    check_packed_values<uint32_t, uint32_t>(42, 0, 10000);
+    check_packed_values<uint64_t, int64_t>(-500000, 999, 30000);
+    // full width deltas
+    check_packed_values<uint32_t, uint64_t>(0, 1ULL << 54, 20000, false);
+}
+
+TEST(ParallelCompaction, TestIsTrue)
+{
+    for( size_t count : { 0, 5, 1000, 300000 } )
+    {
+        HAMapIndexer<uint64_t, uint32_t> serial, parallel, eytz_serial, eytz_parallel;
+        EHCMapIndexer<uint64_t, uint32_t> cserial, cparallel;
+        parallel.set_threads(4);
+        eytz_parallel.set_threads(3);
+        eytz_serial.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        eytz_parallel.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        cparallel.set_threads(5);
+
+        for( size_t i = 0; i < count; ++i )
+        {
+            uint64_t const k = i * 0x9E3779B97F4A7C15ULL;
+            serial.add(k, i);
+            parallel.add(k, i);
+            eytz_serial.add(k, i);
+            eytz_parallel.add(k, i);
+            cserial.add(k, i);
+            cparallel.add(k, i);
+        }
+
+        EXPECT_EQ(serial.get_compacted(), parallel.get_compacted());
+        EXPECT_EQ(eytz_serial.get_compacted(), eytz_parallel.get_compacted());
+        EXPECT_EQ(cserial.get_compacted(), cparallel.get_compacted());
+    }
+}
+
+template<typename Key, typename Value>
+static void check_sort_bucket( size_t n, uint32_t key_shift, Key kfrom, Key kmod )
+{
+    // all keys share lower key_shift bits, like keys of one bucket
+    std::vector< std::pair<Key, Value> > recs, expected;
+    uint64_t x = 88172645463325252ULL;
+    for( size_t i = 0; i < n; ++i )
+    {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        Key const hi = kfrom + Key(x % uint64_t(kmod));
+        Key const k = Key((uint64_t(hi) << key_shift) | 5);
+        recs.emplace_back(k, Value(x >> 40));
+    }
+    expected = recs;
+    std::sort(expected.begin(), expected.end());
+    detail::sort_bucket(recs.data(), recs.size(), key_shift);
+    EXPECT_EQ(expected, recs);
+}
+
+TEST(RadixBucketSort, TestIsTrue)
+{
+    for( size_t n : { 0, 1, 7, 32, 33, 1000, 50000 } )
+    {
+        check_sort_bucket<uint64_t, uint32_t>(n, 10, 0, 1000000000);
+        check_sort_bucket<uint64_t, uint32_t>(n, 4, 0, 3);              // many duplicates
+        check_sort_bucket<uint32_t, uint64_t>(n, 0, 0, 0x7FFFFFFF);
+        check_sort_bucket<int64_t, uint32_t>(n, 8, -1000000, 2000000);  // signed keys
+        check_sort_bucket<int32_t, int32_t>(n, 0, -50, 100);
+    }
+}
+
+TEST(PartitionInPlace, TestIsTrue)
+{
+    for( size_t n : { 0, 1, 100, 50000 } )
+    {
+        for( size_t nbuckets : { 1, 2, 64, 1024 } )
+        {
+            std::vector<std::pair<uint64_t, uint32_t>> recs;
+            for( size_t i = 0; i < n; ++i )
+                recs.emplace_back((i % 97 == 3 ? i - 1 : i) * 0x9E3779B97F4A7C15ULL, uint32_t(i));
+            auto expected = recs;
+            size_t const cap = recs.capacity();
+
+            std::vector<size_t> const starts = detail::partition_in_place(recs, nbuckets);
+            ASSERT_EQ(nbuckets + 1, starts.size());
+            EXPECT_EQ(n, starts.back());
+            EXPECT_EQ(cap, recs.capacity());
+            for( size_t i = 0; i < nbuckets; ++i )
+            {
+                for( size_t j = starts[i]; j < starts[i + 1]; ++j )
+                    ASSERT_EQ(i, recs[j].first & (nbuckets - 1));
+            }
+            std::sort(expected.begin(), expected.end());
+            std::sort(recs.begin(), recs.end());
+            EXPECT_EQ(expected, recs);
+        }
+    }
+}
+
+TEST(SpillingBuild, TestIsTrue)
+{
+    for( size_t count : { 0, 5, 3000, 100000 } )
+    {
+        // small memory budget, so records are spilled by many runs
+        size_t const budget = 64 * 1024;
+        HAMapIndexer<uint64_t, uint32_t> mem, spilled, mem_hint(count), spilled_hint(count);
+        EHCMapIndexer<uint64_t, uint32_t> cmem, cspilled, cspilled_hint;
+        EHCMapIndexer<uint32_t, float> fmem, fspilled;
+        spilled.set_memory_budget(budget);
+        spilled_hint.set_memory_budget(budget);
+        spilled_hint.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        mem_hint.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        cspilled.set_memory_budget(budget);
+        cspilled.set_threads(3);
+        cspilled_hint.set_memory_budget(budget, "/tmp", count);
+        fspilled.set_memory_budget(budget);
+
+        for( size_t i = 0; i < count; ++i )
+        {
+            // some keys are duplicated
+            uint64_t const k = (i % 1000 == 7 ? i - 1 : i) * 0x9E3779B97F4A7C15ULL;
+            uint32_t const v = uint32_t(i * 7919);
+            mem.add(k, v);
+            spilled.add(k, v);
+            mem_hint.add(k, v);
+            spilled_hint.add(k, v);
+            cmem.add(k, v);
+            cspilled.add(k, v);
+            cspilled_hint.add(k, v);
+            fmem.add(uint32_t(k >> 32), float(i));
+            fspilled.add(uint32_t(k >> 32), float(i));
+        }
+
+        EXPECT_EQ(mem.size(), spilled.size());
+        EXPECT_EQ(mem.get_compacted(), spilled.get_compacted());
+        EXPECT_EQ(mem_hint.get_compacted(), spilled_hint.get_compacted());
+        auto const cbuf = cmem.get_compacted();
+        EXPECT_EQ(cbuf, cspilled.get_compacted());
+        EXPECT_EQ(cbuf, cspilled_hint.get_compacted());
+        EXPECT_EQ(cbuf.size(), cspilled.get_compacted_size());
+        EXPECT_EQ(mem.get_compacted_size(), spilled.get_compacted_size());
+        EXPECT_EQ(fmem.get_compacted(), fspilled.get_compacted());
+
+        spilled.clear();
+        EXPECT_EQ(0U, spilled.size());
+    }
+}
+
+static std::vector<uint8_t> read_file( std::string const &path )
+{
+    std::ifstream ifs(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+template<typename Indexer>
+static void check_sinks( Indexer &idx, std::string const &path )
+{
+    auto const buffer = idx.get_compacted();
+    EXPECT_EQ(buffer.size(), idx.get_compacted_size());
+
+    // preallocated memory of exact size
+    std::vector<uint8_t> mem(buffer.size());
+    {
+        utils::OStreamProxy os(mem.data(), mem.size());
+        idx.compact_and_store(os, DEFAULT_PAGE_SIZE);
+        EXPECT_EQ(mem.size(), os.tellp());
+    }
+    EXPECT_EQ(buffer, mem);
+
+    if( !buffer.empty() )
+    {
+        utils::OStreamProxy os(mem.data(), mem.size() - 1);
+        EXPECT_THROW(idx.compact_and_store(os, DEFAULT_PAGE_SIZE), std::runtime_error);
+    }
+
+    idx.store(path, DEFAULT_PAGE_SIZE, utils::FILE_SINK_MMAP);
+    EXPECT_EQ(buffer, read_file(path));
+
+    idx.store(path, DEFAULT_PAGE_SIZE, utils::FILE_SINK_PWRITE);
+    EXPECT_EQ(buffer, read_file(path));
+    {
+        // small batches
+        utils::OStreamProxy os(path, utils::FILE_SINK_PWRITE, 100);
+        idx.compact_and_store(os, DEFAULT_PAGE_SIZE);
+        os.close();
+    }
+    EXPECT_EQ(buffer, read_file(path));
+    {
+        std::ofstream ofs(path, std::ios::trunc | std::ios::binary);
+        utils::OStreamProxy os(ofs);
+        idx.compact_and_store(os, DEFAULT_PAGE_SIZE);
+    }
+    EXPECT_EQ(buffer, read_file(path));
+}
+
+TEST(OutputSinks, TestIsTrue)
+{
+    for( size_t count : { 0, 1, 1000, 70000 } )
+    {
+        HAMapIndexer<uint64_t, uint32_t> idx;
+        HAMapIndexer<uint32_t, uint64_t> eidx;
+        EHCMapIndexer<uint64_t, uint32_t> cidx;
+        EHCMapIndexer<uint32_t, double> didx;
+        eidx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        for( size_t i = 0; i < count; ++i )
+        {
+            uint64_t const k = i * 0x9E3779B97F4A7C15ULL;
+            idx.add(k, i);
+            eidx.add(uint32_t(k >> 32), i);
+            cidx.add(k, i * 3);
+            didx.add(uint32_t(k >> 32), i * 0.5);
+        }
+
+        check_sinks(idx, "test_sink.trie");
+        check_sinks(eidx, "test_sink.trie");
+        check_sinks(cidx, "test_sink.trie");
+        check_sinks(didx, "test_sink.trie");
+    }
+
+    EHCMapIndexer<uint64_t, uint32_t> cidx;
+    for( uint32_t i = 0; i < 50000; ++i )
+        cidx.add(i * 0x9E3779B97F4A7C15ULL, i);
+    cidx.store("test_sink.trie");
+
+    HACMapSearcher<uint64_t, uint32_t> csearcher("test_sink.trie");
+    for( uint32_t i = 0; i < 50000; ++i )
+    {
+        auto v = csearcher.search(i * 0x9E3779B97F4A7C15ULL);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(i, *v);
+    }
+}
+
+TEST(AlignedMemory, TestIsTrue)
+{
+    HAMapIndexer<uint64_t, uint32_t> idx;
+    EHCMapIndexer<uint64_t, uint32_t> cidx;
+    for( uint32_t i = 0; i < 30000; ++i )
+    {
+        idx.add(i * 0x9E3779B97F4A7C15ULL, i);
+        cidx.add(i * 0x9E3779B97F4A7C15ULL, i);
+    }
+
+    auto const buffer = idx.get_compacted();
+    utils::MemoryHolder mem = idx.get_compacted_memory();
+    EXPECT_EQ(0U, size_t(mem.get_ptr<uint8_t>()) % utils::CACHE_LINE_SIZE);
+    ASSERT_EQ(buffer.size(), mem.get_mem_size());
+    EXPECT_EQ(0, memcmp(buffer.data(), mem.get_ptr<void>(), buffer.size()));
+
+    // reader adopts holder without copy
+    uint8_t const *ptr = mem.get_ptr<uint8_t>();
+    utils::MemoryReader rdr(std::move(mem));
+    utils::MemoryHolder adopted = rdr.get_ownership();
+    EXPECT_EQ(ptr, adopted.get_ptr<uint8_t>());
+
+    // copied buffer is aligned too
+    utils::MemoryHolder copied = utils::MemoryHolder::mk(std::vector<uint8_t>(buffer));
+    EXPECT_EQ(0U, size_t(copied.get_ptr<uint8_t>()) % utils::CACHE_LINE_SIZE);
+
+    HAMapSearcher<uint64_t, uint32_t> searcher(idx);
+    HACMapSearcher<uint64_t, uint32_t> csearcher(cidx);
+    for( uint32_t i = 0; i < 30000; ++i )
+    {
+        auto const *v = searcher.search(i * 0x9E3779B97F4A7C15ULL);
+        ASSERT_NE(nullptr, v);
+        EXPECT_EQ(i, *v);
+        auto cv = csearcher.search(i * 0x9E3779B97F4A7C15ULL);
+        ASSERT_TRUE(cv);
+        EXPECT_EQ(i, *cv);
+    }
+}
+
+template<typename Indexer, typename Searcher, typename K, typename V>
+static void check_directory_formats( uint32_t count, size_t page_size, bool expect_tiny )
+{
+    Indexer auto_idx, wide_idx, tiny_idx;
+    wide_idx.set_directory_format(DIRECTORY_FORMAT_WIDE);
+    tiny_idx.set_directory_format(DIRECTORY_FORMAT_TINY);
+    std::vector<K> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        K const k = K(i * 0x9E3779B97F4A7C15ULL);
+        auto_idx.add(k, V(i));
+        wide_idx.add(k, V(i));
+        tiny_idx.add(k, V(i));
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+
+    auto const auto_buf = auto_idx.get_compacted(page_size);
+    auto const wide_buf = wide_idx.get_compacted(page_size);
+    if( !expect_tiny )
+    {
+        EXPECT_EQ(wide_buf, auto_buf);
+        EXPECT_THROW(tiny_idx.get_compacted(page_size), std::runtime_error);
+        return;
+    }
+
+    EXPECT_EQ(auto_buf, tiny_idx.get_compacted(page_size));
+    EXPECT_EQ(auto_buf.size(), auto_idx.get_compacted_size(page_size));
+
+    for( auto const *buf : { &auto_buf, &wide_buf } )
+    {
+        std::istringstream is(std::string(buf->begin(), buf->end()));
+        Searcher srch(is);
+        EXPECT_EQ(count, srch.size());
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            auto const v = srch.search(keys[i * 2]);
+            ASSERT_TRUE(v);
+            EXPECT_EQ(V(i), *v);
+        }
+        check_batch(srch, keys);
+    }
+}
+
+TEST(TinyDirectory, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx64_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch64_t;
+    typedef HAMapIndexer<uint32_t, uint32_t> idx32_t;
+    typedef HAMapSearcher<uint32_t, uint32_t> srch32_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef EHCMapIndexer<uint64_t, float> fidx_t;
+    typedef HACMapSearcher<uint64_t, float> fsrch_t;
+
+    for( uint32_t count : { 1, 3, 1000, 100000 } )
+    {
+        check_directory_formats<idx64_t, srch64_t, uint64_t, uint32_t>(count, DEFAULT_PAGE_SIZE, true);
+        check_directory_formats<idx32_t, srch32_t, uint32_t, uint32_t>(count, DEFAULT_PAGE_SIZE, true);
+        check_directory_formats<cidx_t, csrch_t, uint64_t, uint32_t>(count, DEFAULT_PAGE_SIZE, true);
+        check_directory_formats<fidx_t, fsrch_t, uint64_t, float>(count, DEFAULT_PAGE_SIZE, true);
+    }
+
+    // too many keys per bucket
+    check_directory_formats<idx64_t, srch64_t, uint64_t, uint32_t>(100000, 1 << 20, false);
+    check_directory_formats<cidx_t, csrch_t, uint64_t, uint32_t>(100000, 1 << 20, false);
+
+    // directory takes half of space
+    idx32_t tiny, wide;
+    wide.set_directory_format(DIRECTORY_FORMAT_WIDE);
+    for( uint32_t i = 0; i < 100000; ++i )
+    {
+        tiny.add(i, i);
+        wide.add(i, i);
+    }
+    size_t const nbuckets = detail::calc_buckets_count(100000 * 8, DEFAULT_PAGE_SIZE);
+    EXPECT_EQ(wide.get_compacted_size() - nbuckets * 4 + sizeof(FooterExt) + sizeof(uint16_t) + 1, tiny.get_compacted_size());
+}
+
+TEST(EliasFanoDirectory, TestIsTrue)
+{
+    // round trip of non-decreasing offsets, empty buckets share offset
+    for( size_t n : { 1, 2, 255, 256, 257, 5000 } )
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        uint64_t offs = 0;
+        uint32_t max_nkeys = 0;
+        for( size_t i = 0; i < n; ++i )
+        {
+            uint32_t const nkeys = i % 4 ? (i * 0x9E3779B97F4A7C15ULL >> 40) % 300 : 0;
+            entries.emplace_back(offs, nkeys);
+            max_nkeys = std::max(max_nkeys, nkeys);
+            offs += nkeys * 12;
+        }
+        auto const params = detail::EliasFanoParams::mk(n, entries.back().first, max_nkeys);
+        detail::EliasFanoWriter wr(n, params);
+        for( auto const &e : entries )
+            wr.add(e.first, e.second);
+
+        std::vector<uint8_t> buf;
+        {
+            utils::OStreamProxy os(buf);
+            wr.write(os);
+        }
+        ASSERT_EQ(params.get_size(n), buf.size());
+        std::vector<uint64_t> words(buf.size() / sizeof(uint64_t));
+        memcpy(words.data(), buf.data(), buf.size());
+
+        detail::EliasFanoDirectory const dir(reinterpret_cast<uint8_t const*>(words.data()), n, params);
+        for( size_t i = 0; i < n; ++i )
+            ASSERT_EQ(entries[i], dir.get(i)) << "n: " << n << " i: " << i;
+    }
+}
+
+template<typename Indexer, typename Searcher, typename K, typename V>
+static void check_ef_directory( uint32_t count, size_t page_size )
+{
+    Indexer ef_idx, wide_idx;
+    ef_idx.set_directory_format(DIRECTORY_FORMAT_ELIAS_FANO);
+    wide_idx.set_directory_format(DIRECTORY_FORMAT_WIDE);
+    std::vector<K> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        K const k = K(i * 0x9E3779B97F4A7C15ULL);
+        ef_idx.add(k, V(i));
+        wide_idx.add(k, V(i));
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+
+    auto const ef_buf = ef_idx.get_compacted(page_size);
+    auto const wide_buf = wide_idx.get_compacted(page_size);
+    EXPECT_EQ(ef_buf.size(), ef_idx.get_compacted_size(page_size));
+    size_t const nbuckets = detail::calc_buckets_count((sizeof(K) + sizeof(V)) * count, page_size);
+    if( nbuckets > 16 )
+    {
+        EXPECT_LT(ef_buf.size(), wide_buf.size());
+    }
+
+    std::istringstream ef_is(std::string(ef_buf.begin(), ef_buf.end()));
+    std::istringstream wide_is(std::string(wide_buf.begin(), wide_buf.end()));
+    Searcher ef_srch(ef_is), wide_srch(wide_is);
+    EXPECT_EQ(wide_srch.size(), ef_srch.size());
+    EXPECT_EQ(count, ef_srch.size());
+    for( auto const k : keys )
+    {
+        auto const a = ef_srch.search(k);
+        auto const b = wide_srch.search(k);
+        ASSERT_EQ(bool(b), bool(a));
+        if( b )
+        {
+            EXPECT_EQ(*b, *a);
+        }
+    }
+    check_batch(ef_srch, keys);
+}
+
+TEST(EliasFanoDirectoryMaps, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef EHCMapIndexer<uint64_t, float> fidx_t;
+    typedef HACMapSearcher<uint64_t, float> fsrch_t;
+
+    for( uint32_t count : { 1, 3, 1000, 100000 } )
+    {
+        for( size_t page_size : { 256, DEFAULT_PAGE_SIZE } )
+        {
+            check_ef_directory<idx_t, srch_t, uint64_t, uint32_t>(count, page_size);
+            check_ef_directory<cidx_t, csrch_t, uint64_t, uint32_t>(count, page_size);
+            check_ef_directory<fidx_t, fsrch_t, uint64_t, float>(count, page_size);
+        }
+    }
+    // no limits for keys per bucket
+    check_ef_directory<idx_t, srch_t, uint64_t, uint32_t>(100000, 1 << 20);
+    check_ef_directory<cidx_t, csrch_t, uint64_t, uint32_t>(100000, 1 << 20);
+}
+
+// values of equal_range() result as vector, HAMap returns pointers span
+template<typename V>
+static std::vector<V> range_values( std::pair<V const*, V const*> const &r )
+{
+    return std::vector<V>(r.first, r.second);
+}
+
+template<typename Range>
+static auto range_values( Range const &r )
+{
+    std::vector<decltype(r[0])> out;
+    for( size_t i = 0; i < r.size(); ++i )
+        out.push_back(r[i]);
+    return out;
+}
+
+template<typename Indexer, typename Searcher>
+static void check_multimap( uint32_t count, size_t page_size )
+{
+    Indexer idx;
+    idx.set_multimap(true);
+    // key i has i % 5 values, added in reverse order
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        for( uint32_t j = i % 5; j > 0; --j )
+            idx.add(i * 0x9E3779B97F4A7C15ULL, i * 8 + j);
+    }
+
+    auto const buf = idx.get_compacted(page_size);
+    EXPECT_EQ(buf.size(), idx.get_compacted_size(page_size));
+    std::istringstream is(std::string(buf.begin(), buf.end()));
+    Searcher srch(is);
+    EXPECT_TRUE(srch.is_multimap());
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        uint64_t const k = i * 0x9E3779B97F4A7C15ULL;
+        auto const r = range_values(srch.equal_range(k));
+        ASSERT_EQ(i % 5, r.size()) << i;
+        for( uint32_t j = 0; j < i % 5; ++j )
+            EXPECT_EQ(i * 8 + j + 1, r[j]);
+
+        auto const v = srch.search(k);
+        if( i % 5 )
+        {
+            ASSERT_TRUE(v);
+            EXPECT_EQ(i * 8 + 1, *v);
+        }
+        else
+        {
+            EXPECT_FALSE(v);
+        }
+        EXPECT_TRUE(range_values(srch.equal_range(k + 1)).empty());
+    }
+}
+
+TEST(Multimap, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef EHCMapIndexer<uint64_t, float> fidx_t;
+    typedef HACMapSearcher<uint64_t, float> fsrch_t;
+
+    for( uint32_t count : { 2, 100, 100000 } )
+    {
+        for( size_t page_size : { 256, DEFAULT_PAGE_SIZE } )
+        {
+            check_multimap<idx_t, srch_t>(count, page_size);
+            check_multimap<cidx_t, csrch_t>(count, page_size);
+            check_multimap<fidx_t, fsrch_t>(count, page_size);
+        }
+    }
+
+    // multimap forces sorted layout
+    idx_t eidx;
+    eidx.set_multimap(true);
+    eidx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+    for( uint32_t i = 0; i < 1000; ++i )
+    {
+        eidx.add(i / 2, i);
+    }
+    srch_t esrch(eidx);
+    for( uint32_t i = 0; i < 500; ++i )
+    {
+        auto const r = range_values(esrch.equal_range(i));
+        ASSERT_EQ(2u, r.size());
+        EXPECT_EQ(i * 2, r[0]);
+        EXPECT_EQ(i * 2 + 1, r[1]);
+    }
+
+    // unique map with Eytzinger layout has no ranges
+    idx_t uidx;
+    uidx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+    uidx.add(1, 1);
+    srch_t usrch(uidx);
+    EXPECT_FALSE(usrch.is_multimap());
+    EXPECT_THROW(usrch.equal_range(1), std::runtime_error);
+}
+
+template<typename Indexer, typename Searcher, typename DiskSearcher, typename K, typename V>
+static void check_disk_searcher( uint32_t count, size_t page_size, DirectoryFormat format )
+{
+    std::string const path = "test_disk.map";
+    Indexer idx;
+    idx.set_directory_format(format);
+    std::vector<K> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        K const k = K(i * 0x9E3779B97F4A7C15ULL);
+        idx.add(k, V(i));
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+    idx.store(path, page_size);
+
+    Searcher msrch(path);
+    DiskSearcher dsrch(path);
+    EXPECT_EQ(msrch.size(), dsrch.size());
+    EXPECT_LT(dsrch.get_mem_size(), msrch.get_mem_size());
+    for( auto const k : keys )
+    {
+        auto const a = dsrch.search(k);
+        auto const b = msrch.search(k);
+        ASSERT_EQ(bool(b), bool(a));
+        if( b )
+        {
+            EXPECT_EQ(*b, *a);
+        }
+    }
+
+    for( size_t nthreads : { 1, 4 } )
+    {
+        dsrch.set_io_threads(nthreads);
+        std::vector<std::optional<V>> out(keys.size());
+        EXPECT_EQ(count, dsrch.search_batch(keys.data(), keys.size(), out.data()));
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            ASSERT_TRUE(out[i * 2]);
+            EXPECT_EQ(V(i), *out[i * 2]);
+            EXPECT_FALSE(out[i * 2 + 1]);
+        }
+    }
+
+    // io threads are kept between batches and shared by concurrent callers
+    std::vector<std::thread> callers;
+    for( size_t t = 0; t < 4; ++t )
+    {
+        callers.emplace_back([&dsrch, &keys, t]() {
+            size_t const n = std::min(keys.size(), size_t(64));
+            std::vector<std::optional<V>> out(n);
+            for( size_t first = t * 2; first + n <= keys.size(); first += 1000 )
+            {
+                EXPECT_EQ(n / 2, dsrch.search_batch(keys.data() + first, n, out.data()));
+                for( size_t i = 0; i < n; i += 2 )
+                {
+                    ASSERT_TRUE(out[i]);
+                    EXPECT_EQ(V((first + i) / 2), *out[i]);
+                    EXPECT_FALSE(out[i + 1]);
+                }
+            }
+        });
+    }
+    for( auto &t : callers )
+        t.join();
+    std::remove(path.c_str());
+}
+
+TEST(DiskSearcher, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef HAMapDiskSearcher<uint64_t, uint32_t> dsrch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef HACMapDiskSearcher<uint64_t, uint32_t> cdsrch_t;
+    typedef EHCMapIndexer<uint32_t, float> fidx_t;
+    typedef HACMapSearcher<uint32_t, float> fsrch_t;
+    typedef HACMapDiskSearcher<uint32_t, float> fdsrch_t;
+
+    for( uint32_t count : { 1, 1000, 100000 } )
+    {
+        for( DirectoryFormat format : { DIRECTORY_FORMAT_WIDE, DIRECTORY_FORMAT_AUTO, DIRECTORY_FORMAT_ELIAS_FANO } )
+        {
+            check_disk_searcher<idx_t, srch_t, dsrch_t, uint64_t, uint32_t>(count, DEFAULT_PAGE_SIZE, format);
+            check_disk_searcher<cidx_t, csrch_t, cdsrch_t, uint64_t, uint32_t>(count, DEFAULT_PAGE_SIZE, format);
+            check_disk_searcher<fidx_t, fsrch_t, fdsrch_t, uint32_t, float>(count, 256, format);
+        }
+    }
+
+    EXPECT_THROW(dsrch_t("no_such_file.map"), std::runtime_error);
+}
+
+TEST(BucketCache, TestIsTrue)
+{
+    typedef detail::BucketCache cache_t;
+    size_t const entry = 8 * sizeof(uint64_t) + detail::BUCKET_CACHE_ENTRY_OVERHEAD;
+    // one shard of 4 entries
+    cache_t cache(entry * 4, 1);
+    for( size_t i = 0; i < 4; ++i )
+        cache.put(i, std::make_shared<cache_t::bucket_t>(8, i));
+    EXPECT_EQ(4u, cache.get_stats().entries);
+
+    // referenced entries get second chance
+    ASSERT_TRUE(cache.get(0));
+    ASSERT_TRUE(cache.get(2));
+    EXPECT_EQ(2u, (*cache.get(2))[0]);
+    cache.put(4, std::make_shared<cache_t::bucket_t>(8, 4));
+    cache.put(5, std::make_shared<cache_t::bucket_t>(8, 5));
+    EXPECT_FALSE(cache.get(1));
+    EXPECT_FALSE(cache.get(3));
+    EXPECT_TRUE(cache.get(0));
+    EXPECT_TRUE(cache.get(4));
+
+    cache_t::Stats const st = cache.get_stats();
+    EXPECT_EQ(4u, st.entries);
+    EXPECT_EQ(2u, st.evictions);
+    EXPECT_EQ(2u, st.misses);
+    EXPECT_EQ(5u, st.hits);
+    EXPECT_EQ(entry * 4, st.memory);
+
+    // too large bucket is not cached
+    cache.put(6, std::make_shared<cache_t::bucket_t>(1000));
+    EXPECT_FALSE(cache.get(6));
+}
+
+TEST(DiskSearcherCache, TestIsTrue)
+{
+    std::string const path = "test_disk.map";
+    EHCMapIndexer<uint64_t, uint32_t> idx;
+    uint32_t const count = 100000;
+    std::vector<uint64_t> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        idx.add(i * 0x9E3779B97F4A7C15ULL, i);
+        keys.push_back(i * 0x9E3779B97F4A7C15ULL);
+    }
+    idx.store(path);
+
+    size_t const budget = 512 * 1024;
+    HACMapDiskSearcher<uint64_t, uint32_t> srch(path);
+    srch.set_cache(budget, 4);
+    // hot keys
+    for( int pass = 0; pass < 3; ++pass )
+    {
+        for( uint32_t i = 0; i < 100; ++i )
+        {
+            auto const v = srch.search(keys[i]);
+            ASSERT_TRUE(v);
+            EXPECT_EQ(i, *v);
+        }
+    }
+    auto st = srch.get_cache_stats();
+    EXPECT_GE(st.hits, 2 * st.misses);
+    EXPECT_LE(st.memory, budget);
+
+    // all keys, cache is full and evicts
+    for( size_t nthreads : { 1, 4 } )
+    {
+        srch.set_io_threads(nthreads);
+        std::vector<std::optional<uint32_t>> out(keys.size());
+        EXPECT_EQ(count, srch.search_batch(keys.data(), keys.size(), out.data()));
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            ASSERT_TRUE(out[i]);
+            EXPECT_EQ(i, *out[i]);
+        }
+    }
+    st = srch.get_cache_stats();
+    EXPECT_GT(st.evictions, 0u);
+    EXPECT_LE(st.memory, budget);
+
+    // concurrent lookups
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nfound(0);
+    for( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back([&srch, &keys, &nfound, t]() {
+            for( uint32_t i = t; i < keys.size(); i += 4 )
+                nfound += srch.search(keys[i]).has_value();
+        });
+    }
+    for( auto &t : threads )
+        t.join();
+    EXPECT_EQ(count, nfound);
+
+    srch.set_cache(0);
+    EXPECT_EQ(0u, srch.get_cache_stats().hits);
+    std::remove(path.c_str());
+}
+
+#ifdef __cpp_impl_coroutine
+
+template<typename Searcher, typename K, typename V>
+static void check_async_search( Searcher const &srch, std::vector<K> const &keys, size_t io_threads )
+{
+    LookupScheduler sched(io_threads);
+    for( size_t i = 0; i < keys.size(); i += 97 )
+    {
+        auto task = async_search(srch, sched, keys[i]);
+        sched.spawn(task);
+        sched.run();
+        ASSERT_TRUE(task.done());
+        EXPECT_EQ(detail::to_optional(srch.search(keys[i])), task.get());
+    }
+
+    for( size_t inflight : { 1, 7, 32, 100000 } )
+    {
+        std::vector<std::optional<V>> out(keys.size());
+        EXPECT_EQ(keys.size() / 2, async_search_batch(srch, sched, keys.data(), keys.size(), out.data(), inflight));
+        for( size_t i = 0; i < keys.size(); i += 2 )
+        {
+            ASSERT_TRUE(out[i]);
+            EXPECT_EQ(V(i / 2), *out[i]);
+            EXPECT_FALSE(out[i + 1]);
+        }
+    }
+}
+
+TEST(AsyncSearch, TestIsTrue)
+{
+    std::string const path = "test_disk.map";
+    HAMapIndexer<uint64_t, uint32_t> idx;
+    EHCMapIndexer<uint64_t, uint32_t> cidx;
+    std::vector<uint64_t> keys;
+    for( uint32_t i = 0; i < 20000; ++i )
+    {
+        uint64_t const k = i * 0x9E3779B97F4A7C15ULL;
+        idx.add(k, i);
+        cidx.add(k, i);
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+
+    HAMapSearcher<uint64_t, uint32_t> srch(idx);
+    HACMapSearcher<uint64_t, uint32_t> csrch(cidx);
+    check_async_search<HAMapSearcher<uint64_t, uint32_t>, uint64_t, uint32_t>(srch, keys, 0);
+    check_async_search<HACMapSearcher<uint64_t, uint32_t>, uint64_t, uint32_t>(csrch, keys, 0);
+
+    cidx.store(path);
+    HACMapDiskSearcher<uint64_t, uint32_t> dsrch(path);
+    check_async_search<HACMapDiskSearcher<uint64_t, uint32_t>, uint64_t, uint32_t>(dsrch, keys, 0);
+    check_async_search<HACMapDiskSearcher<uint64_t, uint32_t>, uint64_t, uint32_t>(dsrch, keys, 4);
+    dsrch.set_cache(1 << 20);
+    check_async_search<HACMapDiskSearcher<uint64_t, uint32_t>, uint64_t, uint32_t>(dsrch, keys, 4);
+    EXPECT_GT(dsrch.get_cache_stats().hits, 0u);
+
+    // large batch of lookups finished without suspension(cache hits, filter rejects)
+    // must not grow the stack
+    std::vector<uint64_t> many;
+    for( size_t r = 0; r < 50; ++r )
+        many.insert(many.end(), keys.begin(), keys.end());
+    std::vector<std::optional<uint32_t>> out(many.size());
+    LookupScheduler sched(4);
+    for( size_t inflight : { 1, 32 } )
+    {
+        EXPECT_EQ(many.size() / 2, async_search_batch(dsrch, sched, many.data(), many.size(), out.data(), inflight));
+        EXPECT_EQ(many.size() / 2, async_search_batch(csrch, sched, many.data(), many.size(), out.data(), inflight));
+    }
+    std::remove(path.c_str());
+}
+
+#endif // __cpp_impl_coroutine
+
+template<typename Indexer, typename Searcher, typename K, typename V>
+static void check_sharded( uint32_t count, size_t nshards )
+{
+    std::string const prefix = "test_sharded.map";
+    ShardedIndexer<Indexer, K, V> idx(nshards);
+    std::vector<K> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        K const k = K(i * 0x9E3779B97F4A7C15ULL);
+        idx.add(k, V(i));
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+    EXPECT_EQ(count, idx.size());
+    idx.store(prefix, DEFAULT_PAGE_SIZE, 4);
+
+    ShardedSearcher<Searcher, K> srch(prefix, nshards);
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        auto const v = srch.search(keys[i * 2]);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(V(i), *v);
+        EXPECT_FALSE(srch.search(keys[i * 2 + 1]));
+    }
+    srch.load(4);
+    EXPECT_EQ(count, srch.size());
+    check_batch(srch, keys);
+
+    // rebuild shard 0 with other values
+    Indexer shard0;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        if( 0 == detail::get_shard_index(keys[i * 2], detail::get_shard_bits(nshards)) )
+            shard0.add(keys[i * 2], V(i + 1));
+    }
+    shard0.store(prefix + ".new");
+    srch.replace_shard(0, prefix + ".new");
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        bool const in0 = 0 == detail::get_shard_index(keys[i * 2], detail::get_shard_bits(nshards));
+        auto const v = srch.search(keys[i * 2]);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(V(in0 ? i + 1 : i), *v);
+    }
+
+    for( size_t i = 0; i < nshards; ++i )
+        std::remove(detail::get_shard_path(prefix, i).c_str());
+    std::remove((prefix + ".new").c_str());
+}
+
+TEST(ShardedMap, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef HACMapDiskSearcher<uint64_t, uint32_t> dsrch_t;
+    typedef EHCMapIndexer<uint32_t, float> fidx_t;
+    typedef HACMapSearcher<uint32_t, float> fsrch_t;
+    typedef HAMapIndexer<int64_t, uint32_t> sidx_t;
+    typedef HAMapSearcher<int64_t, uint32_t> ssrch_t;
+
+    // few keys leave some shards empty
+    for( uint32_t count : { 3, 100000 } )
+    {
+        for( size_t nshards : { 1, 8 } )
+        {
+            check_sharded<idx_t, srch_t, uint64_t, uint32_t>(count, nshards);
+            check_sharded<cidx_t, csrch_t, uint64_t, uint32_t>(count, nshards);
+            check_sharded<cidx_t, dsrch_t, uint64_t, uint32_t>(count, nshards);
+            check_sharded<fidx_t, fsrch_t, uint32_t, float>(count, nshards);
+            // about half of keys are negative
+            check_sharded<sidx_t, ssrch_t, int64_t, uint32_t>(count, nshards);
+        }
+    }
+
+    // negative keys are routed to upper shards
+    EXPECT_EQ(3u, detail::get_shard_index<int64_t>(-5, 2));
+    EXPECT_EQ(0u, detail::get_shard_index<int64_t>(INT64_MAX, 1));
+    EXPECT_EQ(7u, detail::get_shard_index<int32_t>(-1, 3));
+
+    EXPECT_THROW((ShardedIndexer<idx_t, uint64_t, uint32_t>(3)), std::runtime_error);
+    EXPECT_THROW((ShardedSearcher<srch_t, uint64_t>("test_no_such", 4).search(1)), std::runtime_error);
+}
+
+template<typename Indexer, typename Merger, typename Searcher, typename K, typename V>
+static void check_merge( std::vector<uint32_t> const &counts, size_t page_size )
+{
+    // input i holds keys [0, counts[i]) with step i + 1, so inputs overlap
+    std::vector<std::string> paths;
+    std::map<K, V> expected;
+    for( uint32_t i = 0; i < counts.size(); ++i )
+    {
+        Indexer idx;
+        for( uint32_t j = 0; j < counts[i]; ++j )
+        {
+            K const k = K(j * (i + 1) * 0x9E3779B97F4A7C15ULL);
+            idx.add(k, V(i * 1000000 + j));
+            expected[k] = V(i * 1000000 + j);
+        }
+        paths.push_back("test_merge.map." + std::to_string(i));
+        idx.store(paths.back(), page_size);
+    }
+
+    Merger mrg(paths);
+    size_t const size = mrg.get_compacted_size(page_size);
+    mrg.store("test_merge.map", page_size);
+    EXPECT_EQ(size, read_file("test_merge.map").size());
+
+    Searcher srch("test_merge.map");
+    EXPECT_EQ(expected.size(), srch.size());
+    for( auto const &kv : expected )
+    {
+        auto const v = srch.search(kv.first);
+        ASSERT_TRUE(v);
+        EXPECT_EQ(kv.second, *v);
+        EXPECT_FALSE(srch.search(kv.first + 1));
+    }
+
+    for( auto const &path : paths )
+        std::remove(path.c_str());
+    std::remove("test_merge.map");
+}
+
+TEST(MergeMaps, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapMerger<uint64_t, uint32_t> mrg_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapMerger<uint64_t, uint32_t> cmrg_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef EHCMapIndexer<uint32_t, float> fidx_t;
+    typedef HACMapMerger<uint32_t, float> fmrg_t;
+    typedef HACMapSearcher<uint32_t, float> fsrch_t;
+
+    // inputs have more and less buckets than output
+    for( auto const &counts : std::vector<std::vector<uint32_t>>{ { 1 }, { 100000, 10, 0, 50000 }, { 10, 100000 } } )
+    {
+        for( size_t page_size : { 256, DEFAULT_PAGE_SIZE } )
+        {
+            check_merge<idx_t, mrg_t, srch_t, uint64_t, uint32_t>(counts, page_size);
+            check_merge<cidx_t, cmrg_t, csrch_t, uint64_t, uint32_t>(counts, page_size);
+            check_merge<fidx_t, fmrg_t, fsrch_t, uint32_t, float>(counts, page_size);
+        }
+    }
+
+    // duplicates of multimap input are kept, older values of a key are dropped
+    cidx_t old_idx, new_idx;
+    new_idx.set_multimap(true);
+    old_idx.add(1, 1);
+    old_idx.add(2, 2);
+    new_idx.add(2, 20);
+    new_idx.add(2, 21);
+    old_idx.store("test_merge.map.0");
+    new_idx.store("test_merge.map.1");
+    cmrg_t mrg({ "test_merge.map.0", "test_merge.map.1" });
+    mrg.store("test_merge.map");
+    csrch_t srch("test_merge.map");
+    EXPECT_TRUE(srch.is_multimap());
+    EXPECT_EQ(std::vector<uint32_t>({ 1 }), range_values(srch.equal_range(1)));
+    EXPECT_EQ(std::vector<uint32_t>({ 20, 21 }), range_values(srch.equal_range(2)));
+    std::remove("test_merge.map.0");
+    std::remove("test_merge.map.1");
+    std::remove("test_merge.map");
+}
+
+TEST(DeltaTable, TestIsTrue)
+{
+    detail::DeltaTable<uint64_t, uint32_t> t(100);
+    EXPECT_LE(100u, t.capacity() * DELTA_MAX_LOAD_PERCENT / 100);
+    for( uint32_t i = 0; i < 100; ++i )
+        EXPECT_TRUE(t.put(i, i));
+    EXPECT_TRUE(t.put(5, 50));
+    EXPECT_EQ(100u, t.size());
+    for( uint32_t i = 0; i < 100; ++i )
+        EXPECT_EQ(5 == i ? 50 : i, *t.get(i));
+    EXPECT_FALSE(t.get(100));
+
+    // fill up to load limit
+    uint32_t n = 100;
+    for( ; t.put(n, n); ++n );
+    EXPECT_EQ(t.capacity() * DELTA_MAX_LOAD_PERCENT / 100, n);
+    EXPECT_TRUE(t.put(0, 1));
+    size_t cnt = 0;
+    t.for_each([&cnt]( uint64_t, uint32_t ) { ++cnt; });
+    EXPECT_EQ(n, cnt);
+}
+
+template<typename Indexer, typename Overlay, typename Searcher, typename K, typename V>
+static void check_overlay( uint32_t count, size_t threshold )
+{
+    std::string const path = "test_overlay.map";
+    Indexer idx;
+    for( uint32_t i = 0; i < count; ++i )
+        idx.add(K(i * 0x9E3779B97F4A7C15ULL), V(i));
+    idx.store(path);
+
+    Overlay ovl(path, threshold);
+    // base keys stay visible while puts and rebuilds run
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> nmissed(0);
+    std::thread reader([&]() {
+        while( !stop )
+        {
+            for( uint32_t i = 0; i < count; i += 7 )
+                nmissed += !ovl.search(K(i * 0x9E3779B97F4A7C15ULL));
+        }
+    });
+
+    // update every odd key, add count new ones
+    for( uint32_t i = 1; i < count; i += 2 )
+        ovl.put(K(i * 0x9E3779B97F4A7C15ULL), V(i + 1));
+    for( uint32_t i = count; i < count * 2; ++i )
+        ovl.put(K(i * 0x9E3779B97F4A7C15ULL), V(i));
+
+    auto check = [count]( auto const &srch ) {
+        for( uint32_t i = 0; i < count * 2; ++i )
+        {
+            auto const v = srch.search(K(i * 0x9E3779B97F4A7C15ULL));
+            ASSERT_TRUE(v) << i;
+            EXPECT_EQ(V(i < count && (i & 1) ? i + 1 : i), *v);
+        }
+        EXPECT_FALSE(srch.search(K(1)));
+    };
+    check(ovl);
+    ovl.flush();
+    stop = true;
+    reader.join();
+    EXPECT_EQ(0u, nmissed);
+    EXPECT_EQ(0u, ovl.get_delta_size());
+    check(ovl);
+
+    Searcher srch(path);
+    EXPECT_EQ(count * 2, srch.size());
+    check(srch);
+    std::remove(path.c_str());
+}
+
+template<typename Overlay, typename Searcher, typename Indexer>
+static void check_overlay_params( Indexer &idx, uint32_t count, uint32_t filter_bits )
+{
+    std::string const path = "test_overlay.map";
+    idx.store(path);
+    FooterExt ext;
+    {
+        Searcher srch(path);
+        ext = srch.get_footer_ext();
+        EXPECT_TRUE(ext.flags & FOOTER_FLAG_BUCKET_FILTER);
+        EXPECT_EQ(filter_bits, detail::BucketIndex::get_filter_params(ext).get_bits_per_key(count, srch.get_nbuckets()));
+    }
+    {
+        Overlay ovl(path, count / 4);
+        for( uint32_t i = count; i < count * 2; ++i )
+            ovl.put(i * 0x9E3779B97F4A7C15ULL, i);
+        ovl.flush();
+    }
+
+    Searcher srch(path);
+    EXPECT_EQ(count * 2, srch.size());
+    FooterExt const new_ext = srch.get_footer_ext();
+    EXPECT_EQ(ext.flags, new_ext.flags);
+    // filter grows with records, bits per key are kept
+    EXPECT_EQ(ext.filter_probes, new_ext.filter_probes);
+    EXPECT_EQ(filter_bits, detail::BucketIndex::get_filter_params(new_ext).get_bits_per_key(count * 2, srch.get_nbuckets()));
+    for( uint32_t i = 0; i < count * 2; ++i )
+        ASSERT_TRUE(srch.search(i * 0x9E3779B97F4A7C15ULL));
+    std::remove(path.c_str());
+}
+
+TEST(DeltaOverlay, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapOverlay<uint64_t, uint32_t> ovl_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapOverlay<uint64_t, uint32_t> covl_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+
+    // rebuild after every put, after few thousands and no rebuild until flush
+    for( auto const &p : std::vector<std::pair<uint32_t, size_t>>{ { 100, 1 }, { 20000, 4000 }, { 20000, 100000 } } )
+    {
+        check_overlay<idx_t, ovl_t, srch_t, uint64_t, uint32_t>(p.first, p.second);
+        check_overlay<cidx_t, covl_t, csrch_t, uint64_t, uint32_t>(p.first, p.second);
+    }
+
+    EXPECT_THROW(ovl_t("test_no_such"), std::runtime_error);
+
+    // rebuilds keep build settings of the map
+    idx_t idx;
+    idx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+    idx.set_directory_format(DIRECTORY_FORMAT_ELIAS_FANO);
+    idx.set_filter_bits(6);
+    cidx_t cidx;
+    cidx.set_value_packing(false);
+    cidx.set_filter_bits(10);
+    for( uint32_t i = 0; i < 10000; ++i )
+    {
+        idx.add(i * 0x9E3779B97F4A7C15ULL, i);
+        cidx.add(i * 0x9E3779B97F4A7C15ULL, i);
+    }
+    check_overlay_params<ovl_t, srch_t>(idx, 10000, 6);
+    check_overlay_params<covl_t, csrch_t>(cidx, 10000, 10);
+}
+
+template<typename Indexer, typename Searcher, typename Merger, typename K, typename V>
+static void check_tombstones( Indexer &idx, uint32_t count )
+{
+    std::string const path = "test_tombstone.map";
+    std::vector<K> keys;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        keys.push_back(K(i * 0x9E3779B97F4A7C15ULL));
+        idx.add(keys.back(), V(i));
+    }
+    idx.store(path);
+
+    {
+        TombstoneSearcher<Searcher, K> srch(path);
+        EXPECT_EQ(count, srch.size());
+        // delete every third key
+        for( uint32_t i = 0; i < count; i += 3 )
+            EXPECT_EQ(1u, srch.erase(keys[i]));
+        EXPECT_EQ(0u, srch.erase(keys[0]));
+        EXPECT_EQ(0u, srch.erase(K(1)));
+        EXPECT_EQ((count + 2) / 3, srch.get_deleted_count());
+        srch.save();
+    }
+
+    TombstoneSearcher<Searcher, K> srch(path);
+    EXPECT_EQ(count - (count + 2) / 3, srch.size());
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        auto const v = srch.search(keys[i]);
+        EXPECT_EQ(i % 3 != 0, bool(v)) << i;
+        if( v )
+        {
+            EXPECT_EQ(V(i), *v);
+        }
+    }
+    std::vector<decltype(srch.search(0))> out(keys.size());
+    EXPECT_EQ(srch.size(), srch.search_batch(keys.data(), keys.size(), out.data()));
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        EXPECT_EQ(i % 3 != 0, bool(out[i])) << i;
+        if( out[i] )
+        {
+            EXPECT_EQ(V(i), *out[i]);
+        }
+    }
+    EXPECT_FALSE(srch.search(K(1)));
+
+    // compaction drops deleted records
+    Merger({ path }).store(path + ".compact");
+    Searcher csrch(path + ".compact");
+    EXPECT_EQ(srch.size(), csrch.size());
+    for( uint32_t i = 0; i < count; ++i )
+        EXPECT_EQ(i % 3 != 0, bool(csrch.search(keys[i]))) << i;
+
+    std::remove(path.c_str());
+    std::remove(srch.get_bitmap_path().c_str());
+    std::remove((path + ".compact").c_str());
+}
+
+TEST(Tombstones, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef HAMapMerger<uint64_t, uint32_t> mrg_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef HACMapMerger<uint64_t, uint32_t> cmrg_t;
+
+    for( uint32_t count : { 1, 100, 100000 } )
+    {
+        idx_t idx;
+        check_tombstones<idx_t, srch_t, mrg_t, uint64_t, uint32_t>(idx, count);
+        idx_t eidx;
+        eidx.set_layout(BUCKET_LAYOUT_EYTZINGER);
+        check_tombstones<idx_t, srch_t, mrg_t, uint64_t, uint32_t>(eidx, count);
+        cidx_t cidx;
+        check_tombstones<cidx_t, csrch_t, cmrg_t, uint64_t, uint32_t>(cidx, count);
+    }
+
+    // key deleted in newer input is dropped from older ones by merge
+    cidx_t old_idx, new_idx;
+    old_idx.add(1, 1);
+    old_idx.add(2, 2);
+    new_idx.add(2, 20);
+    old_idx.store("test_tombstone.map.0");
+    new_idx.store("test_tombstone.map.1");
+    {
+        HACMapTombstoneSearcher<uint64_t, uint32_t> srch("test_tombstone.map.1");
+        srch.erase(2);
+        srch.save();
+    }
+    cmrg_t({ "test_tombstone.map.0", "test_tombstone.map.1" }).store("test_tombstone.map");
+    csrch_t srch("test_tombstone.map");
+    EXPECT_EQ(1u, srch.size());
+    EXPECT_TRUE(srch.search(1));
+    EXPECT_FALSE(srch.search(2));
+
+    // bitmap of other map is rejected
+    std::rename("test_tombstone.map.1.del", "test_tombstone.map.0.del");
+    EXPECT_THROW((HACMapTombstoneSearcher<uint64_t, uint32_t>("test_tombstone.map.0")), std::runtime_error);
+    for( char const *p : { "test_tombstone.map", "test_tombstone.map.0", "test_tombstone.map.1", "test_tombstone.map.0.del" } )
+        std::remove(p);
+}
+
+TEST(BucketFilterRate, TestIsTrue)
+{
+    size_t const nbuckets = 64, count = 100000;
+    for( uint32_t bits : { 4, 6, 10 } )
+    {
+        detail::BucketFilterParams const params = detail::BucketFilterParams::mk(count, nbuckets, bits);
+        EXPECT_NEAR(double(bits), params.get_size(nbuckets) * 8.0 / count, 1.0);
+        detail::BucketFilterWriter wr(nbuckets, params);
+        for( uint64_t i = 0; i < count; ++i )
+            wr.add(i * 0x9E3779B97F4A7C15ULL);
+        std::vector<uint8_t> buf;
+        utils::OStreamProxy os(buf);
+        wr.write(os);
+        ASSERT_EQ(params.get_size(nbuckets), buf.size());
+
+        detail::BucketFilter const filter(buf.data(), params);
+        size_t npassed = 0;
+        for( uint64_t i = 0; i < count; ++i )
+        {
+            uint64_t const k = i * 0x9E3779B97F4A7C15ULL;
+            ASSERT_TRUE(filter.may_contain(k & (nbuckets - 1), k));
+            npassed += filter.may_contain((k + 1) & (nbuckets - 1), k + 1);
+        }
+        // most of misses are rejected: about 16%, 8% and 2% pass
+        EXPECT_LT(npassed, count / (4 == bits ? 5 : 6 == bits ? 10 : 30)) << bits;
+    }
+}
+
+template<typename Indexer, typename Searcher, typename DiskSearcher, typename K, typename V>
+static void check_bucket_filter( uint32_t count, size_t page_size )
+{
+    std::string const path = "test_filter.map";
+    std::vector<K> keys;
+    Indexer plain;
+    Indexer idx;
+    idx.set_filter_bits(8);
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        K const k = K(i * 0x9E3779B97F4A7C15ULL);
+        plain.add(k, V(i));
+        idx.add(k, V(i));
+        keys.push_back(k);
+        keys.push_back(k + 1);
+    }
+    size_t const plain_size = plain.get_compacted_size(page_size);
+    size_t const size = idx.get_compacted_size(page_size);
+    EXPECT_LE(plain_size + count, size);
+    idx.store(path, page_size);
+    EXPECT_EQ(size, read_file(path).size());
+
+    Searcher msrch(path);
+    DiskSearcher dsrch(path);
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        for( auto const &v : { detail::to_optional(msrch.search(keys[i * 2])), dsrch.search(keys[i * 2]) } )
+        {
+            ASSERT_TRUE(v);
+            EXPECT_EQ(V(i), *v);
+        }
+        EXPECT_FALSE(msrch.search(keys[i * 2 + 1]));
+        EXPECT_FALSE(dsrch.search(keys[i * 2 + 1]));
+    }
+    check_batch(msrch, keys);
+    std::vector<std::optional<V>> out(keys.size());
+    EXPECT_EQ(count, dsrch.search_batch(keys.data(), keys.size(), out.data()));
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        EXPECT_TRUE(out[i * 2]);
+        EXPECT_FALSE(out[i * 2 + 1]);
+    }
+    std::remove(path.c_str());
+}
+
+TEST(BucketFilter, TestIsTrue)
+{
+    typedef HAMapIndexer<uint64_t, uint32_t> idx_t;
+    typedef HAMapSearcher<uint64_t, uint32_t> srch_t;
+    typedef HAMapDiskSearcher<uint64_t, uint32_t> dsrch_t;
+    typedef EHCMapIndexer<uint64_t, uint32_t> cidx_t;
+    typedef HACMapSearcher<uint64_t, uint32_t> csrch_t;
+    typedef HACMapDiskSearcher<uint64_t, uint32_t> cdsrch_t;
+    typedef EHCMapIndexer<uint32_t, float> fidx_t;
+    typedef HACMapSearcher<uint32_t, float> fsrch_t;
+    typedef HACMapDiskSearcher<uint32_t, float> fdsrch_t;
+
+    for( uint32_t count : { 1, 1000, 100000 } )
+    {
+        for( size_t page_size : { 256, DEFAULT_PAGE_SIZE } )
+        {
+            check_bucket_filter<idx_t, srch_t, dsrch_t, uint64_t, uint32_t>(count, page_size);
+            check_bucket_filter<cidx_t, csrch_t, cdsrch_t, uint64_t, uint32_t>(count, page_size);
+            check_bucket_filter<fidx_t, fsrch_t, fdsrch_t, uint32_t, float>(count, page_size);
+        }
+    }
+
+    // filter of spilled and merged maps
+    cidx_t sidx;
+    sidx.set_filter_bits(6);
+    sidx.set_memory_budget(64 << 10);
+    for( uint32_t i = 0; i < 100000; ++i )
+        sidx.add(i * 7, i);
+    sidx.store("test_filter.map");
+    HACMapMerger<uint64_t, uint32_t> mrg({ "test_filter.map" });
+    mrg.indexer().set_filter_bits(6);
+    mrg.store("test_filter.map.merged");
+    for( char const *path : { "test_filter.map", "test_filter.map.merged" } )
+    {
+        csrch_t srch(path);
+        EXPECT_TRUE(srch.get_mem_size() > 0);
+        for( uint32_t i = 0; i < 100000; ++i )
+        {
+            auto const v = srch.search(i * 7);
+            ASSERT_TRUE(v);
+            EXPECT_EQ(i, *v);
+            EXPECT_EQ(1u, srch.equal_range(i * 7).size());
+            EXPECT_FALSE(srch.search(i * 7 + 1));
+        }
+        std::remove(path);
+    }
+}
+
+template<typename K, typename V>
+static void check_bucket_key_bits( uint32_t count, size_t page_size, K big_key, bool multimap )
+{
+    typedef EHCMapIndexer<K, V> idx_t;
+    typedef HACMapSearcher<K, V> srch_t;
+
+    // dense keys and a single big one, which makes global key width large
+    std::vector<std::pair<K, V>> records;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        records.emplace_back(K(i * 3 + 5), V(i));
+        if( multimap && 0 == i % 7 )
+            records.emplace_back(K(i * 3 + 5), V(i + 1));
+    }
+    records.emplace_back(big_key, V(count));
+
+    idx_t global, idx;
+    global.set_bucket_key_bits(false);
+    for( idx_t *x : { &global, &idx } )
+    {
+        x->set_multimap(multimap);
+        for( auto const &r : records )
+            x->add(r.first, r.second);
+    }
+    size_t const global_size = global.get_compacted_size(page_size);
+    size_t const size = idx.get_compacted_size(page_size);
+    EXPECT_LE(size, global_size);
+    std::vector<uint8_t> const data = idx.get_compacted(page_size);
+    EXPECT_EQ(size, data.size());
+
+    std::string const path = "test_key_bits.map";
+    idx.store(path, page_size);
+    srch_t msrch(path);
+    HACMapDiskSearcher<K, V> dsrch(path);
+
+    std::vector<K> keys;
+    for( auto const &r : records )
+    {
+        keys.push_back(r.first);
+        keys.push_back(K(r.first + 1));
+    }
+    // keys below and above of stored ones
+    for( K k : { K(0), K(1), K(2), K(big_key - 1), K(big_key + 1) } )
+        keys.push_back(k);
+
+    for( SearchMode mode : { SEARCH_MODE_BINARY, SEARCH_MODE_INTERPOLATION } )
+    {
+        msrch.set_search_mode(mode);
+        for( auto const &r : records )
+        {
+            auto const v = msrch.search(r.first);
+            ASSERT_TRUE(v);
+            // first value of key in multimap mode
+            EXPECT_EQ(r.first == big_key ? V(count) : V((r.first - 5) / 3), *v);
+            EXPECT_EQ(v, dsrch.search(r.first));
+            EXPECT_FALSE(msrch.search(K(r.first + 1)));
+            EXPECT_EQ(size_t(multimap && r.first < big_key && 0 == (r.first - 5) / 3 % 7 ? 2 : 1),
+                      msrch.equal_range(r.first).size());
+        }
+        for( K k : { K(0), K(1), K(2), K(big_key - 1), K(big_key + 1) } )
+        {
+            EXPECT_FALSE(msrch.search(k));
+            EXPECT_TRUE(msrch.equal_range(k).empty());
+        }
+        check_batch(msrch, keys);
+    }
+
+    // merge decodes buckets and writes them back with the same widths
+    HACMapMerger<K, V> mrg({ path });
+    mrg.indexer().set_multimap(multimap);
+    std::vector<uint8_t> merged;
+    utils::OStreamProxy os(merged);
+    mrg.compact_and_store(os, page_size);
+    EXPECT_EQ(data, merged);
+    std::remove(path.c_str());
+}
+
+TEST(BucketKeyBits, TestIsTrue)
+{
+    for( uint32_t count : { 1, 1000, 100000 } )
+    {
+        for( size_t page_size : { 256, DEFAULT_PAGE_SIZE } )
+        {
+            for( bool multimap : { false, true } )
+            {
+                check_bucket_key_bits<uint64_t, uint32_t>(count, page_size, 1ULL << 50, multimap);
+                check_bucket_key_bits<uint64_t, uint64_t>(count, page_size, ~0ULL - 2, multimap);
+                check_bucket_key_bits<uint32_t, float>(count, page_size, 1u << 31, multimap);
+            }
+        }
+    }
+
+    // dense keys take less space with per-bucket width
+    EHCMapIndexer<uint64_t, uint32_t> global, idx;
+    global.set_bucket_key_bits(false);
+    for( uint32_t i = 0; i < 100000; ++i )
+    {
+        global.add(i * 3 + 5, i);
+        idx.add(i * 3 + 5, i);
+    }
+    global.add(1ULL << 50, 0);
+    idx.add(1ULL << 50, 0);
+    EXPECT_LT(idx.get_compacted_size() * 4, global.get_compacted_size() * 3);
+
+    // spilled build gives the same map
+    EHCMapIndexer<uint64_t, uint32_t> sidx;
+    sidx.set_memory_budget(64 << 10);
+    for( uint32_t i = 0; i < 100000; ++i )
+        sidx.add(i * 3 + 5, i);
+    sidx.add(1ULL << 50, 0);
+    EXPECT_EQ(idx.get_compacted(), sidx.get_compacted());
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "hamap.hpp"
+#include "hacmap.hpp"
+#include <string>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+
+// deletion bitmap of map file <path> is stored in sidecar file <path>.del
+char const * const DELETION_BITMAP_SUFFIX = ".del";
+
+namespace detail {
+
+/* Bit per record of map file by its global position: records are counted
+ * bucket by bucket in directory order. Bits are set atomically, so deletes
+ * are published to concurrent searches without locks.
+ * Sidecar file holds bitmap words followed by uint64 records count.
+ */
+class DeletionBitmap
+{
+public:
+    explicit DeletionBitmap( size_t nrecords )
+        : nrecords_(nrecords)
+        , nwords_((nrecords + 63) / 64)
+        , words_(new std::atomic<uint64_t>[nwords_])
+        , ndeleted_(0)
+    {
+        for( size_t i = 0; i < nwords_; ++i )
+            words_[i].store(0, std::memory_order_relaxed);
+    }
+
+    size_t size() const { return nrecords_; }
+    size_t count() const { return ndeleted_.load(std::memory_order_relaxed); }
+
+    bool test( size_t pos ) const
+    {
+        return (words_[pos >> 6].load(std::memory_order_relaxed) >> (pos & 63)) & 1;
+    }
+
+    // return true if record was not deleted before
+    bool set( size_t pos )
+    {
+        uint64_t const bit = uint64_t(1) << (pos & 63);
+        if( words_[pos >> 6].fetch_or(bit, std::memory_order_relaxed) & bit )
+            return false;
+        ++ndeleted_;
+        return true;
+    }
+
+    // read sidecar file if it exists, return false if it does not
+    bool load( std::string const &path )
+    {
+        std::ifstream is(path, std::ios::binary);
+        if( !is )
+            return false;
+
+        utils::MemoryReader rdr(is);
+        uint64_t nrecords = 0;
+        if( rdr.size() == nwords_ * sizeof(uint64_t) + sizeof(nrecords) )
+        {
+            rdr.seek(nwords_ * sizeof(uint64_t));
+            rdr >> nrecords;
+        }
+        if( nrecords != nrecords_ )
+            throw std::runtime_error("[DeletionBitmap] bitmap does not match map: " + path);
+
+        rdr.seek(0);
+        size_t ndeleted = 0;
+        for( size_t i = 0; i < nwords_; ++i )
+        {
+            uint64_t w;
+            rdr >> w;
+            words_[i].store(w, std::memory_order_relaxed);
+            ndeleted += __builtin_popcountll(w);
+        }
+        ndeleted_ = ndeleted;
+        return true;
+    }
+
+    // write sidecar file, it is replaced by rename, so readers see whole one
+    void save( std::string const &path ) const
+    {
+        std::string const tmp_path = path + ".tmp";
+        {
+            utils::OStreamProxy os(tmp_path, utils::FILE_SINK_PWRITE);
+            os.write_range(words_.get(), words_.get() + nwords_, []( std::atomic<uint64_t> const &w ) {
+                return w.load(std::memory_order_relaxed);
+            });
+            os << uint64_t(nrecords_);
+            os.close();
+        }
+        if( 0 != std::rename(tmp_path.c_str(), path.c_str()) )
+            throw std::runtime_error("[DeletionBitmap] unable to replace file " + path);
+    }
+
+private:
+    size_t const                                nrecords_;
+    size_t const                                nwords_;
+    std::unique_ptr<std::atomic<uint64_t>[]>    words_;
+    std::atomic<size_t>                         ndeleted_;
+};
+
+// global position of the first record of each bucket, last item is records count
+template<typename Searcher>
+inline std::vector<uint64_t> get_bucket_starts( Searcher const &srch )
+{
+    std::vector<uint64_t> starts(srch.get_nbuckets() + 1, 0);
+    for( size_t i = 0; i < srch.get_nbuckets(); ++i )
+        starts[i + 1] = starts[i] + srch.get_bucket_size(i);
+    return starts;
+}
+
+} // namespace detail
+
+/* Searcher of map file with deletions: erase() marks records in deletion
+ * bitmap, save() stores it into sidecar file, which is loaded along with
+ * the map. Bitmap is checked only if anything is deleted: search locates
+ * position of the record once, tests its bit and only then reads the value.
+ * Deleted records are dropped when the map is rewritten by MapMerger
+ * (see mergemap.hpp), a single input merge is a compaction. Searcher is HAMapSearcher or HACMapSearcher.
+ */
+template<typename Searcher, typename Key>
+class TombstoneSearcher
+{
+public:
+    explicit TombstoneSearcher( std::string const &path )
+        : path_(path)
+        , srch_(path)
+        , starts_(detail::get_bucket_starts(srch_))
+        , mask_(srch_.get_nbuckets() - 1)
+        , deleted_(starts_.back())
+    {
+        deleted_.load(get_bitmap_path());
+    }
+
+    std::string get_bitmap_path() const { return path_ + DELETION_BITMAP_SUFFIX; }
+    Searcher const& get_searcher() const { return srch_; }
+
+    // result of searcher, not found if record is deleted
+    auto search( Key k ) const
+    {
+        typedef decltype(srch_.search(k)) result_t;
+        if( !deleted_.count() )
+            return srch_.search(k);
+
+        // in multimap mode the first record of key decides
+        auto const pos = srch_.locate(k);
+        if( !pos || deleted_.test(starts_[k & mask_] + *pos) )
+            return result_t();
+        return result_t(srch_.get_value_at(k & mask_, *pos));
+    }
+
+    // batched lookup of searcher, deleted records are not found
+    template<typename Out>
+    size_t search_batch( Key const *keys, size_t n, Out *out_values ) const
+    {
+        if( !deleted_.count() )
+            return srch_.search_batch(keys, n, out_values);
+
+        std::vector<std::optional<uint32_t>> positions(n);
+        srch_.locate_batch(keys, n, positions.data());
+        size_t nfound = 0;
+        for( size_t i = 0; i < n; ++i )
+        {
+            auto const &pos = positions[i];
+            if( pos && !deleted_.test(starts_[keys[i] & mask_] + *pos) )
+            {
+                out_values[i] = Out(srch_.get_value_at(keys[i] & mask_, *pos));
+                ++nfound;
+            }
+            else
+                out_values[i] = Out();
+        }
+        return nfound;
+    }
+
+    // mark all records of key k deleted, return number of newly deleted
+    size_t erase( Key k )
+    {
+        auto const r = srch_.locate_range(k);
+        uint64_t const start = starts_[k & mask_];
+        size_t n = 0;
+        for( uint32_t i = r.first; i < r.second; ++i )
+            n += deleted_.set(start + i);
+        return n;
+    }
+
+    // store deletion bitmap into sidecar file
+    void save() const { deleted_.save(get_bitmap_path()); }
+
+    // return number of not deleted records
+    size_t size() const { return deleted_.size() - deleted_.count(); }
+    size_t get_deleted_count() const { return deleted_.count(); }
+
+private:
+    std::string const           path_;
+    Searcher const              srch_;
+    std::vector<uint64_t> const starts_;
+    Key const                   mask_;
+    detail::DeletionBitmap      deleted_;
+};
+
+template<typename Key, typename Value>
+using HAMapTombstoneSearcher = TombstoneSearcher<HAMapSearcher<Key, Value>, Key>;
+
+template<typename Key, typename Value>
+using HACMapTombstoneSearcher = TombstoneSearcher<HACMapSearcher<Key, Value>, Key>;
@@ -1,8 +1,13 @@
 #pragma once
 
 #include "memory.hpp"
+#include "eliasfano.hpp"
+#include "bucketfilter.hpp"
 #include <stdint.h>
+#include <cassert>
 #include <iostream>
+#include <algorithm>
+#include <thread>
 #include <type_traits>
 
 #define DEFAULT_PAGE_SIZE 4096
@@ -30,6 +35,13 @@ inline uint32_t maxbits(unsigned long long int const v)
 
 int const MAX_OFFSET_BITS = 43; 
 int const MAX_KEYS_IN_BUCKET = 21; 
+// number of keys processed together by search_batch stages
+int const SEARCH_BATCH_GROUP = 16;
+// buckets up to this size are sorted by insertion sort instead of radix one
+int const RADIX_SORT_MIN_RECORDS = 32;
+// parallel build flushes buckets by waves, each thread encodes
+// 1/PARALLEL_FLUSH_WAVES of its share per wave(bounds extra memory)
+int const PARALLEL_FLUSH_WAVES = 16;
 
 struct BucketEntry
 {
@@ -39,13 +51,82 @@ struct BucketEntry
 
 struct BucketEntryTiny
 {
-    uint32_t    offset : 23; // up 64GB of storage size, if each buket is aligned to 8 bytes
-    uint32_t    nkets  : 9; // max 512 records per bucket only!
+    uint32_t    offset : 23; // in 8 bytes units, up to 64MB of storage size, each bucket is aligned to 8 bytes
+    uint32_t    nkeys  : 9; // max 511 records per bucket only!
 };
 
+uint32_t const TINY_DIR_MAX_KEYS    = (1U << 9) - 1;
+uint32_t const TINY_DIR_MAX_OFFSET  = (1U << 23) - 1;
+uint32_t const TINY_DIR_ALIGN       = 8;
+
 static_assert( sizeof(BucketEntry) == 8, "BucketEntry must fit into 8 bytes!" );
 static_assert( sizeof(BucketEntryTiny) == 4, "BucketEntry must fit into 4 bytes!" );
 
+// order of the keys inside of each bucket
+enum BucketLayout
+{
+    BUCKET_LAYOUT_SORTED        = 0, // plain sorted array
+    BUCKET_LAYOUT_EYTZINGER     = 1, // implicit BFS ordered search tree
+};
+
+// directory entries format, selected by indexer
+enum DirectoryFormat
+{
+    DIRECTORY_FORMAT_AUTO       = 0, // tiny one if limits allow
+    DIRECTORY_FORMAT_WIDE       = 1, // BucketEntry
+    DIRECTORY_FORMAT_TINY       = 2, // BucketEntryTiny, buckets are aligned to 8 bytes
+    DIRECTORY_FORMAT_ELIAS_FANO = 3, // succinct offsets + records counts, see eliasfano.hpp
+};
+
+// in-bucket search algorithm, selected by searcher at runtime
+enum SearchMode
+{
+    SEARCH_MODE_BINARY          = 0, // SIMD or binary search
+    SEARCH_MODE_INTERPOLATION   = 1, // predict position, then gallop around it
+};
+
+enum FooterFlags
+{
+    FOOTER_FLAG_EYTZINGER       = 0x1,
+    FOOTER_FLAG_PACKED_VALUES   = 0x2, // per bucket base + value_bits width deltas
+    FOOTER_FLAG_TINY_DIRECTORY  = 0x4, // directory of BucketEntryTiny
+    FOOTER_FLAG_EF_DIRECTORY    = 0x8, // Elias-Fano directory, dir_* fields are set
+    FOOTER_FLAG_MULTIMAP        = 0x10, // duplicate keys are expected, buckets are sorted
+    FOOTER_FLAG_BUCKET_FILTER   = 0x20, // per-bucket filter before footer, filter_* fields are set
+    FOOTER_FLAG_BUCKET_KEY_BITS = 0x40, // compressed bucket starts with word of its keys base and width
+};
+
+/* per-bucket key width: bucket starts with uint64 (base << BUCKET_KEY_BITS_WIDTH) | bits,
+ * reduced keys are stored as (key - base) by bits, so base takes at most 58 bits
+ */
+uint32_t const BUCKET_KEY_BITS_WIDTH = 6;
+uint32_t const BUCKET_KEY_BASE_MAX_BITS = 64 - BUCKET_KEY_BITS_WIDTH;
+
+/* Footer is stored at the end of the stream(read backward):
+ * [FooterExt][uint16 ext size][key_bits_store][nbuckets_p2 | bits]
+ * last byte higher bit signals that key_bits_store byte is present,
+ * next bit signals that extension is present too.
+ * FooterExt is written only if some format feature is enabled,
+ * new fields must be appended at the end of it.
+ */
+uint8_t const FOOTER_HAS_KEY_BITS   = 0x80;
+uint8_t const FOOTER_HAS_EXT        = 0x40;
+
+struct FooterExt
+{
+    uint32_t    flags;
+    uint8_t     value_bits;     // width of packed values
+    uint8_t     dir_low_bits;   // Elias-Fano directory params
+    uint8_t     dir_nkeys_bits;
+    uint8_t     reserved;
+    uint64_t    dir_upper_words;
+    uint32_t    filter_words;   // per-bucket filter params
+    uint8_t     filter_probes;
+    uint8_t     reserved2[3];
+};
+
+static_assert( sizeof(FooterExt) == 24, "FooterExt must not have implicit padding!" );
+
 namespace detail {
 
 template<typename Key, typename Value>
@@ -67,11 +148,587 @@ inline uint32_t calc_buckets_count( size_t kv_sz_total, size_t const page_size )
     return 0;
 }
 
-class BucketIndex
+/* Interpolation search over sorted unique keys:
+ * keys are hashes or dense IDs, so inside of a bucket they are close
+ * to uniformly distributed between first and last key. Predict position
+ * by linear interpolation, then gallop from it in search direction
+ * and finish by binary search inside of found small range.
+ * Keys could be plain array or BitArrayAdapter.
+ * return position of found key or n if not found
+ */
+template<typename Key, typename Keys>
+inline uint32_t interpolation_locate( Key const k, Keys const &keys, uint32_t const n )
 {
+    if( 0 == n )
+        return n;
+
+    Key const lo = keys[0], hi = keys[n - 1];
+    if( k < lo || k > hi )
+        return n;
+    if( lo == hi )
+        return 0;
+
+    // use 128-bit product, 64-bit keys range * n could overflow
+    uint32_t const pos = uint32_t((unsigned __int128)(uint64_t(k) - uint64_t(lo)) * (n - 1) 
+                                  / (uint64_t(hi) - uint64_t(lo)));
+
+    Key const kpos = keys[pos];
+    if( kpos == k )
+        return pos;
+
+    // result range [l, u)
+    uint32_t l, u;
+    if( kpos < k )
+    {
+        // keys[l - 1] < k, look for u: keys[u] >= k
+        l = pos + 1;
+        u = l;
+        for( uint32_t step = 1; u < n && Key(keys[u]) < k; step <<= 1 )
+        {
+            l = u + 1;
+            u = std::min(n, u + step);
+        }
+        u = std::min(n, u + 1);
+    }
+    else
+    {
+        // keys[u] > k, look for l: keys[l] <= k
+        u = pos;
+        l = u;
+        for( uint32_t step = 1; l > 0 && Key(keys[l - 1]) > k; step <<= 1 )
+        {
+            u = l - 1;
+            l = l > step ? l - step : 0;
+        }
+        l = l > 0 ? l - 1 : 0;
+    }
+
+    while( l < u )
+    {
+        uint32_t i = (l + u) >> 1;
+        Key const kval = keys[i];
+        if( kval > k )
+            u = i;
+        else if( kval < k )
+            l = i + 1;
+        else
+            return i;
+    }
+
+    return n;
+}
+
+// view to the contiguous records of one bucket
+template<typename Record>
+struct RecordSpan
+{
+    Record  *first;
+    size_t   n;
+
+    Record* begin() const { return first; }
+    Record* end() const { return first + n; }
+    Record* data() const { return first; }
+    size_t size() const { return n; }
+    bool empty() const { return 0 == n; }
+    Record& front() const { return *first; }
+    Record& back() const { return first[n - 1]; }
+    Record& operator [] ( size_t i ) const { return first[i]; }
+};
+
+/* Per bucket records count, values and keys ranges(if tracked), enough
+ * to compute exact size of the compacted map before writing it.
+ */
+template<typename Value>
+class BucketStats
+{
+public:
+    BucketStats( size_t nbuckets = 0, bool track_values = false, bool track_keys = false )
+        : counts_(nbuckets, 0)
+        , track_values_(track_values)
+        , track_keys_(track_keys)
+    {
+        if( track_values_ )
+        {
+            vmin_.resize(nbuckets);
+            vmax_.resize(nbuckets);
+        }
+        if( track_keys_ )
+        {
+            kmin_.resize(nbuckets);
+            kmax_.resize(nbuckets);
+        }
+    }
+
+    size_t nbuckets() const { return counts_.size(); }
+    uint32_t bucket_size( size_t i ) const { return counts_[i]; }
+    Value get_vmin( size_t i ) const { return vmin_[i]; }
+    Value get_vmax( size_t i ) const { return vmax_[i]; }
+
+    // records count of all buckets
+    size_t size() const
+    {
+        size_t n = 0;
+        for( uint32_t c : counts_ )
+            n += c;
+        return n;
+    }
+
+    template<typename Key>
+    void add( size_t i, Key k, Value v )
+    {
+        if( track_values_ )
+        {
+            vmin_[i] = counts_[i] ? std::min(vmin_[i], v) : v;
+            vmax_[i] = counts_[i] ? std::max(vmax_[i], v) : v;
+        }
+        if( track_keys_ )
+        {
+            kmin_[i] = counts_[i] ? std::min(kmin_[i], uint64_t(k)) : uint64_t(k);
+            kmax_[i] = counts_[i] ? std::max(kmax_[i], uint64_t(k)) : uint64_t(k);
+        }
+        ++counts_[i];
+    }
+
+    template<typename Record>
+    void add( std::vector<Record> const &records )
+    {
+        if( counts_.empty() )
+            return;
+
+        size_t const hash_mask = counts_.size() - 1;
+        for( auto const &r : records )
+            add(r.first & hash_mask, r.first, r.second);
+    }
+
+    // bits required to store (reduced key - bucket minimal reduced key) of bucket i
+    uint32_t get_key_bits( size_t i, uint32_t key_rshift_by ) const
+    {
+        return counts_[i] ? utils::maxbits((kmax_[i] >> key_rshift_by) - (kmin_[i] >> key_rshift_by)) : 0;
+    }
+
+    // bits required to store (value - bucket minimal value) for all buckets
+    uint32_t get_value_bits() const
+    {
+        uint32_t bits = 0;
+        for( size_t i = 0; i < counts_.size(); ++i )
+        {
+            if( counts_[i] )
+                bits = std::max(bits, utils::maxbits(uint64_t(vmax_[i]) - uint64_t(vmin_[i])));
+        }
+        return bits;
+    }
+
 private:
-    static size_t read_nbuckets( utils::MemoryReader &rdr, uint32_t &key_bits_store )
+    std::vector<uint32_t>   counts_;
+    std::vector<Value>      vmin_;
+    std::vector<Value>      vmax_;
+    std::vector<uint64_t>   kmin_;
+    std::vector<uint64_t>   kmax_;
+    bool                    track_values_;
+    bool                    track_keys_;
+};
+
+/* Records partitioned by buckets in one contiguous array,
+ * bucket i occupies [starts[i], starts[i + 1]) range of records.
+ * Built by counting pass over (key & hash_mask) and one scatter pass,
+ * so there is no allocation per bucket.
+ */
+template<typename Record>
+class BucketPartition
+{
+public:
+    BucketPartition( std::vector<Record> const &src, size_t nbuckets )
+        : records_(src.size())
+        , starts_(nbuckets + 1, 0)
+    {
+        if( 0 == nbuckets )
+            return;
+
+        size_t const hash_mask = nbuckets - 1;
+        for( auto const &r : src )
+            ++starts_[(r.first & hash_mask) + 1];
+
+        for( size_t i = 1; i <= nbuckets; ++i )
+            starts_[i] += starts_[i - 1];
+
+        std::vector<size_t> pos(starts_.begin(), starts_.end() - 1);
+        for( auto const &r : src )
+            records_[pos[r.first & hash_mask]++] = r;
+    }
+
+    // adopt records already grouped by buckets, starts has nbuckets + 1 items
+    BucketPartition( std::vector<Record> &&records, std::vector<size_t> &&starts )
+        : records_(std::move(records))
+        , starts_(std::move(starts))
+    {}
+
+    size_t nbuckets() const { return starts_.size() - 1; }
+    size_t size() const { return records_.size(); }
+    size_t bucket_size( size_t i ) const { return starts_[i + 1] - starts_[i]; }
+    
+    RecordSpan<Record> bucket( size_t i )
+    {
+        return RecordSpan<Record>{ records_.data() + starts_[i], bucket_size(i) };
+    }
+private:
+    std::vector<Record>     records_;
+    std::vector<size_t>     starts_;
+};
+
+/* Group records by buckets in place(American flag permutation): every swap
+ * puts one record into its bucket, so no copy of records is made, order
+ * inside of bucket is not kept. Return bucket starts, nbuckets + 1 items.
+ */
+template<typename Record>
+inline std::vector<size_t> partition_in_place( std::vector<Record> &records, size_t nbuckets )
+{
+    std::vector<size_t> starts(nbuckets + 1, 0);
+    if( 0 == nbuckets )
+        return starts;
+
+    size_t const hash_mask = nbuckets - 1;
+    for( auto const &r : records )
+        ++starts[(r.first & hash_mask) + 1];
+
+    for( size_t i = 1; i <= nbuckets; ++i )
+        starts[i] += starts[i - 1];
+
+    std::vector<size_t> next(starts.begin(), starts.end() - 1);
+    for( size_t i = 0; i < nbuckets; ++i )
+    {
+        while( next[i] < starts[i + 1] )
+        {
+            Record &r = records[next[i]];
+            size_t const j = r.first & hash_mask;
+            if( j == i )
+                ++next[i];
+            else
+                std::swap(r, records[next[j]++]);
+        }
+    }
+    return starts;
+}
+
+/* Sort records of one bucket same way as std::sort of pairs does:
+ * all keys of bucket have equal lower key_shift bits(bucket index),
+ * so LSD radix sort by 8-bit digits runs only over higher key bits,
+ * digits equal for all keys are skipped. Tiny buckets use insertion sort.
+ * Radix sort is stable, so equal keys are ordered by values after all.
+ */
+template<typename Key, typename Value>
+inline void sort_bucket( std::pair<Key, Value> *b, size_t n, uint32_t key_shift )
+{
+    typedef std::pair<Key, Value> record_t;
+    typedef typename std::make_unsigned<Key>::type ukey_t;
+
+    if( n <= size_t(RADIX_SORT_MIN_RECORDS) )
+    {
+        for( size_t i = 1; i < n; ++i )
+        {
+            record_t r = b[i];
+            size_t j = i;
+            for( ; j > 0 && r < b[j - 1]; --j )
+                b[j] = b[j - 1];
+            b[j] = r;
+        }
+        return;
+    }
+
+    // flip sign bit, so signed keys are ordered as unsigned ones
+    ukey_t const sign_flip = std::is_signed<Key>::value ? ukey_t(ukey_t(1) << (sizeof(Key) * 8 - 1)) : 0;
+    auto reduced = [sign_flip, key_shift]( record_t const &r ) {
+        return uint64_t((ukey_t(r.first) ^ sign_flip) >> key_shift);
+    };
+
+    uint64_t kor = 0;
+    for( size_t i = 0; i < n; ++i )
+        kor |= reduced(b[i]);
+
+    static thread_local std::vector<record_t> scratch;
+    scratch.resize(n);
+    record_t *src = b, *dst = scratch.data();
+
+    uint32_t const nbits = utils::maxbits(kor);
+    for( uint32_t shift = 0; shift < nbits; shift += 8 )
+    {
+        size_t count[256] = {};
+        for( size_t i = 0; i < n; ++i )
+            ++count[(reduced(src[i]) >> shift) & 0xFF];
+
+        if( count[(reduced(src[0]) >> shift) & 0xFF] == n )
+            continue;
+
+        size_t offs = 0;
+        for( auto &c : count )
+        {
+            size_t const cnt = c;
+            c = offs;
+            offs += cnt;
+        }
+
+        for( size_t i = 0; i < n; ++i )
+            dst[count[(reduced(src[i]) >> shift) & 0xFF]++] = src[i];
+
+        std::swap(src, dst);
+    }
+
+    if( src != b )
+        std::copy(src, src + n, b);
+
+    // order runs of equal keys by values
+    for( size_t i = 0; i < n; )
     {
+        size_t j = i + 1;
+        while( j < n && b[j].first == b[i].first )
+            ++j;
+        if( j - i > 1 )
+            std::sort(b + i, b + j);
+        i = j;
+    }
+}
+
+/* Encode buckets by nthreads in parallel and write them in order:
+ * buckets are split into waves, in each wave every thread encodes
+ * contiguous block of buckets into own buffer, then buffers are
+ * written in order, so output is identical to serial one.
+ * encode( bucket_index, OStreamProxy& ) must be thread safe for different buckets.
+ */
+template<typename EncodeFunc>
+inline void flush_parallel( utils::OStreamProxy &os, size_t nbuckets, size_t nthreads, EncodeFunc encode )
+{
+    if( nthreads <= 1 )
+    {
+        for( size_t i = 0; i < nbuckets; ++i )
+            encode(i, os);
+        return;
+    }
+
+    size_t const block = std::max(size_t(1), nbuckets / (nthreads * PARALLEL_FLUSH_WAVES));
+    std::vector<std::vector<uint8_t>> buffers(nthreads);
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads);
+
+    for( size_t wave = 0; wave < nbuckets; wave += block * nthreads )
+    {
+        for( size_t t = 0; t < nthreads; ++t )
+        {
+            size_t const from = std::min(nbuckets, wave + t * block);
+            size_t const to = std::min(nbuckets, from + block);
+            threads.emplace_back([&buffers, &encode, t, from, to]() {
+                utils::OStreamProxy tos(buffers[t]);
+                for( size_t i = from; i < to; ++i )
+                    encode(i, tos);
+            });
+        }
+
+        for( size_t t = 0; t < nthreads; ++t )
+        {
+            threads[t].join();
+            os.write(buffers[t].data(), buffers[t].size());
+            buffers[t].clear();
+        }
+        threads.clear();
+    }
+}
+
+// write footer, keeps old compact form if no extension is used
+inline void write_footer( utils::OStreamProxy &os, size_t nbuckets, uint32_t key_bits_store, FooterExt const &ext )
+{
+    // store only N from: buckets = 2 ** (N - 1)
+    uint8_t n = nbuckets ? utils::maxbits(nbuckets) - 1 : 0;
+    bool const has_ext = ext.flags != 0;
+
+    if( has_ext )
+    {
+        os << ext << uint16_t(sizeof(ext));
+        n |= FOOTER_HAS_EXT;
+    }
+
+    if( key_bits_store || has_ext )
+    {
+        os << uint8_t(key_bits_store);
+        n |= FOOTER_HAS_KEY_BITS;
+    }
+
+    os << n;
+}
+
+inline uint64_t align_tiny( uint64_t sz )
+{
+    return (sz + TINY_DIR_ALIGN - 1) & ~uint64_t(TINY_DIR_ALIGN - 1);
+}
+
+/* check if all buckets could be addressed by BucketEntryTiny,
+ * bucket_size(i) returns pair of bucket records count and bytes size
+ */
+template<typename BucketSize>
+inline bool fits_tiny_directory( size_t nbuckets, BucketSize const &bucket_size )
+{
+    uint64_t offs = nbuckets * sizeof(BucketEntryTiny);
+    for( size_t i = 0; i < nbuckets; ++i )
+    {
+        auto const bs = bucket_size(i);
+        if( bs.first > TINY_DIR_MAX_KEYS || offs / TINY_DIR_ALIGN > TINY_DIR_MAX_OFFSET )
+            return false;
+        offs += align_tiny(bs.second);
+    }
+    return true;
+}
+
+// resolved directory format of the map being written
+struct DirectoryPlan
+{
+    DirectoryFormat     format;     // never AUTO
+    EliasFanoParams     ef;
+    BucketFilterParams  filter;     // set by indexer, written after buckets
+
+    bool is_tiny() const { return DIRECTORY_FORMAT_TINY == format; }
+
+    // bucket bytes including padding
+    uint64_t get_bucket_size( uint64_t sz ) const { return is_tiny() ? align_tiny(sz) : sz; }
+
+    size_t get_size( size_t nbuckets ) const
+    {
+        switch( format )
+        {
+            case DIRECTORY_FORMAT_TINY:         return nbuckets * sizeof(BucketEntryTiny);
+            case DIRECTORY_FORMAT_ELIAS_FANO:   return ef.get_size(nbuckets);
+            default:                            return nbuckets * sizeof(BucketEntry);
+        }
+    }
+
+    void fill_ext( FooterExt &ext ) const
+    {
+        if( filter )
+        {
+            ext.flags |= FOOTER_FLAG_BUCKET_FILTER;
+            ext.filter_words = filter.words;
+            ext.filter_probes = filter.probes;
+        }
+        if( is_tiny() )
+            ext.flags |= FOOTER_FLAG_TINY_DIRECTORY;
+        else if( DIRECTORY_FORMAT_ELIAS_FANO == format )
+        {
+            ext.flags |= FOOTER_FLAG_EF_DIRECTORY;
+            ext.dir_low_bits = ef.low_bits;
+            ext.dir_nkeys_bits = ef.nkeys_bits;
+            ext.dir_upper_words = ef.upper_words;
+        }
+    }
+};
+
+template<typename BucketSize>
+inline DirectoryPlan plan_directory( DirectoryFormat format, size_t nbuckets, BucketSize const &bucket_size )
+{
+    DirectoryPlan plan = { DIRECTORY_FORMAT_WIDE, {}, {} };
+    if( 0 == nbuckets || DIRECTORY_FORMAT_WIDE == format )
+        return plan;
+
+    if( DIRECTORY_FORMAT_ELIAS_FANO == format )
+    {
+        // offsets are relative to the end of directory
+        uint64_t offs = 0, max_offset = 0;
+        uint32_t max_nkeys = 0;
+        for( size_t i = 0; i < nbuckets; ++i )
+        {
+            auto const bs = bucket_size(i);
+            max_offset = offs;
+            max_nkeys = std::max(max_nkeys, uint32_t(bs.first));
+            offs += bs.second;
+        }
+        plan.format = format;
+        plan.ef = EliasFanoParams::mk(nbuckets, max_offset, max_nkeys);
+        return plan;
+    }
+
+    bool const fits = fits_tiny_directory(nbuckets, bucket_size);
+    if( DIRECTORY_FORMAT_TINY == format && !fits )
+        throw std::runtime_error("[Directory] buckets don't fit into tiny directory limits");
+    if( fits )
+        plan.format = DIRECTORY_FORMAT_TINY;
+    return plan;
+}
+
+// size of directory, buckets and filter
+template<typename BucketSize>
+inline uint64_t get_buckets_area_size( size_t nbuckets, DirectoryPlan const &plan, BucketSize const &bucket_size )
+{
+    uint64_t sz = plan.get_size(nbuckets) + plan.filter.get_size(nbuckets);
+    for( size_t i = 0; i < nbuckets; ++i )
+        sz += plan.get_bucket_size(bucket_size(i).second);
+    return sz;
+}
+
+// write buckets index, offsets are computed from bucket sizes
+template<typename BucketSize>
+inline void write_directory( utils::OStreamProxy &os, size_t nbuckets, DirectoryPlan const &plan, BucketSize const &bucket_size )
+{
+    if( plan.is_tiny() )
+    {
+        BucketEntryTiny be;
+        uint64_t offs = nbuckets * sizeof(BucketEntryTiny);
+        for( size_t i = 0; i < nbuckets; ++i )
+        {
+            auto const bs = bucket_size(i);
+            be.offset = offs / TINY_DIR_ALIGN;
+            be.nkeys = bs.first;
+            os << be;
+            offs += align_tiny(bs.second);
+        }
+        return;
+    }
+
+    if( DIRECTORY_FORMAT_ELIAS_FANO == plan.format )
+    {
+        EliasFanoWriter ef(nbuckets, plan.ef);
+        uint64_t offs = 0;
+        for( size_t i = 0; i < nbuckets; ++i )
+        {
+            auto const bs = bucket_size(i);
+            ef.add(offs, bs.first);
+            offs += bs.second;
+        }
+        ef.write(os);
+        return;
+    }
+
+    BucketEntry be;
+    uint64_t offs = nbuckets * sizeof(BucketEntry);
+    for( size_t i = 0; i < nbuckets; ++i )
+    {
+        auto const bs = bucket_size(i);
+        be.offset = offs;
+        be.nkeys = bs.first;
+        os << be;
+        offs += bs.second;
+    }
+}
+
+// zero padding after bucket of sz bytes, if directory requires it
+inline void write_bucket_padding( utils::OStreamProxy &os, DirectoryPlan const &plan, uint64_t sz )
+{
+    uint64_t const zero = 0;
+    os.write(&zero, plan.get_bucket_size(sz) - sz);
+}
+
+// number of bytes write_footer() stores
+inline size_t get_footer_size( uint32_t key_bits_store, FooterExt const &ext )
+{
+    bool const has_ext = ext.flags != 0;
+    return sizeof(uint8_t)
+         + (key_bits_store || has_ext ? sizeof(uint8_t) : 0)
+         + (has_ext ? sizeof(ext) + sizeof(uint16_t) : 0);
+}
+
+class BucketIndex
+{
+public:
+    /* parse footer of the stream end, return nbuckets,
+     * footer_size(if passed) is set to number of footer bytes
+     */
+    static size_t read_footer( utils::MemoryReader &rdr, uint32_t &key_bits_store, FooterExt &ext, size_t *footer_size = nullptr )
+    {
+        size_t fsize = sizeof(uint8_t);
         // read from footer nbuckets of the stream end
         rdr.seek(rdr.size() - 1);
 
@@ -79,40 +736,117 @@ private:
         
         rdr >> nbucket_p2;
 
+        memset(&ext, 0, sizeof(ext));
 
         uint8_t _key_bits_store;
 
         // detect if higher bit is set then
         // we also need to get previuos byte too
-        if( nbucket_p2 & 0x80 )
+        if( nbucket_p2 & FOOTER_HAS_KEY_BITS )
         {
-            // clear bit
-            nbucket_p2 &= ~0x80;
             rdr.seek_by(-2L);
             rdr >> _key_bits_store;
             key_bits_store = _key_bits_store;
+            fsize += sizeof(uint8_t);
+
+            if( nbucket_p2 & FOOTER_HAS_EXT )
+            {
+                uint16_t ext_size;
+                rdr.seek_by(-1L - long(sizeof(ext_size)));
+                rdr >> ext_size;
+                // newer writer may have longer extension, read only known part
+                rdr.seek_by(-long(sizeof(ext_size)) - long(ext_size));
+                rdr.read(&ext, std::min(size_t(ext_size), sizeof(ext)));
+                fsize += sizeof(ext_size) + ext_size;
+            }
         }
         else
             key_bits_store = 0; // not defined!
 
+        // clear bits
+        nbucket_p2 &= ~(FOOTER_HAS_KEY_BITS | FOOTER_HAS_EXT);
+
         size_t nbuckets = 1UL << nbucket_p2;
 
+        if( footer_size )
+            *footer_size = fsize;
         return nbuckets;
     }
-public:
+
+    // directory bytes, buckets start right after it
+    static size_t get_directory_size( size_t nbuckets, FooterExt const &ext )
+    {
+        if( ext.flags & FOOTER_FLAG_TINY_DIRECTORY )
+            return nbuckets * sizeof(BucketEntryTiny);
+        if( ext.flags & FOOTER_FLAG_EF_DIRECTORY )
+            return get_ef_params(ext).get_size(nbuckets);
+        return nbuckets * sizeof(BucketEntry);
+    }
+
+    static EliasFanoParams get_ef_params( FooterExt const &ext )
+    {
+        EliasFanoParams const params = { ext.dir_low_bits, ext.dir_nkeys_bits, ext.dir_upper_words };
+        return params;
+    }
+
+    static BucketFilterParams get_filter_params( FooterExt const &ext )
+    {
+        BucketFilterParams params = { 0, 0 };
+        if( ext.flags & FOOTER_FLAG_BUCKET_FILTER )
+            params = BucketFilterParams{ ext.filter_words, ext.filter_probes };
+        return params;
+    }
+
     /*
         init from istream
      */
     BucketIndex( utils::MemoryReader rdr )
-        : nbuckets_(read_nbuckets(rdr, key_bits_store_))
+        : nbuckets_(read_footer(rdr, key_bits_store_, ext_, &footer_size_))
         , data_(rdr.get_ownership())
     {
         dstart_ = data_.get_ptr<uint8_t const>();
+        // filter is stored right before the footer
+        BucketFilterParams const fp = get_filter_params(ext_);
+        if( fp )
+            filter_ = BucketFilter(dstart_ + data_.get_mem_size() - footer_size_ - fp.get_size(nbuckets_), fp);
+        format_ = DIRECTORY_FORMAT_WIDE;
+        ef_buckets_ = 0;
+        // empty map is footer only(nbuckets is never 1 otherwise),
+        // use directory of one empty bucket for it
+        if( 1 == nbuckets_ )
+        {
+            static BucketEntry const empty_directory[1] = {};
+            dstart_ = reinterpret_cast<uint8_t const*>(empty_directory);
+        }
+        else if( ext_.flags & FOOTER_FLAG_TINY_DIRECTORY )
+            format_ = DIRECTORY_FORMAT_TINY;
+        else if( ext_.flags & FOOTER_FLAG_EF_DIRECTORY )
+        {
+            format_ = DIRECTORY_FORMAT_ELIAS_FANO;
+            ef_ = EliasFanoDirectory(dstart_, nbuckets_, get_ef_params(ext_));
+            ef_buckets_ = get_directory_size(nbuckets_, ext_);
+        }
     }
     
     size_t get_mask() const { return nbuckets_ - 1; }
     size_t get_nbuckets() const { return nbuckets_; }
     size_t get_key_bits_store() const { return key_bits_store_; }
+    uint32_t get_flags() const { return ext_.flags; }
+    FooterExt const& get_ext() const { return ext_; }
+
+    // false if key k is surely not stored in bucket i, true if map has no filter
+    template<typename Key>
+    bool may_contain( size_t i, Key k ) const
+    {
+        return !filter_ || filter_.may_contain(i, k);
+    }
+
+    template<typename Key>
+    void prefetch_filter( size_t i, Key k ) const
+    {
+        if( filter_ )
+            filter_.prefetch(i, k);
+    }
     
     // return number of records!
     size_t size() const
@@ -120,9 +854,8 @@ public:
         if( nbuckets_ )
         {
             size_t nrec = 0;
-            auto const *be = get_entries();
             for( size_t i = 0; i < nbuckets_; ++i )
-               nrec += be[i].nkeys;
+               nrec += get(i).nkeys;
             return nrec;
         }
         return 0;
@@ -137,18 +870,54 @@ public:
     {
         return reinterpret_cast<BucketEntry const *>(get_data_start());
     }
+
+    BucketEntryTiny const *get_tiny_entries() const
+    {
+        return reinterpret_cast<BucketEntryTiny const *>(get_data_start());
+    }
+
+    DirectoryFormat get_directory_format() const { return format_; }
     
-    // return bucket entry[offset, nkeys] by bucket index
+    // return bucket entry[offset, nkeys] by bucket index, for any directory format
     BucketEntry get(size_t i) const
     {
         assert( i < nbuckets_ );
-        return get_entries()[i];
+        BucketEntry be;
+        switch( format_ )
+        {
+            case DIRECTORY_FORMAT_TINY:
+            {
+                BucketEntryTiny const te = get_tiny_entries()[i];
+                be.offset = uint64_t(te.offset) * TINY_DIR_ALIGN;
+                be.nkeys = te.nkeys;
+                return be;
+            }
+            case DIRECTORY_FORMAT_ELIAS_FANO:
+            {
+                auto const e = ef_.get(i);
+                be.offset = ef_buckets_ + e.first;
+                be.nkeys = e.second;
+                return be;
+            }
+            default:
+                return get_entries()[i];
+        }
+    }
+
+    // hint CPU to bring bucket entry into cache, used for batched lookups
+    void prefetch( size_t i ) const
+    {
+        switch( format_ )
+        {
+            case DIRECTORY_FORMAT_TINY:         __builtin_prefetch(get_tiny_entries() + i); break;
+            case DIRECTORY_FORMAT_ELIAS_FANO:   ef_.prefetch(i); break;
+            default:                            __builtin_prefetch(get_entries() + i); break;
+        }
     }
 
     std::pair<uint8_t const*, uint32_t> get_unpacked(size_t i) const
     {
-        assert( i < nbuckets_ );
-        BucketEntry be = get_entries()[i];
+        BucketEntry const be = get(i);
         return std::make_pair(dstart_ + be.offset, uint32_t(be.nkeys));
     }
     
@@ -165,14 +934,21 @@ public:
 public:
     static size_t get_kcompressed_size( uint32_t nrecords, uint32_t key_bits_store )
     {
-        size_t total_bits = nrecords * key_bits_store;
-        return ((total_bits - 1) / 64 + 1) * 8;
+        size_t total_bits = size_t(nrecords) * key_bits_store;
+        return total_bits ? ((total_bits - 1) / 64 + 1) * 8 : 0;
     }
 private:
     uint8_t const           *dstart_;
+    DirectoryFormat         format_;
     size_t const            nbuckets_;
     uint32_t                key_bits_store_;
+    FooterExt               ext_;
+    size_t                  footer_size_;
     utils::MemoryHolder     data_;
+    EliasFanoDirectory      ef_;
+    // buckets start after Elias-Fano directory
+    size_t                  ef_buckets_;
+    BucketFilter            filter_;
 };
 
 } // namespace detail